@@ -0,0 +1,84 @@
+#!/usr/bin/env bash
+# Runs the server once per HTTP backend under the same load and prints the
+# throughput, latency, memory and system calls of each run side by side.
+#
+#   ./bench_backends.sh </GLOBAL/PATH/TO/SSL/KEYS> [extra server flags]
+#
+# Needs wrk and, for the system call count, strace. Settings:
+#   SERVER       server binary, ./RestaurantBES by default
+#   PORT         port of the runs, 8443 by default
+#   CONNECTIONS  open connections, 1000 by default
+#   THREADS      wrk threads, 4 by default
+#   DURATION     length of every run, 30s by default
+#   RESOURCE     resource under load, /menu by default
+
+set -eu
+
+if [ $# -lt 1 ]; then
+    sed -n '5p' "$0" | cut -c3-
+    exit 1
+fi
+
+SSL_KEYS=$1
+shift
+SERVER=${SERVER:-./RestaurantBES}
+PORT=${PORT:-8443}
+CONNECTIONS=${CONNECTIONS:-1000}
+THREADS=${THREADS:-4}
+DURATION=${DURATION:-30s}
+RESOURCE=${RESOURCE:-/menu}
+URL="https://localhost:${PORT}${RESOURCE}"
+
+results=()
+
+run() {
+    local backend=$1
+    shift
+    "$SERVER" --port "$PORT" --SSLkeys "$SSL_KEYS" --backend "$backend" "$@" \
+        >"bench_${backend}.log" 2>&1 &
+    local pid=$!
+    trap 'kill "$pid" 2>/dev/null || true' EXIT
+
+    for _ in $(seq 50); do
+        curl -sk -o /dev/null "$URL" && break
+        sleep 0.2
+    done
+
+    local strace_pid=""
+    if command -v strace >/dev/null; then
+        strace -c -f -p "$pid" -o "bench_${backend}.strace" 2>/dev/null &
+        strace_pid=$!
+    fi
+
+    wrk -t "$THREADS" -c "$CONNECTIONS" -d "$DURATION" --latency "$URL" \
+        >"bench_${backend}.wrk"
+    local rss
+    rss=$(awk '/VmHWM/ {print $2 " " $3}' "/proc/$pid/status")
+
+    if [ -n "$strace_pid" ]; then
+        kill -INT "$strace_pid" 2>/dev/null || true
+        wait "$strace_pid" 2>/dev/null || true
+    fi
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+    trap - EXIT
+
+    local requests p50 p99 syscalls="-"
+    requests=$(awk '/Requests\/sec/ {print $2}' "bench_${backend}.wrk")
+    p50=$(awk '$1 == "50%" {print $2}' "bench_${backend}.wrk")
+    p99=$(awk '$1 == "99%" {print $2}' "bench_${backend}.wrk")
+    if [ -f "bench_${backend}.strace" ]; then
+        syscalls=$(awk '$NF == "total" {print $4}' \
+            "bench_${backend}.strace")
+    fi
+    results+=("$(printf '%-8s %12s %10s %10s %12s %12s' "$backend" \
+        "$requests" "$p50" "$p99" "$rss" "$syscalls")")
+}
+
+run restbed "$@"
+run asio "$@"
+
+printf '%-8s %12s %10s %10s %12s %12s\n' backend requests/s p50 p99 \
+    "peak RSS" syscalls
+printf '%s\n' "${results[@]}"
+echo "Full reports: bench_<backend>.wrk, bench_<backend>.strace"
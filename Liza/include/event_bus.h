@@ -0,0 +1,33 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+namespace pqxx {
+class transaction_base;
+}  // namespace pqxx
+
+namespace restbes {
+
+// Events shared by the server nodes through Postgres NOTIFY on one channel.
+// An event is a short string, e.g. "order:42", "cart:7" or "menu"; the
+// receiving node reads the rest from the database
+using EventHandler = std::function<void(const std::string &event)>;
+
+// Names this node in the events it publishes, so it can skip its own. Must
+// be called before the worker processes are forked, so they share it
+void setEventNode(const std::string &node);
+
+// Publishes the event from the transaction that makes the change it
+// describes: Postgres delivers it on commit, and never if the transaction is
+// rolled back. Does nothing until the node is named
+void publishEvent(pqxx::transaction_base &transaction,
+                  const std::string &event);
+
+// Listens on a dedicated connection, reconnecting when it is lost, and passes
+// the events of the other nodes to handler. Events published while the
+// connection was down never arrive, so resync runs after every reconnect.
+// One listener per node is enough
+void startEventListener(EventHandler handler, std::function<void()> resync);
+
+}  // namespace restbes
@@ -3,6 +3,7 @@
 #include <ctime>
 #include <fstream>
 #include <iomanip>
+#include <memory>
 #include <string>
 #include <vector>
 #include "folly/dynamic.h"
@@ -41,8 +42,14 @@ std::time_t getTime();
 
 void connectExec(const std::string &sql);
 
+// Runs the statements in one transaction that also publishes the event, see
+// event_bus.h
+void connectExec(const std::string &sql, const std::string &event);
+
 std::string connectGet(const std::string &sql);
 
 pqxx::result connectGet_pqxx_result(const std::string &sql);
 
+std::unique_ptr<pqxx::connection> connectDatabase();
+
 }  // namespace restbes
@@ -7,44 +7,71 @@ using restbes::Server;
 namespace restbes {
 std::shared_ptr<Server> &getServer();
 
-void getMenuHandler(const std::shared_ptr<restbed::Session> &session,
+void getMenuHandler(const SharedHttpSession &session,
                     const std::shared_ptr<Server> &server);
 
-void getOrderHandler(const std::shared_ptr<restbed::Session> &session,
+void getOrderHandler(const SharedHttpSession &session,
                      const std::shared_ptr<Server> &server);
 
-void getCartHandler(const std::shared_ptr<restbed::Session> &session,
+void getCartHandler(const SharedHttpSession &session,
                     const std::shared_ptr<Server> &server);
 
-void postAuthorizationMethodHandler(
-    const std::shared_ptr<restbed::Session> &session,
-    const std::string &data,
-    const std::shared_ptr<Server> &server);
+task<void> postAuthorizationMethodHandler(RequestContext &context);
 
-void postCartMethodHandler(const std::shared_ptr<restbed::Session> &session,
+void postCartMethodHandler(const SharedHttpSession &session,
                            const std::string &data,
                            const std::shared_ptr<Server> &server);
 
-void postOrderMethodHandler(const std::shared_ptr<restbed::Session> &session,
+void postOrderMethodHandler(const SharedHttpSession &session,
                             const std::string &data,
                             const std::shared_ptr<Server> &server);
 
-void pollingHandler(const std::shared_ptr<restbed::Session>& session,
+void pollingHandler(const SharedHttpSession& session,
                     const std::shared_ptr<Server>& server);
 
+void webSocketMessageHandler(const std::shared_ptr<Session> &session,
+                             const std::string &data,
+                             const std::shared_ptr<Server> &server);
+
 void errorHandler(const int code,
                   const std::exception &exception,
-                  const std::shared_ptr<restbed::Session>& session,
+                  const SharedHttpSession& session,
                   const std::shared_ptr<Server>& server);
 
 void handleInactiveSessions(const std::shared_ptr<Server>& server);
 
-void cleanUpUserSessions(const std::shared_ptr<Server>& server);
+void reportDroppedNotifications(const std::shared_ptr<Server>& server);
+
+void reportDroppedPeerMessages(const std::shared_ptr<Server>& server);
+
+void reportShedRequests(const std::shared_ptr<Server>& server);
+
+void reportBroadcast(const restbes::Notification &notification,
+                     std::size_t recipients,
+                     std::chrono::microseconds latency);
+
+// Keeps the caches of this worker in sync with changes made in the others
+void applyPeerBroadcast(const restbes::Notification &notification);
+
+void sendHeartbeats(const std::shared_ptr<Server>& server);
+
+void flushNotifications(const std::shared_ptr<Server>& server);
+
+// Largest cart, order or menu in bytes that is sent inside its notification,
+// 0 to send only ids
+void setInlinePayloadLimit(std::size_t bytes);
 
 void notifySessionsMenuChanged();
 
 void notifySessionsOrderChanged(const std::string &order_id);
 
+// Pushes a change made on another server node to the local sessions
+void applyNodeEvent(const std::string &event);
+
+// Asks every client of the node to refetch after events of the other nodes
+// may have been missed
+void resyncNodeEvents();
+
 std::string show_menu();
 
 }  // namespace restbes
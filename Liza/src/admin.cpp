@@ -43,10 +43,11 @@ bool check_order_exists(const std::string &order_id) {
 void change_order_status(const std::string &order_id,
                          const std::string &set_status) {
     connectExec(R"(UPDATE "ORDER" SET "STATUS" = )" + set_status +
-                " WHERE \"ORDER_ID\"=" + order_id);
-    connectExec(R"(UPDATE "ORDER" SET "LAST_MODIFIED" = ')" +
-                std::to_string(restbes::getTime()) +
-                "' WHERE \"ORDER_ID\"=" + order_id);
+                    " WHERE \"ORDER_ID\"=" + order_id +
+                    R"(; UPDATE "ORDER" SET "LAST_MODIFIED" = ')" +
+                    std::to_string(restbes::getTime()) +
+                    "' WHERE \"ORDER_ID\"=" + order_id,
+                "order:" + order_id);
 
     restbes::notifySessionsOrderChanged(order_id);
 }
@@ -54,9 +55,10 @@ void change_order_status(const std::string &order_id,
 void change_dish_status(const std::string &dish_id,
                         const std::string &set_status) {
     connectExec(R"(UPDATE "DISH" SET "STATUS" = )" + set_status +
-                " WHERE \"DISH_ID\"=" + dish_id);
-    connectExec(R"(UPDATE "MENU_HISTORY" SET "TIMESTAMP" = ')" +
-                std::to_string(restbes::getTime()) + "'");
+                    " WHERE \"DISH_ID\"=" + dish_id +
+                    R"(; UPDATE "MENU_HISTORY" SET "TIMESTAMP" = ')" +
+                    std::to_string(restbes::getTime()) + "'",
+                "menu");
 
     restbes::notifySessionsMenuChanged();
 }
@@ -68,6 +70,10 @@ std::string add_new_dish(const std::string &dish_name,
         R"(INSERT INTO "DISH" ("DISH_NAME", "PRICE", "IMAGE", "STATUS") VALUES (')" +
         dish_name + "', " + dish_price + ", '" + image_url +
         "', 1) RETURNING \"DISH_ID\"");
+    // Clients see the new dish by the menu timestamp
+    connectExec(R"(UPDATE "MENU_HISTORY" SET "TIMESTAMP" = ')" +
+                    std::to_string(restbes::getTime()) + "'",
+                "menu");
 
     restbes::notifySessionsMenuChanged();
 
@@ -77,9 +83,10 @@ std::string add_new_dish(const std::string &dish_name,
 void change_dish_price(const std::string &dish_id,
                        const std::string &set_price) {
     connectExec(R"(UPDATE "DISH" SET "PRICE" = )" + set_price +
-                " WHERE \"DISH_ID\"= '" + dish_id + "'");
-    connectExec(R"(UPDATE "MENU_HISTORY" SET "TIMESTAMP" = ')" +
-                std::to_string(restbes::getTime()) + "'");
+                    " WHERE \"DISH_ID\"= '" + dish_id +
+                    R"('; UPDATE "MENU_HISTORY" SET "TIMESTAMP" = ')" +
+                    std::to_string(restbes::getTime()) + "'",
+                "menu");
 
     restbes::notifySessionsMenuChanged();
 }
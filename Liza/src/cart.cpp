@@ -30,12 +30,13 @@ void set_cart(const std::string &client_id,
               const std::string &cart,
               int cart_cost) {
     connectExec(R"(UPDATE "CART" SET "CART" = ')" + cart +
-                R"(' WHERE "CLIENT_ID" = )" + client_id);
-    connectExec(R"(UPDATE "CART" SET "COST" = )" + std::to_string(cart_cost) +
-                R"( WHERE "CLIENT_ID" = )" + client_id);
-    connectExec(R"(UPDATE "CART" SET "TIMESTAMP" = )" +
-                std::to_string(restbes::getTime()) +
-                R"( WHERE "CLIENT_ID" = )" + client_id);
+                    R"(' WHERE "CLIENT_ID" = )" + client_id +
+                    R"(; UPDATE "CART" SET "COST" = )" +
+                    std::to_string(cart_cost) + R"( WHERE "CLIENT_ID" = )" +
+                    client_id + R"(; UPDATE "CART" SET "TIMESTAMP" = )" +
+                    std::to_string(restbes::getTime()) +
+                    R"( WHERE "CLIENT_ID" = )" + client_id,
+                "cart:" + client_id);
 }
 
 void set_item_count(const std::string &client_id, int dish_id, int count) {
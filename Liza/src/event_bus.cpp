@@ -0,0 +1,77 @@
+#include "event_bus.h"
+#include "../include/fwd.h"
+
+#include <chrono>
+#include <thread>
+
+namespace restbes {
+
+namespace {
+
+const std::string EVENT_CHANNEL = "restbes_events";
+
+std::string &eventNode() {
+    static std::string node;
+    return node;
+}
+
+// Payload is "<node> <event>"
+struct EventReceiver : pqxx::notification_receiver {
+    EventHandler handler;
+
+    EventReceiver(pqxx::connection &connection, EventHandler handler)
+        : pqxx::notification_receiver(connection, EVENT_CHANNEL),
+          handler(std::move(handler)) {
+    }
+
+    void operator()(const std::string &payload, int) override {
+        auto separator = payload.find(' ');
+        if (separator == std::string::npos ||
+            payload.compare(0, separator, eventNode()) == 0)
+            return;
+        try {
+            handler(payload.substr(separator + 1));
+        } catch (const std::exception &e) {
+            server_error_log << "Failed to apply event " << payload << ": "
+                             << e.what() << std::endl;
+        }
+    }
+};
+
+}  // namespace
+
+void setEventNode(const std::string &node) {
+    eventNode() = node;
+}
+
+void publishEvent(pqxx::transaction_base &transaction,
+                  const std::string &event) {
+    if (eventNode().empty()) return;
+    transaction.exec("SELECT pg_notify(" + transaction.quote(EVENT_CHANNEL) +
+                     ", " + transaction.quote(eventNode() + " " + event) + ")");
+}
+
+void startEventListener(EventHandler handler, std::function<void()> resync) {
+    std::thread([handler = std::move(handler), resync = std::move(resync)]() {
+        bool reconnecting = false;
+        while (true) {
+            try {
+                auto connection = connectDatabase();
+                EventReceiver receiver(*connection, handler);
+                // Listening again, whatever was missed is refetched once
+                if (reconnecting) {
+                    resync();
+                    reconnecting = false;
+                }
+                while (true) connection->await_notification();
+            } catch (const std::exception &e) {
+                reconnecting = true;
+                server_error_log << "Event listener disconnected: "
+                                 << e.what() << std::endl;
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }).detach();
+}
+
+}  // namespace restbes
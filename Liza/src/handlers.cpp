@@ -1,6 +1,7 @@
 #include "handlers.h"
-#include "../../Liza/include/fwd.h"
+#include "../include/fwd.h"
 #include "client.h"
+#include "compression.h"
 #include "order.h"
 #include "session.h"
 #include "user.h"
@@ -8,12 +9,17 @@
 using folly::dynamic;
 using folly::parseJson;
 using nlohmann::json;
+using restbes::CompressedBody;
 using restbes::Connection;
 using restbes::generateResponse;
+using restbes::generateSerializedResponse;
 using restbes::Server;
 using restbes::server_error_log;
 using restbes::server_request_log;
+using restbes::RequestContext;
 using restbes::Session;
+using restbes::SessionId;
+using restbes::task;
 
 namespace restbes {
 
@@ -22,25 +28,66 @@ std::shared_ptr<Server> &getServer() {
     return server;
 }
 
-void addUserToServer(const std::shared_ptr<Server> &server,
-                     const std::shared_ptr<Session> &receivingSession,
-                     const std::string &user_id,
-                     unsigned int &session_id) {
-    Server::addUser(user_id, server);
-    if (receivingSession->getUserId().empty())
+const restbes::SerializedResponse &checkConnectionResponse() {
+    static const auto response = generateSerializedResponse(
+        "Check your connection", "text/plain", Connection::CLOSE);
+    return *response;
+}
+
+const restbes::SerializedResponse &errorResponse() {
+    static const auto response =
+        generateSerializedResponse("ERROR", "text/plain", Connection::CLOSE);
+    return *response;
+}
+
+struct MenuCache {
+    unsigned int version = 0;
+    std::shared_ptr<const CompressedBody> body;
+};
+
+folly::Synchronized<MenuCache> &getMenuCache() {
+    static folly::Synchronized<MenuCache> menu;
+    return menu;
+}
+
+std::shared_ptr<User> addUserToServer(
+    const std::shared_ptr<Server> &server,
+    const std::shared_ptr<Session> &receivingSession,
+    const std::string &user_id,
+    SessionId &session_id) {
+    auto user = Server::getOrCreateUser(user_id, server);
+    // Sessions of the other workers are assigned by their worker
+    if (receivingSession == nullptr || receivingSession->getUserId().empty())
         server->assignSession(session_id, user_id);
+    return user;
 }
 
-void sendResponse(const std::shared_ptr<restbed::Session> &session,
+void sendResponse(const SharedHttpSession &session,
+                  const std::shared_ptr<Server> &server,
                   const dynamic &responseJson) {
-    session->close(*generateResponse(folly::toJson(responseJson),
-                                     "application/json", Connection::CLOSE));
+    respond(session, *server, folly::toJson(responseJson), "application/json");
+}
+
+// Pending notifications about the same cart or order are coalesced: the
+// client refetches the whole object anyway
+std::string coalescingKey(const dynamic &notificationJson) {
+    const auto &event = notificationJson["event"].asString();
+    if (event == "cart_changed") return "cart";
+    if (event == "order_changed")
+        return "order:" +
+               notificationJson["body"]["order_id"].asString();
+    return "";
 }
 
-void sendNotification(const std::shared_ptr<User> &user,
-                      const dynamic &notificationJson) {
-    user->push(generateResponse(folly::toJson(notificationJson),
-                                "application/json", Connection::KEEP_ALIVE));
+void sendNotification(const std::string &user_id,
+                      const dynamic &notificationJson,
+                      SessionId origin_session_id = 0) {
+    getServer()->pushToUser(
+        user_id,
+        restbes::makeNotification(notificationJson["event"].asString(),
+                                  folly::toJson(notificationJson),
+                                  coalescingKey(notificationJson)),
+        origin_session_id);
 }
 
 void parseInsertOrders(dynamic &responseJson, const std::string &user_id) {
@@ -63,14 +110,94 @@ void parseInsertOrders(dynamic &responseJson, const std::string &user_id) {
     }
 }
 
+dynamic cartBody(const std::string &user_id) {
+    dynamic body = dynamic::object;
+    body["item"] = "cart";
+    body["timestamp"] = restbesCart::get_cart_timestamp(user_id);
+    body["contents"] = dynamic::array;
+
+    auto contents = json::parse(restbesCart::get_cart(user_id));
+    for (auto &el : contents) {
+        dynamic item = dynamic::object("dish_id", el.at("dish_id").get<int>())(
+            "count", el.at("count").get<int>());
+        body["contents"].push_back(item);
+    }
+    return body;
+}
+
+dynamic orderBody(const std::string &order_id) {
+    dynamic body = dynamic::object;
+    body["item"] = "order";
+    body["order_id"] = std::stoi(order_id);
+    body["timestamp"] = restbesOrder::get_order_timestamp(order_id);
+    body["last_modified"] = restbesOrder::get_order_last_modified(order_id);
+    body["cost"] = restbesOrder::get_order_cost(order_id);
+    body["status"] = restbesOrder::get_order_status(order_id);
+    body["address"] = restbesOrder::get_order_address(order_id);
+    body["comment"] = restbesOrder::get_order_comment(order_id);
+    body["cart"] = dynamic::object;
+    body["cart"]["item"] = "cart";
+    body["cart"]["contents"] = dynamic::array;
+
+    auto contents = json::parse(restbesOrder::get_order_items(order_id));
+    for (auto &el : contents) {
+        dynamic item = dynamic::object("dish_id", el.at("dish_id").get<int>())(
+            "count", el.at("count").get<int>());
+        body["cart"]["contents"].push_back(item);
+    }
+    return body;
+}
+
+dynamic menuBody() {
+    std::string sqlRequest = R"(SELECT * FROM "DISH" WHERE "STATUS" = 1)";
+    pqxx::result result = connectGet_pqxx_result(sqlRequest);
+
+    dynamic body = dynamic::object;
+    body["item"] = "menu";
+    body["timestamp"] =
+        std::stoi(connectGet(R"(SELECT "TIMESTAMP" FROM "MENU_HISTORY")"));
+    body["contents"] = dynamic::array;
+
+    for (auto row : result) {
+        dynamic item = dynamic::object;
+        item["item"] = "dish";
+        item["dish_id"] = row[0].as<int>();
+        item["name"] = row[1].as<std::string>();
+        item["image"] = row[2].as<std::string>();
+        item["price"] = row[3].as<int>();
+        item["status"] = row[4].as<int>();
+        body["contents"].push_back(item);
+    }
+    return body;
+}
+
+std::atomic<std::size_t> &inlinePayloadLimit() {
+    static std::atomic<std::size_t> limit{0};
+    return limit;
+}
+
+// Embeds the changed object into the notification if it fits the limit, so
+// that the client doesn't have to request it
+void inlinePayload(dynamic &notificationJson,
+                   const std::string &field,
+                   const dynamic &payload) {
+    if (folly::toJson(payload).size() > inlinePayloadLimit()) return;
+    if (notificationJson.count("body") == 0)
+        notificationJson["body"] = dynamic::object;
+    notificationJson["body"][field] = payload;
+}
+
 dynamic cartChangedResponse() {
     return dynamic::object("status_code", 0)("query", "cart_changed")(
         "timestamp", restbes::getTime());
 }
 
 dynamic cartChangedNotification(const std::string &user_id) {
-    return dynamic::object("event", "cart_changed")(
+    dynamic notificationJson = dynamic::object("event", "cart_changed")(
         "timestamp", restbesCart::get_cart_timestamp(user_id));
+    if (inlinePayloadLimit() != 0)
+        inlinePayload(notificationJson, "cart", cartBody(user_id));
+    return notificationJson;
 }
 
 dynamic orderChangedResponse() {
@@ -79,9 +206,18 @@ dynamic orderChangedResponse() {
 }
 
 dynamic orderChangedNotification(const std::string &order_id) {
-    return dynamic::object("event", "order_changed")(
+    dynamic notificationJson = dynamic::object("event", "order_changed")(
         "timestamp", restbesOrder::get_order_last_modified(order_id))(
         "body", dynamic::object("order_id", std::stoi(order_id)));
+    if (inlinePayloadLimit() != 0)
+        inlinePayload(notificationJson, "order", orderBody(order_id));
+    return notificationJson;
+}
+
+void notifySessionsCartChanged(const std::string &user_id,
+                               SessionId origin_session_id) {
+    sendNotification(user_id, cartChangedNotification(user_id),
+                     origin_session_id);
 }
 
 void formErrorResponseAuthentication(dynamic &responseJson,
@@ -114,23 +250,23 @@ void setUsersInfoInResponse(dynamic &responseJson,
     responseJson["body"]["orders"] = dynamic::array;
 }
 
-void postAuthorizationMethodHandler(
-    const std::shared_ptr<restbed::Session> &session,
-    const std::string &data,
-    const std::shared_ptr<Server> &server) {
-    auto request = session->get_request();
+// Every database call runs on the blocking pool, the handler thread serves
+// other requests meanwhile
+task<void> postAuthorizationMethodHandler(RequestContext &context) {
+    const auto &session = context.getSession();
+    const auto &server = context.getServer();
+    auto request = context.getRequest();
 
     std::string user_id = request->get_header("User-ID", "");
-    unsigned int session_id = request->get_header("Session-ID", 0);
+    SessionId session_id = request->get_header("Session-ID", SessionId(0));
     auto receivingSession = server->getSession(session_id);
 
-    if (receivingSession == nullptr) {
-        session->close(*generateResponse("Check your connection", "text/plain",
-                                         Connection::CLOSE));
-        return;
+    if (!server->hasSession(session_id)) {
+        session->close(checkConnectionResponse().getBytes());
+        co_return;
     }
 
-    auto values = json::parse(data);
+    auto values = json::parse(context.getBody());
     std::string command = values.at("query").get<std::string>();
     std::string user_email = values.at("body").at("email").get<std::string>();
     std::string password = values.at("body").at("password").get<std::string>();
@@ -139,120 +275,121 @@ void postAuthorizationMethodHandler(
         "body", dynamic::object("item", "user"))("query", command);
 
     if (command == "sign_in") {
-        if (restbesClient::check_sign_in(user_email, password)) {
-            user_id = restbesClient::get_client_id_by_email(user_email);
-            std::string user_name = restbesClient::get_client_name(user_id);
+        bool signedIn = co_await context.blocking([&] {
+            return restbesClient::check_sign_in(user_email, password);
+        });
+        if (signedIn) {
+            user_id = co_await context.blocking([&] {
+                return restbesClient::get_client_id_by_email(user_email);
+            });
+            std::string user_name = co_await context.blocking(
+                [&] { return restbesClient::get_client_name(user_id); });
 
             addUserToServer(server, receivingSession, user_id, session_id);
-            auto user = server->getUser(user_id);
 
             setUsersInfoInResponse(responseJson, user_id, user_name,
                                    user_email);
 
-            parseInsertOrders(responseJson, user_id);
+            co_await context.blocking(
+                [&] { parseInsertOrders(responseJson, user_id); });
 
-            sendResponse(session, responseJson);
+            sendResponse(session, server, responseJson);
 
             if (values.at("body").at("update_cart").get<bool>()) {
                 std::string new_cart =
                     values.at("body").at("cart").get<json>().dump();
-                restbesCart::set_cart(user_id, new_cart,
-                                      restbesCart::cart_cost(new_cart));
+                co_await context.blocking([&] {
+                    restbesCart::set_cart(user_id, new_cart,
+                                          restbesCart::cart_cost(new_cart));
+                });
 
-                dynamic notificationJson = cartChangedNotification(user_id);
-                sendNotification(user, notificationJson);
+                notifySessionsCartChanged(user_id, session_id);
             }
 
         } else {
             formErrorResponseAuthentication(responseJson, user_email);
-            sendResponse(session, responseJson);
+            sendResponse(session, server, responseJson);
         }
 
     } else if (command == "sign_up") {
         std::string user_name = values.at("body").at("name").get<std::string>();
         std::string user_cart = "{}";
 
-        if (restbesClient::check_user_exists(user_email)) {
+        bool exists = co_await context.blocking(
+            [&] { return restbesClient::check_user_exists(user_email); });
+        if (exists) {
             formErrorResponseAuthorization(responseJson);
-            sendResponse(session, responseJson);
+            sendResponse(session, server, responseJson);
 
         } else {
             if (values.at("body").at("update_cart").get<bool>()) {
                 user_cart = values.at("body").at("cart").get<json>().dump();
             }
 
-            restbesClient::Client client(user_name, user_email, password,
-                                         user_cart);
-            user_id = client.get_client_id();
+            user_id = co_await context.blocking([&] {
+                restbesClient::Client client(user_name, user_email, password,
+                                             user_cart);
+                return client.get_client_id();
+            });
 
             addUserToServer(server, receivingSession, user_id, session_id);
-            auto user = server->getUser(user_id);
 
             setUsersInfoInResponse(responseJson, user_id, user_name,
                                    user_email);
 
-            sendResponse(session, responseJson);
+            sendResponse(session, server, responseJson);
 
             if (values.at("body").at("update_cart").get<bool>()) {
-                dynamic notificationJson = cartChangedNotification(user_id);
-                sendNotification(user, notificationJson);
+                notifySessionsCartChanged(user_id, session_id);
             }
         }
     }
 }
 
-void postCartMethodHandler(const std::shared_ptr<restbed::Session> &session,
-                           const std::string &data,
-                           const std::shared_ptr<Server> &server) {
-    auto request = session->get_request();
-    std::string user_id = request->get_header("User-ID", "");
-    unsigned int session_id = request->get_header("Session-ID", 0);
-    auto receivingSession = server->getSession(session_id);
-    auto user = server->getUser(user_id);
-
-    if (receivingSession == nullptr) {
-        session->close(*generateResponse("Check your connection", "text/plain",
-                                         Connection::CLOSE));
-        return;
-    }
-
-    auto values = json::parse(data);
+bool applyCartCommand(const std::string &user_id, const json &values) {
     std::string command = values.at("query").get<std::string>();
 
-    dynamic responseJson = cartChangedResponse();
-    dynamic notificationJson = cartChangedNotification(user_id);
-
     if (command == "set_item_count") {
         restbesCart::set_item_count(user_id,
                                     values.at("body").at("dish_id").get<int>(),
                                     values.at("body").at("count").get<int>());
-
-        sendResponse(session, responseJson);
-        sendNotification(user, notificationJson);
+        return true;
 
     } else if (command == "set_cart") {
         std::string new_cart = values.at("body").at("cart").get<json>().dump();
 
         restbesCart::set_cart(user_id, new_cart,
                               restbesCart::cart_cost(new_cart));
+        return true;
+    }
+    return false;
+}
 
-        sendResponse(session, responseJson);
-        sendNotification(user, notificationJson);
+void postCartMethodHandler(const SharedHttpSession &session,
+                           const std::string &data,
+                           const std::shared_ptr<Server> &server) {
+    auto request = session->get_request();
+    std::string user_id = request->get_header("User-ID", "");
+    SessionId session_id = request->get_header("Session-ID", SessionId(0));
+    if (!server->hasSession(session_id)) {
+        session->close(checkConnectionResponse().getBytes());
+        return;
+    }
+
+    if (applyCartCommand(user_id, json::parse(data))) {
+        sendResponse(session, server, cartChangedResponse());
+        notifySessionsCartChanged(user_id, session_id);
     }
 }
 
-void postOrderMethodHandler(const std::shared_ptr<restbed::Session> &session,
+void postOrderMethodHandler(const SharedHttpSession &session,
                             const std::string &data,
                             const std::shared_ptr<Server> &server) {
     auto request = session->get_request();
     std::string user_id = request->get_header("User-ID", "");
-    unsigned int session_id = request->get_header("Session-ID", 0);
-    auto receivingSession = server->getSession(session_id);
-    auto user = server->getUser(user_id);
-
-    if (receivingSession == nullptr) {
-        session->close(*generateResponse("Check your connection", "text/plain",
-                                         Connection::CLOSE));
+    SessionId session_id = request->get_header("Session-ID", SessionId(0));
+    if (!server->hasSession(session_id)) {
+        session->close(checkConnectionResponse().getBytes());
         return;
     }
 
@@ -266,17 +403,23 @@ void postOrderMethodHandler(const std::shared_ptr<restbed::Session> &session,
     dynamic responseJson = orderChangedResponse();
     dynamic notificationJson = orderChangedNotification(order_id);
 
-    sendResponse(session, responseJson);
-    sendNotification(user, notificationJson);
+    sendResponse(session, server, responseJson);
+    sendNotification(user_id, notificationJson);
 }
 
-void getMenuHandler(const std::shared_ptr<restbed::Session> &session,
+void getMenuHandler(const SharedHttpSession &session,
                     const std::shared_ptr<Server> &server) {
-    session->close(
-        *generateResponse(show_menu(), "application/json", Connection::CLOSE));
+    auto cache = getMenuCache().copy();
+    if (cache.body == nullptr) {
+        cache.body = std::make_shared<const CompressedBody>(show_menu());
+        auto lockedCache = getMenuCache().wlock();
+        if (lockedCache->version == cache.version)
+            lockedCache->body = cache.body;
+    }
+    respond(session, *server, *cache.body, "application/json");
 }
 
-void getOrderHandler(const std::shared_ptr<restbed::Session> &session,
+void getOrderHandler(const SharedHttpSession &session,
                      const std::shared_ptr<Server> &server) {
     auto request = session->get_request();
     std::string order_id = request->get_header("Order-ID", "");
@@ -284,33 +427,12 @@ void getOrderHandler(const std::shared_ptr<restbed::Session> &session,
     dynamic responseJson = dynamic::object;
     responseJson["query"] = "get_order";
     responseJson["status_code"] = 0;
-    responseJson["body"] = dynamic::object;
-    responseJson["body"]["item"] = "order";
-    responseJson["body"]["order_id"] = std::stoi(order_id);
-    responseJson["body"]["timestamp"] =
-        restbesOrder::get_order_timestamp(order_id);
-    responseJson["body"]["last_modified"] =
-        restbesOrder::get_order_last_modified(order_id);
-    responseJson["body"]["cost"] = restbesOrder::get_order_cost(order_id);
-    responseJson["body"]["status"] = restbesOrder::get_order_status(order_id);
-    responseJson["body"]["address"] = restbesOrder::get_order_address(order_id);
-    responseJson["body"]["comment"] = restbesOrder::get_order_comment(order_id);
-    responseJson["body"]["cart"] = dynamic::object;
-    responseJson["body"]["cart"]["item"] = "cart";
-    responseJson["body"]["cart"]["contents"] = dynamic::array;
-
-    auto contents = json::parse(restbesOrder::get_order_items(order_id));
-    for (auto &el : contents) {
-        dynamic item = dynamic::object("dish_id", el.at("dish_id").get<int>())(
-            "count", el.at("count").get<int>());
-        responseJson["body"]["cart"]["contents"].push_back(item);
-    }
+    responseJson["body"] = orderBody(order_id);
 
-    session->close(*generateResponse(folly::toJson(responseJson),
-                                     "application/json", Connection::CLOSE));
+    sendResponse(session, server, responseJson);
 }
 
-void getCartHandler(const std::shared_ptr<restbed::Session> &session,
+void getCartHandler(const SharedHttpSession &session,
                     const std::shared_ptr<Server> &server) {
     auto request = session->get_request();
     std::string user_id = request->get_header("User-ID", "");
@@ -318,124 +440,224 @@ void getCartHandler(const std::shared_ptr<restbed::Session> &session,
     dynamic responseJson = dynamic::object;
     responseJson["query"] = "get_cart";
     responseJson["status_code"] = 0;
-    responseJson["body"] = dynamic::object;
-    responseJson["body"]["item"] = "cart";
-    responseJson["body"]["timestamp"] =
-        restbesCart::get_cart_timestamp(user_id);
-    responseJson["body"]["contents"] = dynamic::array;
+    responseJson["body"] = cartBody(user_id);
 
-    auto contents = json::parse(restbesCart::get_cart(user_id));
-    for (auto &el : contents) {
-        dynamic item = dynamic::object("dish_id", el.at("dish_id").get<int>())(
-            "count", el.at("count").get<int>());
-        responseJson["body"]["contents"].push_back(item);
-    }
-
-    session->close(*generateResponse(folly::toJson(responseJson),
-                                     "application/json", Connection::CLOSE));
+    sendResponse(session, server, responseJson);
 }
 
 void errorHandler(const int code,
                   const std::exception &exception,
-                  const std::shared_ptr<restbed::Session> &session,
+                  const SharedHttpSession &session,
                   const std::shared_ptr<Server> &server) {
-    auto response = generateResponse("ERROR", "text/plain", Connection::CLOSE);
-    session->close(*response);
+    session->close(errorResponse().getBytes());
 }
 
 void handleInactiveSessions(const std::shared_ptr<Server> &server) {
-    auto lockedSessions = server->getSessionsW();
-    for (auto session = lockedSessions->begin();
-         session != lockedSessions->end();) {
-        if (session->second->is_closed()) {
-            session = lockedSessions->erase(session);
-        } else
-            ++session;
-    }
+    server->expireSessions();
+    server->expireUsers();
+    server->expireRateLimits();
 }
 
-void cleanUpUserSessions(const std::shared_ptr<Server> &server) {
-    auto lockedUsers = server->getUsers();
-    for (const auto &user : *lockedUsers) {
-        user.second->eraseInactiveSessions();
-    }
+void reportBroadcast(const restbes::Notification &notification,
+                     std::size_t recipients,
+                     std::chrono::microseconds latency) {
+    if (notification.isComment()) return;
+    server_request_log << "Broadcast " << notification.getEvent() << " to "
+                       << recipients << " recipients in " << latency.count()
+                       << " us" << std::endl;
 }
 
-void pollingHandler(const std::shared_ptr<restbed::Session> &session,
+void reportDroppedNotifications(const std::shared_ptr<Server> &server) {
+    static std::uint64_t reported = 0;
+    auto dropped = server->getDroppedCount();
+    if (dropped == reported) return;
+    server_request_log << "Dropped " << dropped - reported
+                       << " notifications of slow sessions" << std::endl;
+    reported = dropped;
+}
+
+void reportDroppedPeerMessages(const std::shared_ptr<Server> &server) {
+    static std::uint64_t reported = 0;
+    auto dropped = server->getPeerDroppedCount();
+    if (dropped == reported) return;
+    server_request_log << "Dropped " << dropped - reported
+                       << " messages to other workers" << std::endl;
+    reported = dropped;
+}
+
+void reportShedRequests(const std::shared_ptr<Server> &server) {
+    static std::uint64_t reported = 0;
+    auto shed = server->getShedCount();
+    if (shed == reported) return;
+    server_request_log << "Shed " << shed - reported
+                       << " requests under load, handler queue delay "
+                       << server->getAdmissionDelay().count() << " us"
+                       << std::endl;
+    reported = shed;
+}
+
+bool acceptsEventStream(const SharedHttpSession &session) {
+    return session->get_request()->get_header("Accept", "").find(
+               "text/event-stream") != std::string::npos;
+}
+
+void pollingHandler(const SharedHttpSession &session,
                     const std::shared_ptr<Server> &server) {
     std::string user_id = session->get_request()->get_header("User-ID", "");
-    unsigned int session_id =
-        session->get_request()->get_header("Session-ID", 0);
-
-    if (!user_id.empty() && server->getUser(user_id) == nullptr) {
-        server->addUser(user_id, server);
+    SessionId session_id =
+        session->get_request()->get_header("Session-ID", SessionId(0));
+    auto transport = acceptsEventStream(session) ? restbes::EVENT_STREAM
+                                                 : restbes::LONG_POLL;
+    std::uint64_t lastEventId = std::strtoull(
+        session->get_request()->get_header("Last-Event-ID", "0").c_str(),
+        nullptr, 10);
+
+    if (!user_id.empty()) {
+        Server::getOrCreateUser(user_id, server);
     }
     auto realSession = server->getSession(session_id);
     if (realSession == nullptr) {
-        session_id = server->addSession(session, user_id);
+        session_id = server->addSession(session, "", transport);
         auto response = generateResponse(
             "New Session-ID: " + std::to_string(session_id) + '\n',
             "text/plain", Connection::KEEP_ALIVE);
         response->set_header("Session-ID", std::to_string(session_id));
-        server->getSession(session_id)->push(response);
+        server->getSession(session_id)->push(restbes::makeNotification(
+            "new_session",
+            folly::toJson(dynamic::object("event", "new_session")(
+                "session_id", session_id)),
+            restbes::serializeResponse(*response)));
+        if (!user_id.empty()) {
+            server->assignSession(session_id, user_id);
+            server->replayEvents(session_id, user_id, lastEventId);
+        }
     } else {
-        if (realSession->getSession() != session && realSession->is_closed()) {
-            realSession->setSession(session);
+        // A keep-alive connection keeps its session, so only a switch of
+        // transport or a closed attachment means the client came back
+        if (transport != realSession->getTransport() ||
+            realSession->is_closed()) {
+            realSession->setSession(session, transport);
             auto response = generateResponse(
                 "Reconnected session: " + std::to_string(realSession->getId()) +
                     '\n',
                 "text/plain", Connection::KEEP_ALIVE);
-            if (session->is_open())
+            if (transport == restbes::LONG_POLL && session->is_open())
                 session->yield(*response);
+            if (!user_id.empty())
+                server->replayEvents(session_id, user_id, lastEventId);
         }
         if (!user_id.empty() && realSession->getUserId().empty())
             server->assignSession(session_id, user_id);
     }
 }
 
-void notifySessionsMenuChanged() {
+void sendHeartbeats(const std::shared_ptr<Server> &server) {
+    static const auto heartbeat = restbes::Notification::comment("heartbeat");
+    server->pushToStreamingSessions(heartbeat);
+}
+
+void flushNotifications(const std::shared_ptr<Server> &server) {
+    server->flushSessions();
+}
+
+void setInlinePayloadLimit(std::size_t bytes) {
+    inlinePayloadLimit() = bytes;
+}
+
+void webSocketMessageHandler(const std::shared_ptr<Session> &session,
+                             const std::string &data,
+                             const std::shared_ptr<Server> &server) {
+    std::string user_id = session->getUserId();
+    if (user_id.empty()) return;
+
+    bool changed;
+    try {
+        changed = applyCartCommand(user_id, json::parse(data));
+    } catch (const std::exception &exception) {
+        dynamic responseJson = dynamic::object("query", "cart_changed")(
+            "status_code", 1);
+        responseJson["body"] = dynamic::object;
+        responseJson["body"]["message"] =
+            std::string("error: ") + exception.what();
+        responseJson["body"]["error_code"] = 1;
+        session->sendMessage(folly::toJson(responseJson));
+        return;
+    }
+    if (changed) {
+        session->sendMessage(folly::toJson(cartChangedResponse()));
+        notifySessionsCartChanged(user_id, session->getId());
+    }
+}
+
+void invalidateMenuCache() {
+    auto lockedCache = getMenuCache().wlock();
+    ++lockedCache->version;
+    lockedCache->body.reset();
+}
+
+void applyPeerBroadcast(const restbes::Notification &notification) {
+    // The menu was changed through another worker process, or another node
+    // may have changed it unnoticed
+    if (notification.getEvent() == "menu_changed" ||
+        notification.getEvent() == "resync_required")
+        invalidateMenuCache();
+}
+
+void pushMenuChanged() {
+    invalidateMenuCache();
+
     folly::dynamic notificationJson = folly::dynamic::object;
     notificationJson["event"] = "menu_changed";
     notificationJson["timestamp"] =
         std::stoi(connectGet(R"(SELECT "TIMESTAMP" FROM "MENU_HISTORY")"));
+    if (inlinePayloadLimit() != 0)
+        inlinePayload(notificationJson, "menu", menuBody());
 
-    restbes::getServer()->pushToAllSessions(restbes::generateResponse(
-        folly::toJson(notificationJson), "application/json",
-        restbes::Connection::KEEP_ALIVE));
+    restbes::getServer()->pushToAllSessions(restbes::makeNotification(
+        "menu_changed", folly::toJson(notificationJson), "menu"));
+}
+
+void pushOrderChanged(const std::string &order_id) {
+    std::string user_id = restbesOrder::get_order_client_id(order_id);
+    // Offline customers get their orders on the next sign in
+    if (!getServer()->hasUser(user_id)) return;
+    sendNotification(user_id, orderChangedNotification(order_id));
+}
+
+void notifySessionsMenuChanged() {
+    pushMenuChanged();
 }
 
 void notifySessionsOrderChanged(const std::string &order_id) {
-    folly::dynamic notificationJson = orderChangedNotification(order_id);
+    pushOrderChanged(order_id);
+}
 
-    std::string user_id = restbesOrder::get_order_client_id(order_id);
-    Server::addUser(user_id, getServer());
-    auto user = restbes::getServer()->getUser(user_id);
-    sendNotification(user, notificationJson);
+void applyNodeEvent(const std::string &event) {
+    auto separator = event.find(':');
+    auto kind = event.substr(0, separator);
+    auto id = separator == std::string::npos ? ""
+                                             : event.substr(separator + 1);
+    if (kind == "menu") {
+        pushMenuChanged();
+    } else if (kind == "order" && !id.empty()) {
+        pushOrderChanged(id);
+    } else if (kind == "cart" && getServer()->hasUser(id)) {
+        sendNotification(id, cartChangedNotification(id));
+    }
 }
 
-std::string show_menu() {
-    std::string sqlRequest = R"(SELECT * FROM "DISH" WHERE "STATUS" = 1)";
-    pqxx::result result = connectGet_pqxx_result(sqlRequest);
+void resyncNodeEvents() {
+    invalidateMenuCache();
+    // The same marker the replay ring and the worker group send for what
+    // they lost; the other workers get it as a broadcast
+    getServer()->pushToAllSessions(makeResyncNotification());
+}
 
+std::string show_menu() {
     dynamic response = dynamic::object;
     response["query"] = "menu";
     response["status_code"] = 0;
-    response["body"] = dynamic::object;
-    response["body"]["item"] = "menu";
-    response["body"]["timestamp"] =
-        std::stoi(connectGet(R"(SELECT "TIMESTAMP" FROM "MENU_HISTORY")"));
-    response["body"]["contents"] = dynamic::array;
-
-    for (auto row : result) {
-        dynamic item = dynamic::object;
-        item["item"] = "dish";
-        item["dish_id"] = row[0].as<int>();
-        item["name"] = row[1].as<std::string>();
-        item["image"] = row[2].as<std::string>();
-        item["price"] = row[3].as<int>();
-        item["status"] = row[4].as<int>();
-        response["body"]["contents"].push_back(item);
-    }
+    response["body"] = menuBody();
     return folly::toJson(response);
 }
 
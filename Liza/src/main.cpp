@@ -1,5 +1,16 @@
 #include <gflags/gflags.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <csignal>
 #include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <set>
+#include <sstream>
+#include "event_bus.h"
 #include "handlers.h"
 #include "tgBot.h"
 
@@ -38,53 +49,366 @@ static bool ValidateWorkers(const char *flagname, gflags::int32 value) {
     return false;
 }
 
+static bool ValidateCoalesceWindow(const char *flagname, gflags::int32 value) {
+    if (0 <= value && value <= 1000) {
+        return true;
+    }
+    printf("Invalid value for --%s: %d\n", flagname, (int)value);
+    return false;
+}
+
+static bool ValidatePayloadLimit(const char *flagname, gflags::int32 value) {
+    if (0 <= value && value <= 65536) {
+        return true;
+    }
+    printf("Invalid value for --%s: %d\n", flagname, (int)value);
+    return false;
+}
+
+static bool ValidateProcesses(const char *flagname, gflags::int32 value) {
+    if (0 < value && value <= static_cast<int>(restbes::MAX_WORKERS)) {
+        return true;
+    }
+    printf("Invalid value for --%s: %d\n", flagname, (int)value);
+    return false;
+}
+
+static const std::map<std::string, restbes::OverflowPolicy> overflowPolicies = {
+    {"drop_oldest", restbes::DROP_OLDEST},
+    {"coalesce", restbes::COALESCE},
+    {"disconnect", restbes::DISCONNECT}};
+
+static bool ValidateOverflowPolicy(const char *flagname,
+                                   const std::string &value) {
+    if (overflowPolicies.count(value) > 0) {
+        return true;
+    }
+    printf("Invalid value for --%s: %s\n", flagname, value.c_str());
+    return false;
+}
+
+static const std::map<std::string, restbes::BackendKind> backends = {
+    {"restbed", restbes::BackendKind::RESTBED},
+    {"asio", restbes::BackendKind::ASIO}};
+
+static bool ValidateBackend(const char *flagname, const std::string &value) {
+    if (backends.count(value) > 0) {
+        return true;
+    }
+    printf("Invalid value for --%s: %s\n", flagname, value.c_str());
+    return false;
+}
+
+// "/path=rate:burst,..." where rate is requests per second
+static std::optional<std::map<std::string, restbes::RateLimit>>
+parseRateLimits(const std::string &value) {
+    std::map<std::string, restbes::RateLimit> limits;
+    std::stringstream stream(value);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        auto separator = item.find('=');
+        restbes::RateLimit limit;
+        if (separator == std::string::npos || item[0] != '/' ||
+            sscanf(item.c_str() + separator + 1, "%lf:%lf", &limit.rate,
+                   &limit.burst) != 2 ||
+            limit.rate < 0 || limit.burst < 1)
+            return std::nullopt;
+        limits[item.substr(0, separator)] = limit;
+    }
+    return limits;
+}
+
+static bool ValidateRateLimits(const char *flagname,
+                               const std::string &value) {
+    if (parseRateLimits(value)) {
+        return true;
+    }
+    printf("Invalid value for --%s: %s\n", flagname, value.c_str());
+    return false;
+}
+
+// The --rate_limits format, the items may also be on separate lines
+static std::optional<std::map<std::string, restbes::RateLimit>>
+readRateLimits(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) return std::nullopt;
+    std::string value, line;
+    while (std::getline(file, line)) {
+        line.erase(std::remove_if(line.begin(), line.end(),
+                                  [](unsigned char c) { return isspace(c); }),
+                   line.end());
+        if (line.empty()) continue;
+        if (!value.empty()) value += ',';
+        value += line;
+    }
+    return parseRateLimits(value);
+}
+
+static bool ValidateRateLimitsFile(const char *flagname,
+                                   const std::string &value) {
+    if (value.empty() || readRateLimits(value)) {
+        return true;
+    }
+    printf("Invalid value for --%s: %s\n", flagname, value.c_str());
+    return false;
+}
+
+// Paths limited by the last applied limits, only touched by main() and then
+// by the reload task
+static std::set<std::string> limitedPaths;
+
+static std::atomic<bool> rateLimitsReload{false};
+
+static void applyRateLimits(
+    const std::map<std::string, restbes::RateLimit> &limits) {
+    for (const auto &path: limitedPaths)
+        if (limits.count(path) == 0) getServer()->setRateLimit(path, {});
+    limitedPaths.clear();
+    for (const auto &[path, limit]: limits) {
+        getServer()->setRateLimit(path, limit);
+        limitedPaths.insert(path);
+    }
+}
+
+static bool ValidateNonNegative(const char *flagname, gflags::int32 value) {
+    if (0 <= value) {
+        return true;
+    }
+    printf("Invalid value for --%s: %d\n", flagname, (int)value);
+    return false;
+}
+
 DEFINE_string(SSLkeys, "", "Path to SSL keys");
+DEFINE_bool(ktls, false,
+            "Hand TLS record encryption to the kernel when it supports it, "
+            "asio backend only");
 DEFINE_int32(port, 0, "What port to listen on");
 DEFINE_int32(workers, 10, "Number of workers");
+DEFINE_bool(event_bus, false,
+            "Share order, cart and menu changes with the other server nodes "
+            "through Postgres LISTEN/NOTIFY, for deployments of several "
+            "nodes");
+DEFINE_int32(processes, 1,
+             "Number of worker processes; worker i listens on port + i, "
+             "with the asio backend all of them share the port");
+DEFINE_string(backend, "restbed",
+              "HTTP transport: restbed, or asio for the native epoll loop");
+DEFINE_string(upgrade_socket, "",
+              "Unix socket through which a new server takes over from the "
+              "running one, needs --backend asio; empty to restart with "
+              "downtime");
+DEFINE_int32(drain_spread_ms, 5000,
+             "Time in milliseconds over which the clients of a replaced "
+             "server are told to reconnect");
+DEFINE_int32(drain_timeout_ms, 10000,
+             "Longest wait in milliseconds for the requests in progress "
+             "when the server is replaced");
+DEFINE_int32(coalesce_window_ms, 0,
+             "Delay in milliseconds for collecting notifications before "
+             "sending them to a session, 0 to send right away");
+DEFINE_int32(inline_payload_limit, 2048,
+             "Largest cart, order or menu in bytes that is embedded into its "
+             "notification, 0 to send only ids");
+DEFINE_int32(session_queue_limit, 256,
+             "Most notifications queued for one session, 0 for no limit");
+DEFINE_int32(session_queue_bytes, 1 << 20,
+             "Most bytes of notifications queued for one session, "
+             "0 for no limit");
+DEFINE_string(queue_overflow, "coalesce",
+              "What to do when a session queue overflows: drop_oldest, "
+              "coalesce or disconnect");
+DEFINE_int32(fan_out_threads, 0,
+             "Number of threads pushing broadcasts to sessions, 0 for one "
+             "per core");
+DEFINE_int32(user_idle_ttl, 300,
+             "Seconds a user without sessions is kept in memory");
+DEFINE_int32(max_users, 100000,
+             "Most users kept in memory, the least recently active ones "
+             "without sessions are evicted first; 0 for no limit");
+DEFINE_int32(core_loops, 0,
+             "Number of core-pinned event loops owning users and their "
+             "sessions, 0 for one per core");
+DEFINE_string(rate_limits, "/cart=20:40,/order=5:10,/user=5:10",
+              "Requests per second and burst allowed to one user for each "
+              "resource, as /path=rate:burst separated by commas");
+DEFINE_string(rate_limits_file, "",
+              "File with limits in the --rate_limits format that replace "
+              "them, read again on SIGHUP");
+DEFINE_int32(handler_threads, 10, "Number of threads running request handlers");
+DEFINE_int32(blocking_threads, 16,
+             "Number of threads running the database queries of coroutine "
+             "handlers");
+DEFINE_int32(max_queued_requests, 1024,
+             "Most requests waiting for a handler thread before the lowest "
+             "priority ones are refused with 503");
+DEFINE_int32(max_queue_delay_ms, 200,
+             "Longest average wait for a handler thread before the lowest "
+             "priority requests are refused with 503");
 
 DEFINE_validator(SSLkeys, &ValidatePath);
 DEFINE_validator(port, &ValidatePort);
 DEFINE_validator(workers, &ValidateWorkers);
+DEFINE_validator(processes, &ValidateProcesses);
+DEFINE_validator(coalesce_window_ms, &ValidateCoalesceWindow);
+DEFINE_validator(inline_payload_limit, &ValidatePayloadLimit);
+DEFINE_validator(session_queue_limit, &ValidateNonNegative);
+DEFINE_validator(session_queue_bytes, &ValidateNonNegative);
+DEFINE_validator(queue_overflow, &ValidateOverflowPolicy);
+DEFINE_validator(backend, &ValidateBackend);
+DEFINE_validator(fan_out_threads, &ValidateNonNegative);
+DEFINE_validator(core_loops, &ValidateNonNegative);
+DEFINE_validator(user_idle_ttl, &ValidateNonNegative);
+DEFINE_validator(max_users, &ValidateNonNegative);
+DEFINE_validator(rate_limits, &ValidateRateLimits);
+DEFINE_validator(rate_limits_file, &ValidateRateLimitsFile);
+DEFINE_validator(handler_threads, &ValidateWorkers);
+DEFINE_validator(blocking_threads, &ValidateWorkers);
+DEFINE_validator(max_queued_requests, &ValidateNonNegative);
+DEFINE_validator(max_queue_delay_ms, &ValidateNonNegative);
+DEFINE_validator(drain_spread_ms, &ValidateNonNegative);
+DEFINE_validator(drain_timeout_ms, &ValidateNonNegative);
 
 int main(int argc, char **argv) {
     gflags::ParseCommandLineFlags(&argc, &argv, true);
+    // restbed binds its own sockets: the handed ones would be closed and the
+    // port bound again, resetting the connections waiting in the backlog
+    if (!fLS::FLAGS_upgrade_socket.empty() && fLS::FLAGS_backend != "asio") {
+        printf("--upgrade_socket needs --backend asio\n");
+        return 1;
+    }
+    if (fLB::FLAGS_event_bus) {
+        char host[256] = {};
+        gethostname(host, sizeof(host) - 1);
+        restbes::setEventNode(std::string(host) + "-" +
+                              std::to_string(getpid()));
+    }
+    // Forks before the server starts any thread
+    auto workerGroup = restbes::WorkerGroup::start(fLI::FLAGS_processes);
+    if (fLI::FLAGS_core_loops > 0)
+        getServer()->setCoreLoops(fLI::FLAGS_core_loops);
+    getServer()->setUserIdleTtl(std::chrono::seconds(fLI::FLAGS_user_idle_ttl));
+    getServer()->setMaxUsers(fLI::FLAGS_max_users);
 
-    std::thread t([&] { TelegramBot::tgBotPolling(); });
-    t.detach();
+    // SO_REUSEPORT lets the kernel spread connections over the workers
+    auto backend = backends.at(fLS::FLAGS_backend);
+    bool sharedPort = backend == restbes::BackendKind::ASIO &&
+                      fLI::FLAGS_processes > 1;
+    getServer()->setBackend(restbes::makeBackend(backend, sharedPort));
+    if (fLB::FLAGS_ktls && !getServer()->enableKernelTls())
+        printf("Kernel TLS needs --backend asio, kernel TLS support and "
+               "OpenSSL 3, encrypting in user space\n");
+    getServer()->setWorkerGroup(std::move(workerGroup));
+    getServer()->setPeerBroadcastListener(restbes::applyPeerBroadcast);
+
+    // One bot and one event listener per node: what they push reaches the
+    // other workers
+    if (getServer()->getWorkerIndex() == 0) {
+        std::thread t([&] { TelegramBot::tgBotPolling(); });
+        t.detach();
+        if (fLB::FLAGS_event_bus)
+            restbes::startEventListener(restbes::applyNodeEvent,
+                                        restbes::resyncNodeEvents);
+    }
 
     auto order = createResource("/order", restbes::getOrderHandler,
                                 restbes::postOrderMethodHandler, errorHandler,
-                                getServer());
+                                getServer(), restbes::Priority::ORDER);
 
     auto cart = createResource("/cart", restbes::getCartHandler,
                                restbes::postCartMethodHandler, errorHandler,
-                               getServer());
+                               getServer(), restbes::Priority::CART);
 
     auto menu = createResource("/menu", restbes::getMenuHandler, std::nullopt,
-                               errorHandler, getServer());
+                               errorHandler, getServer(),
+                               restbes::Priority::MENU);
 
-    auto user = createResource("/user", std::nullopt,
-                               restbes::postAuthorizationMethodHandler,
-                               errorHandler, getServer());
+    auto user = createCoroutineResource("/user", std::nullopt,
+                                        restbes::postAuthorizationMethodHandler,
+                                        errorHandler, getServer(),
+                                        restbes::Priority::USER);
 
     auto get = createResource("/get", restbes::pollingHandler, std::nullopt,
-                              errorHandler, getServer());
+                              errorHandler, getServer(),
+                              restbes::Priority::POLLING);
+
+    // The socket carries cart commands
+    auto ws = createWebSocketResource("/ws", restbes::webSocketMessageHandler,
+                                      errorHandler, getServer(), "/cart");
 
     std::string pathToSSL[] = {fLS::FLAGS_SSLkeys + "/server.key",
                                fLS::FLAGS_SSLkeys + "/server.crt",
                                fLS::FLAGS_SSLkeys + "/dh2048.pem"};
 
+    int port = fLI::FLAGS_port;
+    if (!sharedPort) port += getServer()->getWorkerIndex();
     auto settings =
         restbes::createSettingsWithSSL(pathToSSL[0], pathToSSL[1], pathToSSL[2],
-                                       fLI::FLAGS_port, fLI::FLAGS_workers);
+                                       port, fLI::FLAGS_workers);
+
+    auto rateLimits = fLS::FLAGS_rate_limits_file.empty()
+                          ? parseRateLimits(fLS::FLAGS_rate_limits)
+                          : readRateLimits(fLS::FLAGS_rate_limits_file);
+    // The file may have changed since the flags were validated
+    if (!rateLimits) {
+        printf("Invalid --rate_limits_file\n");
+        return 1;
+    }
+    applyRateLimits(*rateLimits);
+    getServer()->setHandlerThreads(fLI::FLAGS_handler_threads);
+    getServer()->setBlockingThreads(fLI::FLAGS_blocking_threads);
+    getServer()->setAdmissionLimits(
+        {static_cast<std::size_t>(fLI::FLAGS_max_queued_requests),
+         std::chrono::milliseconds(fLI::FLAGS_max_queue_delay_ms)});
 
     getServer()->addResource(order);
     getServer()->addResource(cart);
     getServer()->addResource(user);
     getServer()->addResource(get);
+    getServer()->addResource(ws);
     getServer()->addResource(menu);
     getServer()->schedule(restbes::handleInactiveSessions, getServer(), 1s);
-    getServer()->schedule(restbes::cleanUpUserSessions, getServer(), 2s);
+    getServer()->schedule(restbes::sendHeartbeats, getServer(), 15s);
+    getServer()->schedule(restbes::reportDroppedNotifications, getServer(),
+                          60s);
+    getServer()->schedule(restbes::reportDroppedPeerMessages, getServer(),
+                          60s);
+    getServer()->schedule(restbes::reportShedRequests, getServer(), 60s);
+    if (!fLS::FLAGS_rate_limits_file.empty()) {
+        signal(SIGHUP, [](int) { rateLimitsReload = true; });
+        getServer()->schedule(
+            [](const std::shared_ptr<restbes::Server> &) {
+                if (!rateLimitsReload.exchange(false)) return;
+                auto limits = readRateLimits(fLS::FLAGS_rate_limits_file);
+                if (limits)
+                    applyRateLimits(*limits);
+                else
+                    printf("Invalid --rate_limits_file, keeping the limits\n");
+            },
+            getServer(), 1s);
+    }
+    getServer()->setQueueLimits(
+        {static_cast<std::size_t>(fLI::FLAGS_session_queue_limit),
+         static_cast<std::size_t>(fLI::FLAGS_session_queue_bytes),
+         overflowPolicies.at(fLS::FLAGS_queue_overflow)});
+    if (fLI::FLAGS_coalesce_window_ms > 0) {
+        std::chrono::milliseconds window(fLI::FLAGS_coalesce_window_ms);
+        getServer()->setFlushWindow(window);
+        getServer()->schedule(restbes::flushNotifications, getServer(),
+                              window);
+    }
+    restbes::setInlinePayloadLimit(fLI::FLAGS_inline_payload_limit);
+    if (fLI::FLAGS_fan_out_threads > 0)
+        getServer()->setFanOutThreads(fLI::FLAGS_fan_out_threads);
+    getServer()->setBroadcastListener(restbes::reportBroadcast);
+    if (!fLS::FLAGS_upgrade_socket.empty()) {
+        // Every worker hands over to the worker with the same index
+        auto path = fLS::FLAGS_upgrade_socket;
+        if (fLI::FLAGS_processes > 1)
+            path += "." + std::to_string(getServer()->getWorkerIndex());
+        getServer()->setUpgradeSocket(
+            path, {std::chrono::milliseconds(fLI::FLAGS_drain_spread_ms),
+                   std::chrono::milliseconds(fLI::FLAGS_drain_timeout_ms)});
+    }
     getServer()->setSettings(settings);
     getServer()->startServer();
 
@@ -8,9 +8,11 @@ std::string get_order_client_id(const std::string &order_id) {
 }
 
 void update_order_history(id_t order_id, id_t client_id) {
+    // Last write of a new order, other nodes find its client through it
     restbes::connectExec(
         R"(INSERT INTO "HISTORY" ("ORDER_ID", "CLIENT_ID") VALUES ()" +
-        std::to_string(order_id) + ", " + std::to_string(client_id) + ")");
+            std::to_string(order_id) + ", " + std::to_string(client_id) + ")",
+        "order:" + std::to_string(order_id));
 }
 
 int get_order_timestamp(const std::string &order_id) {
@@ -1,15 +1,18 @@
-#include "../../Liza/include/fwd.h"
+#include "../include/fwd.h"
+#include "event_bus.h"
 
 namespace restbes {
 
+static const char *const DATABASE =
+    "dbname=testdb user=postgres password=restbes2022 hostaddr=127.0.0.1 "
+    "port=5432";
+
 std::time_t getTime() {
     return std::time(nullptr);
 }
 
 void connectExec(const std::string &sql) {
-    pqxx::connection C(
-        "dbname=testdb user=postgres password=restbes2022 hostaddr=127.0.0.1 "
-        "port=5432");
+    pqxx::connection C(DATABASE);
 
     pqxx::work W(C);
     W.exec(sql);
@@ -18,14 +21,23 @@ void connectExec(const std::string &sql) {
     C.disconnect();
 }
 
+void connectExec(const std::string &sql, const std::string &event) {
+    pqxx::connection C(DATABASE);
+
+    pqxx::work W(C);
+    W.exec(sql);
+    publishEvent(W, event);
+    W.commit();
+
+    C.disconnect();
+}
+
 std::string connectGet(const std::string &sql) {
     return connectGet_pqxx_result(sql)[0][0].c_str();
 }
 
 pqxx::result connectGet_pqxx_result(const std::string &sql) {
-    pqxx::connection C(
-        "dbname=testdb user=postgres password=restbes2022 hostaddr=127.0.0.1 "
-        "port=5432");
+    pqxx::connection C(DATABASE);
 
     pqxx::nontransaction N(C);
     pqxx::result result(N.exec(sql));
@@ -34,4 +46,8 @@ pqxx::result connectGet_pqxx_result(const std::string &sql) {
     return result;
 }
 
+std::unique_ptr<pqxx::connection> connectDatabase() {
+    return std::make_unique<pqxx::connection>(DATABASE);
+}
+
 }  // namespace restbes
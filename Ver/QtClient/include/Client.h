@@ -1,10 +1,14 @@
 #pragma once
 
 #include <QObject>
+#ifdef RESTBES_WEBSOCKET
+#include <QWebSocket>
+#endif
 
 #include <nlohmann/json.hpp>
 
 #define CPPHTTPLIB_OPENSSL_SUPPORT
+#define CPPHTTPLIB_ZLIB_SUPPORT
 
 #include "httplib.h"
 
@@ -13,6 +17,7 @@
 #include "OrderList.h"
 #include "Order.h"
 
+#include <atomic>
 #include <memory>
 
 namespace restbes {
@@ -23,7 +28,7 @@ Q_OBJECT
     Q_PROPERTY(QString name READ getName NOTIFY nameChanged)
     Q_PROPERTY(QString email READ getEmail NOTIFY emailChanged)
     Q_PROPERTY(int userId READ getUserId NOTIFY userIdChanged)
-    Q_PROPERTY(int sessionId READ getSessionId NOTIFY sessionIdChanged)
+    Q_PROPERTY(quint64 sessionId READ getSessionId NOTIFY sessionIdChanged)
 public:
     enum ServerNotification : bool {
         NotifyServer = true,
@@ -39,9 +44,17 @@ public:
 
     Q_ENUM(OrderType);
 
+    enum NotificationTransport {
+        LongPolling,
+        EventStream,
+        WebSocket
+    };
+
     explicit Client(QObject *parent = nullptr);
 
-    explicit Client(std::string server, int _port, QObject *parent = nullptr);
+    explicit Client(std::string server, int _port,
+                    NotificationTransport notificationTransport = LongPolling,
+                    QObject *parent = nullptr);
 
     [[nodiscard]] bool getRegStatus() const;
 
@@ -51,7 +64,7 @@ public:
 
     [[nodiscard]] int getUserId() const;
 
-    [[nodiscard]] int getSessionId() const;
+    [[nodiscard]] quint64 getSessionId() const;
 
     void startPolling();
 
@@ -82,6 +95,8 @@ private slots:
 
     void getOrderFromServer(int orderId, int type);
 
+    void applyOrder(const QString &body, int type);
+
 signals:
 
     void regStatusChanged();
@@ -100,6 +115,8 @@ signals:
 
     void getOrder(int orderId, int type);
 
+    void gotOrder(const QString &body, int type);
+
 public slots:
 
 private:
@@ -107,9 +124,10 @@ private:
     QString name;
     QString email;
     int userId = -1;
-    int sessionId = -1;
+    quint64 sessionId = 0;
     std::string address;
     int port;
+    NotificationTransport transport = LongPolling;
     folly::Synchronized<httplib::Headers> headers;
     CartList *cartList = new CartList();
     MenuList *menuList = new MenuList();
@@ -118,19 +136,28 @@ private:
     std::shared_ptr<httplib::Client> postingClient;
     std::shared_ptr<httplib::Client> pollingClient;
     std::shared_ptr<std::thread> pollingThread;
+    // Set by a reconnect event: the server is being replaced and the next
+    // request should reach its successor after this delay
+    std::atomic<int> reconnectDelayMs{0};
 
     enum PollingEvent {
         CartChanged,
         OrderChanged,
         MenuChanged,
-        NewSignIn
+        NewSignIn,
+        NewSession,
+        ResyncRequired,
+        ReconnectRequested
     };
 
     static inline std::unordered_map<std::string, PollingEvent> eventMap{
             {"cart_changed",  CartChanged},
             {"order_changed", OrderChanged},
             {"menu_changed",  MenuChanged},
-            {"new_sign_in",   NewSignIn}
+            {"new_sign_in",   NewSignIn},
+            {"new_session",   NewSession},
+            {"resync_required", ResyncRequired},
+            {"reconnect",       ReconnectRequested}
     };
 
     void setRegStatus(bool newStatus);
@@ -141,7 +168,7 @@ private:
 
     void setUserId(int newId);
 
-    void setSessionId(int newId);
+    void setSessionId(quint64 newId);
 
     bool parseUserFromJson(const nlohmann::json &json);
 
@@ -151,6 +178,32 @@ private:
 
     void getCartFromServer();
 
+    void applyMenu(const nlohmann::json &body);
+
+    void applyCart(const nlohmann::json &body);
+
+    void setOrder(const nlohmann::json &body, int type);
+
+    void pollOnce();
+
+    void pollEventStream();
+
+    void handleNotification(const nlohmann::json &json);
+
+    void setLastEventId(const std::string &eventId);
+
+    void awaitReconnect();
+
+    bool sendCartQuery(const std::string &query);
+
+#ifdef RESTBES_WEBSOCKET
+    QWebSocket *webSocket = nullptr;
+
+    void openWebSocket();
+
+    void handleSocketMessage(const QString &message);
+#endif
+
 };
 
 }
@@ -1,5 +1,10 @@
 #include <QDebug>
 
+#include <QTimer>
+
+#include <algorithm>
+#include <sstream>
+
 #include "Client.h"
 #include "jsonParser.h"
 #include "MenuList.h"
@@ -8,16 +13,20 @@
 
 namespace restbes {
 
-Client::Client(std::string server, int _port, QObject *parent)
+Client::Client(std::string server, int _port,
+               NotificationTransport notificationTransport, QObject *parent)
         : QObject(parent),
           address("https://" + std::move(server) + ':' + std::to_string(_port)),
           port(_port),
+          transport(notificationTransport),
           postingClient(std::make_shared<httplib::Client>(address)),
           pollingClient(std::make_shared<httplib::Client>(address)) {
 
     *headers.wlock() = {
-            {"Session-ID", ""},
-            {"User-ID",    ""}
+            {"Session-ID",      ""},
+            {"User-ID",         ""},
+            {"Last-Event-ID",   "0"},
+            {"Accept-Encoding", "gzip, deflate"}
     };
     pollingClient->enable_server_certificate_verification(false);
     pollingClient->set_keep_alive(true);
@@ -30,20 +39,26 @@ Client::Client(std::string server, int _port, QObject *parent)
                 "Bad response from the server " + std::to_string(res->status));
     }
 
-    int newSessionId;
+    quint64 newSessionId = 0;
     // TODO: answer from the server should be a JSON file
-    sscanf(res->body.c_str(), "New Session-ID: %d", &newSessionId);
+    sscanf(res->body.c_str(), "New Session-ID: %llu", &newSessionId);
     setSessionId(newSessionId);
     qDebug() << "Got Session-ID from the server";
     qDebug() << res->body.c_str() << '\n';
-    headers.wlock()->find("Session-ID")->second = std::to_string(sessionId);
+#ifdef RESTBES_WEBSOCKET
+    if (transport == WebSocket) openWebSocket();
+    else startPolling();
+#else
     startPolling();
+#endif
 
     postingClient->set_read_timeout(180);
+    postingClient->set_keep_alive(true);
     postingClient->enable_server_certificate_verification(false);
     getMenuFromServer();
 
     connect(this, &Client::getOrder, this, &Client::getOrderFromServer);
+    connect(this, &Client::gotOrder, this, &Client::applyOrder);
 //    setItemCount(1, 2);
 //    setItemCount(2, 1);
 }
@@ -90,13 +105,14 @@ void Client::setUserId(int newId) {
     emit userIdChanged();
 }
 
-int Client::getSessionId() const {
+quint64 Client::getSessionId() const {
     return sessionId;
 }
 
-void Client::setSessionId(int newId) {
+void Client::setSessionId(quint64 newId) {
     if (newId == sessionId) return;
     sessionId = newId;
+    headers.wlock()->find("Session-ID")->second = std::to_string(sessionId);
     emit sessionIdChanged();
 }
 
@@ -162,59 +178,207 @@ MenuList *Client::getMenu() const {
 void Client::startPolling() {
     pollingThread = std::make_shared<std::thread>([this]() {
         while (true) {
-            auto res = pollingClient->Get("/get", headers.copy());
-            if (res == nullptr) {
-                throw std::runtime_error("Can't connect to the server");
-            } else if (res->status != 200) {
-                throw std::runtime_error(
-                        "Bad response from the server " +
-                        std::to_string(res->status));
-            }
-            qDebug() << "Notification\n" << res->body.c_str() << '\n';
-            nlohmann::json json = nlohmann::json::parse(res->body);
-            const std::string &stringEvent = json.at(
-                    "event").get<std::string>();
-            unsigned int timestamp = json["timestamp"].get<unsigned int>();
-            PollingEvent event = eventMap.at(stringEvent);
-            auto checkTimestamp = [](unsigned int timestamp,
-                                     unsigned int oldTimestamp) {
-                if (timestamp <= oldTimestamp) {
-                    qDebug()
-                            << "Timestamp is outdated. No changes will be made";
-                    qDebug() << "timestamp is:" << timestamp;
-                    qDebug() << "old timestamp is:"
-                             << oldTimestamp << '\n';
-                    return false;
-                }
-                return true;
-            };
-            switch (event) {
-                case CartChanged: {
-                    if (checkTimestamp(timestamp, cartList->getTimestamp())
-                        && regStatus)
-                        getCartFromServer();
-                    break;
-                }
-                case OrderChanged: {
-                    if (checkTimestamp(timestamp, orderList->getTimestamp())) {
-                        int orderId = json["body"]["order_id"].get<int>();
-                        emit getOrder(orderId, Notification);
+            if (transport == EventStream) pollEventStream();
+            else pollOnce();
+            awaitReconnect();
+        }
+    });
+}
+
+void Client::pollOnce() {
+    auto res = pollingClient->Get("/get", headers.copy());
+    if (res == nullptr) {
+        throw std::runtime_error("Can't connect to the server");
+    } else if (res->status != 200) {
+        throw std::runtime_error(
+                "Bad response from the server " +
+                std::to_string(res->status));
+    }
+    qDebug() << "Notification\n" << res->body.c_str() << '\n';
+    if (res->has_header("Session-ID")) {
+        // The server replaced the session, e.g. after a restart
+        setSessionId(std::stoull(res->get_header_value("Session-ID")));
+        return;
+    }
+    setLastEventId(res->get_header_value("Event-ID"));
+    handleNotification(nlohmann::json::parse(res->body));
+}
+
+void Client::setLastEventId(const std::string &eventId) {
+    if (eventId.empty()) return;
+    headers.wlock()->find("Last-Event-ID")->second = eventId;
+}
+
+void Client::awaitReconnect() {
+    int delay = reconnectDelayMs.exchange(0);
+    if (delay == 0) return;
+    qDebug() << "Server is restarting, reconnecting in" << delay << "ms\n";
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+}
+
+void Client::pollEventStream() {
+    auto streamHeaders = headers.copy();
+    streamHeaders.insert({"Accept", "text/event-stream"});
+    std::string buffer;
+    auto res = pollingClient->Get(
+            "/get", streamHeaders,
+            [this, &buffer](const char *data, size_t length) {
+                buffer.append(data, length);
+                size_t end;
+                while ((end = buffer.find("\n\n")) != std::string::npos) {
+                    std::istringstream frame(buffer.substr(0, end));
+                    buffer.erase(0, end + 2);
+                    std::string line, payload;
+                    while (std::getline(frame, line)) {
+                        if (line.rfind("data: ", 0) == 0)
+                            payload += line.substr(6);
+                        else if (line.rfind("id: ", 0) == 0)
+                            setLastEventId(line.substr(4));
                     }
-                    break;
+                    if (payload.empty()) continue;
+                    qDebug() << "Notification\n" << payload.c_str() << '\n';
+                    handleNotification(nlohmann::json::parse(payload));
                 }
-                case MenuChanged: {
-                    if (checkTimestamp(timestamp,
-                                       menuList->getTimestamp()))
-                        getMenuFromServer();
-                    break;
+                // Drops the stream to the old server
+                return reconnectDelayMs == 0;
+            });
+    if (reconnectDelayMs != 0) return;
+    if (res == nullptr || res->status != 200) {
+        qDebug() << "Event stream interrupted, reconnecting\n";
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+void Client::handleNotification(const nlohmann::json &json) {
+    const std::string &stringEvent = json.at("event").get<std::string>();
+    auto foundEvent = eventMap.find(stringEvent);
+    if (foundEvent == eventMap.end()) return;
+    PollingEvent event = foundEvent->second;
+    if (event == NewSession) {
+        // The server replaced the session, e.g. after a restart
+        setSessionId(json["session_id"].get<quint64>());
+        return;
+    }
+    unsigned int timestamp = json["timestamp"].get<unsigned int>();
+    auto checkTimestamp = [](unsigned int timestamp,
+                             unsigned int oldTimestamp) {
+        if (timestamp <= oldTimestamp) {
+            qDebug()
+                    << "Timestamp is outdated. No changes will be made";
+            qDebug() << "timestamp is:" << timestamp;
+            qDebug() << "old timestamp is:"
+                     << oldTimestamp << '\n';
+            return false;
+        }
+        return true;
+    };
+    // Small objects are sent inside the notification
+    auto inlined = [&json](const char *field) {
+        return json.contains("body") && json["body"].contains(field);
+    };
+    switch (event) {
+        case CartChanged: {
+            if (checkTimestamp(timestamp, cartList->getTimestamp())
+                && regStatus) {
+                if (inlined("cart")) applyCart(json["body"]["cart"]);
+                else getCartFromServer();
+            }
+            break;
+        }
+        case OrderChanged: {
+            if (checkTimestamp(timestamp, orderList->getTimestamp())) {
+                if (inlined("order")) {
+                    emit gotOrder(QString::fromStdString(
+                            json["body"]["order"].dump()), Notification);
+                } else {
+                    int orderId = json["body"]["order_id"].get<int>();
+                    emit getOrder(orderId, Notification);
                 }
-                default:
-                    break;
             }
+            break;
         }
-    });
+        case MenuChanged: {
+            if (checkTimestamp(timestamp,
+                               menuList->getTimestamp())) {
+                if (inlined("menu")) applyMenu(json["body"]["menu"]);
+                else getMenuFromServer();
+            }
+            break;
+        }
+        case ResyncRequired: {
+            getMenuFromServer();
+            if (regStatus) getCartFromServer();
+            break;
+        }
+        case ReconnectRequested: {
+            // Every event up to this one is already queued for the session,
+            // the next server resumes after it
+            auto lastEventId = json["last_event_id"].get<uint64_t>();
+            if (lastEventId != 0) setLastEventId(std::to_string(lastEventId));
+            reconnectDelayMs = std::max(1, json["retry_ms"].get<int>());
+            break;
+        }
+        default:
+            break;
+    }
 }
 
+bool Client::sendCartQuery(const std::string &query) {
+#ifdef RESTBES_WEBSOCKET
+    if (webSocket != nullptr &&
+        webSocket->state() == QAbstractSocket::ConnectedState) {
+        webSocket->sendTextMessage(QString::fromStdString(query));
+        qDebug() << "Cart query sent over the WebSocket";
+        qDebug() << query.c_str() << '\n';
+        return true;
+    }
+#endif
+    return false;
+}
+
+#ifdef RESTBES_WEBSOCKET
+void Client::openWebSocket() {
+    if (webSocket == nullptr) {
+        webSocket = new QWebSocket(QString(), QWebSocketProtocol::VersionLatest,
+                                   this);
+        connect(webSocket, &QWebSocket::textMessageReceived, this,
+                &Client::handleSocketMessage);
+        connect(webSocket,
+                QOverload<const QList<QSslError> &>::of(&QWebSocket::sslErrors),
+                webSocket, [this](const QList<QSslError> &) {
+                    webSocket->ignoreSslErrors();
+                });
+        connect(webSocket, &QWebSocket::disconnected, this, [this]() {
+            qDebug() << "WebSocket closed, reconnecting\n";
+            QTimer::singleShot(1000, this, &Client::openWebSocket);
+        });
+    }
+    QNetworkRequest request(QUrl(QString::fromStdString(
+            "wss" + address.substr(address.find(':')) + "/ws")));
+    for (const auto &header: headers.copy()) {
+        request.setRawHeader(QByteArray::fromStdString(header.first),
+                             QByteArray::fromStdString(header.second));
+    }
+    webSocket->open(request);
+}
+
+void Client::handleSocketMessage(const QString &message) {
+    qDebug() << "WebSocket message\n" << message << '\n';
+    nlohmann::json json = nlohmann::json::parse(message.toStdString());
+    if (json.contains("event")) {
+        if (json.contains("event_id"))
+            setLastEventId(std::to_string(json["event_id"].get<uint64_t>()));
+        handleNotification(json);
+        // The disconnected handler opens the socket to the new server
+        if (int delay = reconnectDelayMs.exchange(0))
+            QTimer::singleShot(delay, this, [this]() { webSocket->close(); });
+    } else if (json.value("query", "") == "cart_changed" &&
+               json.value("status_code", 1) == 0) {
+        cartList->setTimestamp(json["timestamp"].get<unsigned int>());
+    }
+}
+#endif
+
 restbes::CartList *Client::getCart() const {
     return cartList;
 }
@@ -231,8 +395,12 @@ void Client::getMenuFromServer() {
     qDebug() << response->body.c_str() << '\n';
 
     nlohmann::json jsonMenu = nlohmann::json::parse(response->body);
-    auto menuData = JsonParser::parseMenu(jsonMenu["body"]);
-    unsigned int timestamp = jsonMenu["body"]["timestamp"].get<unsigned int>();
+    applyMenu(jsonMenu["body"]);
+}
+
+void Client::applyMenu(const nlohmann::json &body) {
+    auto menuData = JsonParser::parseMenu(body);
+    unsigned int timestamp = body["timestamp"].get<unsigned int>();
     menuList->setMenu(std::move(menuData));
     menuList->setTimestamp(timestamp);
 }
@@ -241,6 +409,7 @@ void Client::clearCart(bool notifyServer) {
     cartList->clearCart();
     if (regStatus && notifyServer) {
         std::string query = JsonParser::generateSetCartQuery(*cartList);
+        if (sendCartQuery(query)) return;
         auto response = postingClient->Post("/cart",
                                             headers.copy(),
                                             query,
@@ -275,8 +444,12 @@ void Client::getCartFromServer() {
     qDebug() << response->body.c_str() << '\n';
 
     nlohmann::json jsonBody = nlohmann::json::parse(response->body);
-    auto cartData = JsonParser::parseCart(jsonBody.at("body"));
-    unsigned int timestamp = jsonBody["body"]["timestamp"].get<int>();
+    applyCart(jsonBody.at("body"));
+}
+
+void Client::applyCart(const nlohmann::json &body) {
+    auto cartData = JsonParser::parseCart(body);
+    unsigned int timestamp = body["timestamp"].get<int>();
     cartList->setCart(std::move(cartData));
     cartList->setTimestamp(timestamp);
 }
@@ -285,6 +458,7 @@ void Client::setItemCount(int id, int value) {
     bool countChanged = cartList->setItemCount(id, value);
     if (regStatus && countChanged) {
         std::string query = JsonParser::generateSetItemCountQuery(id, value);
+        if (sendCartQuery(query)) return;
         auto response = postingClient->Post("/cart",
                                             headers.copy(),
                                             query,
@@ -343,8 +517,16 @@ void Client::getOrderFromServer(int orderId, int type) {
     qDebug() << response->body.c_str() << '\n';
 
     nlohmann::json jsonBody = nlohmann::json::parse(response->body);
+    setOrder(jsonBody["body"], type);
+}
+
+void Client::applyOrder(const QString &body, int type) {
+    setOrder(nlohmann::json::parse(body.toStdString()), type);
+}
+
+void Client::setOrder(const nlohmann::json &body, int type) {
     auto *order = new Order();
-    JsonParser::parseOrder(jsonBody["body"], *order);
+    JsonParser::parseOrder(body, *order);
     orderList->setItemStatus(order->getOrderId(), order->getStatus(),
                              order->getTimestamp());
     orderList->setTimestamp(order->getLastModified());
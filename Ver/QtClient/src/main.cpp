@@ -26,6 +26,10 @@ static bool ValidatePort(const char *flagname, gflags::int32 value) {
 
 DEFINE_int32(port, 1234, "What port to listen on");
 DEFINE_string(server, "localhost", "Domain to send requests to");
+DEFINE_bool(event_stream, false,
+            "Receive notifications as a text/event-stream instead of long-polling");
+DEFINE_bool(websocket, false,
+            "Receive notifications and send cart changes over a WebSocket");
 
 DEFINE_validator(port, &ValidatePort);
 
@@ -40,8 +44,13 @@ int main(int argc, char *argv[]) {
     qmlRegisterType<restbes::Client>("Ver", 1, 0, "Client");
     qmlRegisterType<restbes::Order>("Ver", 1, 0, "Order");
 
+    auto transport = restbes::Client::LongPolling;
+    if (fLB::FLAGS_event_stream) transport = restbes::Client::EventStream;
+    if (fLB::FLAGS_websocket) transport = restbes::Client::WebSocket;
+
     auto client = new restbes::Client(fLS::FLAGS_server,
-                                                    fLI::FLAGS_port);
+                                                    fLI::FLAGS_port,
+                                                    transport);
 
     QQmlApplicationEngine engine;
     engine.rootContext()->setContextProperty(QStringLiteral("theClient"),
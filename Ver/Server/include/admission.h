@@ -0,0 +1,83 @@
+#pragma once
+
+#include <folly/Executor.h>
+#include <folly/Function.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace restbes {
+
+// Classes of requests, from the first to be shed to the last
+enum class Priority { POLLING, MENU, USER, CART, ORDER };
+
+inline constexpr std::size_t PRIORITY_COUNT =
+    static_cast<std::size_t>(Priority::ORDER) + 1;
+
+struct AdmissionLimits {
+    // Most handlers waiting to run
+    std::size_t maxQueued = 1024;
+    // Longest time a handler should wait to run
+    std::chrono::milliseconds maxDelay{200};
+};
+
+// Runs request handlers on its own pool, higher priorities first. Under
+// overload the lower classes are refused before the higher ones: class p is
+// admitted while both the queue and the average wait stay under
+// (p + 1) / PRIORITY_COUNT of the limits
+struct AdmissionScheduler {
+private:
+    std::atomic<std::size_t> maxQueued;
+    std::atomic<std::chrono::microseconds::rep> maxDelay;
+    std::atomic<std::size_t> queued{0};
+    // Admitted handlers that have not returned yet
+    std::atomic<std::size_t> inFlight{0};
+    // Signalled when the last handler in flight is done
+    std::mutex idleMutex;
+    std::condition_variable idle;
+    // Moving average of the time a handler waits in the queue
+    std::atomic<std::chrono::microseconds::rep> delay{0};
+    std::atomic<std::uint64_t> shed{0};
+    // Declared last so its threads are joined before the counters go away
+    std::shared_ptr<folly::CPUThreadPoolExecutor> pool;
+
+    [[nodiscard]] bool admits(Priority priority) const;
+
+public:
+    explicit AdmissionScheduler(std::size_t threads,
+                                AdmissionLimits limits = {});
+
+    // False if the task was shed and will not run
+    bool submit(Priority priority, folly::Func task);
+
+    // Like submit(), but the task stays in flight until it calls done. It
+    // may return before, leaving the rest to getExecutor()
+    bool submitAsync(Priority priority,
+                     folly::Function<void(folly::Func done)> task);
+
+    // Runs continuations of the admitted tasks with their priority
+    [[nodiscard]] folly::Executor::KeepAlive<>
+    getExecutor(Priority priority) const;
+
+    void setLimits(AdmissionLimits limits);
+
+    void setThreads(std::size_t threads);
+
+    [[nodiscard]] std::chrono::microseconds getDelay() const;
+
+    [[nodiscard]] std::size_t getInFlight() const;
+
+    // Waits until no handler is in flight, false if the deadline came first
+    bool waitIdle(std::chrono::steady_clock::time_point deadline);
+
+    // Requests shed since the start
+    [[nodiscard]] std::uint64_t getShedCount() const;
+};
+
+} // namespace restbes
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "backend.h"
+#include "tls_context.h"
+
+#include <asio.hpp>
+#include <asio/ssl.hpp>
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace restbes {
+
+// Backend on asio's reactor (epoll on Linux), without restbed. A connection
+// waiting for its next request only waits for readiness and borrows a pooled
+// buffer to read, so idle keep-alive and long-poll connections cost little.
+// Writes queued on a connection while one is in flight go out together in one
+// vectored write. Adopts the sockets of a replaced process and can share its
+// port with other processes. TLS connections read and write the socket through
+// OpenSSL directly, so their records can be encrypted in the kernel, and
+// resume through the session cache or tickets, see tls_context.h. An
+// upgraded WebSocket waits for its frames the same way
+struct AsioBackend : Backend {
+private:
+    struct Scheduled {
+        Task task;
+        std::chrono::milliseconds interval;
+    };
+
+    asio::io_context context;
+    asio::executor_work_guard<asio::io_context::executor_type> work;
+    std::optional<asio::ssl::context> tls;
+    TicketKeys ticketKeys;
+    std::vector<std::unique_ptr<asio::ip::tcp::acceptor>> acceptors;
+    // By path, fixed once the backend starts
+    std::map<std::string, std::shared_ptr<const Resource>> resources;
+    std::chrono::milliseconds requestTimeout{5000};
+    const bool reusePort;
+    bool kernelTls = false;
+
+    void listen(const std::shared_ptr<restbed::Settings> &settings);
+
+    void accept(asio::ip::tcp::acceptor &acceptor);
+
+    void run(const std::shared_ptr<Scheduled> &task,
+             const std::shared_ptr<asio::steady_timer> &timer);
+
+    friend struct AsioSession;
+
+public:
+    explicit AsioBackend(bool reusePort = false);
+
+    void publish(std::shared_ptr<const Resource> resource) override;
+
+    void schedule(Task task, std::chrono::milliseconds interval) override;
+
+    bool enableKernelTls() override;
+
+    bool adopt(const std::vector<int> &sockets) override;
+
+    void start(const std::shared_ptr<restbed::Settings> &settings,
+               Task ready) override;
+
+    void stopAccepting() override;
+
+    void stop() override;
+};
+
+} // namespace restbes
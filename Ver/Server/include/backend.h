@@ -0,0 +1,74 @@
+#pragma once
+
+#include "http_session.h"
+
+#include <restbed>
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace restbes {
+
+using HttpHandler = std::function<void(const SharedHttpSession &)>;
+using HttpErrorHandler = std::function<void(const int, const std::exception &,
+                                            const SharedHttpSession &)>;
+
+// Handlers of one path by method, what createResource() builds
+struct Resource {
+    std::string path;
+    std::map<std::string, HttpHandler> methods;
+    HttpErrorHandler errorHandler;
+};
+
+enum class BackendKind { RESTBED, ASIO };
+
+// Networking under Server: accepts the connections, reads the requests,
+// routes them to the resources and runs the scheduled tasks
+struct Backend {
+    using Task = std::function<void()>;
+
+    virtual ~Backend() = default;
+
+    virtual void publish(std::shared_ptr<const Resource> resource) = 0;
+
+    // Runs the task every interval, once for a zero interval
+    virtual void schedule(Task task, std::chrono::milliseconds interval) = 0;
+
+    // Listens on sockets handed over by a replaced process instead of binding
+    // the port. False if the backend can't, the caller closes them then
+    virtual bool adopt(const std::vector<int> &sockets) = 0;
+
+    // Blocks until stop(). ready is called once the backend listens
+    virtual void start(const std::shared_ptr<restbed::Settings> &settings,
+                       Task ready) = 0;
+
+    // Stops accepting connections, the open ones are served further. The
+    // listening sockets stay open in any process they were handed to
+    virtual void stopAccepting() = 0;
+
+    // Hands TLS record encryption to the kernel where it is supported, must
+    // be called before start(). False if the backend can't (restbed only
+    // encrypts through a memory BIO pair) or the kernel or OpenSSL lacks it
+    virtual bool enableKernelTls() {
+        return false;
+    }
+
+    // True if HttpSession::native() gives the restbed session
+    [[nodiscard]] virtual bool hasNativeSessions() const {
+        return false;
+    }
+
+    virtual void stop() = 0;
+};
+
+// reusePort lets several processes listen on the same port, where the
+// backend supports it
+[[nodiscard]] std::unique_ptr<Backend> makeBackend(BackendKind kind,
+                                                   bool reusePort = false);
+
+} // namespace restbes
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "fwd.h"
+
+#include <string>
+
+namespace restbes {
+
+// Bodies shorter than this are always sent as is
+inline constexpr std::size_t MIN_COMPRESSED_SIZE = 256;
+
+[[nodiscard]] Encoding negotiateEncoding(const std::string &accept_encoding);
+
+[[nodiscard]] const char *encodingName(Encoding encoding);
+
+[[nodiscard]] std::string compress(const std::string &body, Encoding encoding);
+
+// Immutable body together with all its precompressed variants, so that a
+// cached body (e.g. the menu) is compressed once per version
+struct CompressedBody {
+private:
+    std::string identity;
+    std::string gzip;
+    std::string deflate;
+    std::string brotli;
+
+public:
+    explicit CompressedBody(std::string body);
+
+    [[nodiscard]] const std::string &get(Encoding encoding) const;
+
+    [[nodiscard]] Encoding effectiveEncoding(Encoding encoding) const;
+};
+
+} // namespace restbes
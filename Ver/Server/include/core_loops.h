@@ -0,0 +1,34 @@
+#pragma once
+
+#include <folly/Function.h>
+#include <folly/io/async/ScopedEventBaseThread.h>
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace restbes {
+
+// Event loops pinned to cores. Every user is owned by one loop chosen by the
+// hash of its id: the user's state is only touched from that loop, other
+// threads post tasks to it instead of taking locks
+struct CoreLoops {
+private:
+    std::vector<std::unique_ptr<folly::ScopedEventBaseThread>> loops;
+
+public:
+    // count == 0 starts one loop per core
+    explicit CoreLoops(std::size_t count = 0);
+
+    [[nodiscard]] std::size_t size() const;
+
+    [[nodiscard]] std::size_t ownerOf(const std::string &key) const;
+
+    // Tasks posted to one loop run one by one in the order they were posted
+    void run(std::size_t loop, folly::Func task) const;
+
+    [[nodiscard]] bool isOwnerThread(std::size_t loop) const;
+};
+
+} // namespace restbes
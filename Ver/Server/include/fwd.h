@@ -1,7 +1,12 @@
 #pragma once
 
+#include <cstdint>
+
 namespace restbes {
 
+// Generation-tagged slot of the session table, see SlotMap
+using SessionId = std::uint64_t;
+
 struct User;
 
 enum Connection {
@@ -9,8 +14,31 @@ enum Connection {
     CLOSE
 };
 
+enum Encoding {
+    IDENTITY,
+    GZIP,
+    DEFLATE,
+    BROTLI
+};
+
+enum Transport {
+    LONG_POLL,
+    EVENT_STREAM,
+    WEB_SOCKET
+};
+
+enum OverflowPolicy {
+    DROP_OLDEST,
+    COALESCE,
+    DISCONNECT
+};
+
 struct Server;
 
 struct Session;
 
+struct CompressedBody;
+
+struct Notification;
+
 } // restbes
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <restbed>
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <system_error>
+
+namespace restbes {
+
+// WebSocket of an upgraded connection. The members mirror the part of
+// restbed::WebSocket the server uses; messages are restbed's on every backend
+struct WebSocketConnection : std::enable_shared_from_this<WebSocketConnection> {
+    using Message = std::shared_ptr<restbed::WebSocketMessage>;
+    using Callback =
+            std::function<void(const std::shared_ptr<WebSocketConnection>)>;
+    using MessageHandler = std::function<void(
+            const std::shared_ptr<WebSocketConnection>, const Message)>;
+    using ErrorHandler = std::function<void(
+            const std::shared_ptr<WebSocketConnection>, const std::error_code)>;
+
+    virtual ~WebSocketConnection() = default;
+
+    [[nodiscard]] virtual bool is_open() const = 0;
+
+    [[nodiscard]] virtual bool is_closed() const = 0;
+
+    // sent is called once the frame is on the socket
+    virtual void send(const Message &message, Callback sent = nullptr) = 0;
+
+    // Sends a close frame and closes the connection
+    virtual void close() = 0;
+
+    virtual void set_message_handler(MessageHandler handler) = 0;
+
+    virtual void set_close_handler(Callback handler) = 0;
+
+    virtual void set_error_handler(ErrorHandler handler) = 0;
+};
+
+using SharedWebSocket = std::shared_ptr<WebSocketConnection>;
+
+// Connection a request came in on, as the handlers see it. The members mirror
+// the part of restbed::Session the handlers use, so the same handlers run on
+// every backend, see backend.h
+struct HttpSession : std::enable_shared_from_this<HttpSession> {
+    using Callback = std::function<void(const std::shared_ptr<HttpSession>)>;
+    using FetchCallback = std::function<void(
+            const std::shared_ptr<HttpSession>, const restbed::Bytes &)>;
+    using UpgradeCallback = std::function<void(const SharedWebSocket)>;
+
+    virtual ~HttpSession() = default;
+
+    [[nodiscard]] virtual std::shared_ptr<const restbed::Request>
+    get_request() const = 0;
+
+    // "address:port" of the client
+    [[nodiscard]] virtual std::string get_origin() const = 0;
+
+    [[nodiscard]] virtual bool is_open() const = 0;
+
+    [[nodiscard]] virtual bool is_closed() const = 0;
+
+    // Reads length bytes of the request body
+    virtual void fetch(std::size_t length, FetchCallback callback) = 0;
+
+    // Writes the data, then waits for the next request on the connection or,
+    // when there is a callback, calls it instead
+    virtual void yield(const restbed::Bytes &data,
+                       Callback callback = nullptr) = 0;
+
+    virtual void yield(const restbed::Response &response) = 0;
+
+    // Writes the data and waits for the next request like yield() without a
+    // callback, calling written once the data is on the socket
+    virtual void write(const restbed::Bytes &data, Callback written) = 0;
+
+    // Writes the data and closes the connection
+    virtual void close(const restbed::Bytes &data) = 0;
+
+    virtual void close(const restbed::Response &response) = 0;
+
+    virtual void close(int status) = 0;
+
+    virtual void close() = 0;
+
+    // WebSocket handshake, the callback gets the socket once the headers
+    // are written
+    virtual void upgrade(int status,
+                         const std::multimap<std::string, std::string> &headers,
+                         UpgradeCallback callback) = 0;
+
+    // The restbed session behind this one, nullptr on other backends. For
+    // handlers written against restbed::Session, see createResource()
+    [[nodiscard]] virtual std::shared_ptr<restbed::Session> native() const {
+        return nullptr;
+    }
+};
+
+using SharedHttpSession = std::shared_ptr<HttpSession>;
+
+} // namespace restbes
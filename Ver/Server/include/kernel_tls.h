@@ -0,0 +1,24 @@
+#pragma once
+
+#include <openssl/ssl.h>
+
+namespace restbes {
+
+// Kernel TLS: after the handshake OpenSSL hands the record keys to the kernel
+// (TCP_ULP "tls"), so writes and SSL_sendfile are encrypted there instead of
+// in the worker threads. It only works for SSL objects that read and write
+// the socket themselves (SSL_set_fd). TLS through a memory BIO pair, like
+// restbed's and asio::ssl::stream's, stays in user space
+
+// Checks that the kernel can attach the tls ULP to a TCP socket
+[[nodiscard]] bool kernelTlsSupported();
+
+// Checks that both the kernel and the OpenSSL build can offload TLS records
+[[nodiscard]] bool kernelTlsAvailable();
+
+// Turns kTLS on for the connections of the context. Returns false and changes
+// nothing when the kernel or the OpenSSL build lacks support; connections
+// whose cipher the kernel can't offload stay in user space either way
+bool enableKernelTls(SSL_CTX *context);
+
+} // namespace restbes
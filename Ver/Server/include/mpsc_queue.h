@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace restbes {
+
+// Lock-free multi-producer single-consumer queue. Producers push with a single
+// CAS, the consumer takes everything that is pending at once
+template <class T>
+struct MpscQueue {
+private:
+    struct Node {
+        T value;
+        Node *next;
+    };
+
+    std::atomic<Node *> head{nullptr};
+
+public:
+    MpscQueue() = default;
+
+    MpscQueue(const MpscQueue &) = delete;
+
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    ~MpscQueue() {
+        consumeAll([](T &&) {});
+    }
+
+    void push(T value) {
+        auto node = new Node{std::move(value), head.load(std::memory_order_relaxed)};
+        while (!head.compare_exchange_weak(node->next, node,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed)) {
+        }
+    }
+
+    [[nodiscard]] bool empty() const {
+        return head.load(std::memory_order_acquire) == nullptr;
+    }
+
+    // Must only be called by one thread at a time. Values are passed to
+    // callback in the order they were pushed
+    template <class Callback>
+    void consumeAll(Callback &&callback) {
+        Node *node = head.exchange(nullptr, std::memory_order_acquire);
+        Node *reversed = nullptr;
+        while (node != nullptr) {
+            Node *next = node->next;
+            node->next = reversed;
+            reversed = node;
+            node = next;
+        }
+        while (reversed != nullptr) {
+            Node *next = reversed->next;
+            callback(std::move(reversed->value));
+            delete reversed;
+            reversed = next;
+        }
+    }
+};
+
+} // namespace restbes
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "fwd.h"
+#include "response.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace restbes {
+
+// Event delivered to sessions. It is preformatted both as a long-polling HTTP
+// response and as a text/event-stream frame
+struct Notification {
+private:
+    std::string event;
+    std::string data;
+    SharedResponse response;
+    std::string frame;
+    std::string key;
+    mutable std::once_flag deflatedOnce;
+    mutable std::string deflated;
+
+public:
+    Notification(std::string event, const std::string &data,
+                 SharedResponse response, std::string key = "");
+
+    // Comment frame (e.g. heartbeat) that is only written to event streams
+    static std::shared_ptr<const Notification>
+    comment(const std::string &text);
+
+    [[nodiscard]] const std::string &getEvent() const;
+
+    [[nodiscard]] const std::string &getData() const;
+
+    // Queued notifications with the same non-empty key collapse into the
+    // latest one, e.g. "cart" or "order:42"
+    [[nodiscard]] const std::string &getKey() const;
+
+    // permessage-deflate payload, compressed on first use
+    [[nodiscard]] const std::string &getDeflated() const;
+
+    // nullptr for notifications that are not sent to long-polling sessions
+    [[nodiscard]] const SharedResponse &getResponse() const;
+
+    [[nodiscard]] const std::string &getFrame() const;
+
+    [[nodiscard]] bool isComment() const;
+};
+
+using SharedNotification = std::shared_ptr<const Notification>;
+
+// WebSocket payload of a numbered event: the notification's JSON with the
+// event id added. Built on first use and shared by every session the event is
+// queued for, like the notification's own deflated payload
+struct NumberedMessage {
+private:
+    std::uint64_t id;
+    SharedNotification notification;
+    mutable std::once_flag dataOnce;
+    mutable std::string data;
+    mutable std::once_flag deflatedOnce;
+    mutable std::string deflated;
+
+public:
+    NumberedMessage(std::uint64_t id, SharedNotification notification);
+
+    [[nodiscard]] const std::string &getData() const;
+
+    // permessage-deflate payload, compressed on first use
+    [[nodiscard]] const std::string &getDeflated() const;
+};
+
+// Notification as it is queued for one session. id is the event id in the
+// user's history, 0 for events that are not recorded there
+struct Delivery {
+    std::uint64_t id = 0;
+    SharedNotification notification;
+    // Set on a marker without a notification: drop every queued event of the
+    // user, the history is replayed after replayFrom right behind the marker
+    std::uint64_t replayFrom = 0;
+    // Session whose request caused the event. It already has the change in
+    // the response, so the event is not sent back to it
+    SessionId origin = 0;
+    // Payload for WebSocket sessions, may be unset for numbered events that
+    // are queued for a single session
+    std::shared_ptr<const NumberedMessage> message;
+    // Order of the broadcast the event belongs to, 0 for other events. A
+    // session drops a broadcast that arrives after a newer one with the same
+    // key
+    std::uint64_t sequence = 0;
+};
+
+[[nodiscard]] SharedNotification makeNotification(const std::string &event,
+                                                  const std::string &data,
+                                                  std::string key = "");
+
+[[nodiscard]] SharedNotification
+makeNotification(const std::string &event, const std::string &data,
+                 SharedResponse response, std::string key = "");
+
+// Tells the client that missed events are no longer available
+[[nodiscard]] SharedNotification makeResyncNotification();
+
+// Asks the client to reconnect after the delay, resuming from lastEventId.
+// Sent while the server drains before an upgrade
+[[nodiscard]] SharedNotification
+makeReconnectNotification(std::chrono::milliseconds retry,
+                          std::uint64_t lastEventId);
+
+} // namespace restbes
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <folly/concurrency/ConcurrentHashMap.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace restbes {
+
+struct RateLimit {
+    // Requests allowed per second on average, 0 for no limit
+    double rate = 0;
+    // Requests allowed at once after a quiet period
+    double burst = 0;
+};
+
+// Token buckets of one resource, one bucket per client key. The limit can be
+// changed at any time, existing buckets pick it up on their next request
+struct RateLimiter {
+    using Clock = std::chrono::steady_clock;
+
+private:
+    struct Bucket {
+        std::mutex mutex;
+        double tokens;
+        Clock::time_point updated;
+        // Set under the mutex when the bucket leaves the map, a request that
+        // found it before that looks the key up again
+        bool expired = false;
+
+        Bucket(double tokens, Clock::time_point updated)
+            : tokens(tokens), updated(updated) {}
+    };
+
+    std::atomic<double> rate{0};
+    std::atomic<double> burst{0};
+    folly::ConcurrentHashMap<std::string, std::shared_ptr<Bucket>> buckets;
+
+public:
+    void setLimit(RateLimit limit);
+
+    [[nodiscard]] RateLimit getLimit() const;
+
+    // Takes a token from the key's bucket, false if it is empty
+    [[nodiscard]] bool tryAcquire(const std::string &key,
+                                  Clock::time_point now = Clock::now());
+
+    // Forgets the buckets that have refilled completely: they behave the same
+    // as new ones
+    void expire(Clock::time_point now = Clock::now());
+};
+
+} // namespace restbes
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "fwd.h"
+#include "http_session.h"
+
+#include <folly/Executor.h>
+#include <folly/experimental/coro/Task.h>
+#include <folly/futures/Future.h>
+#include <restbed>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace restbes {
+
+template <class T = void>
+using task = folly::coro::Task<T>;
+
+// One request to a coroutine handler, see createCoroutineResource(). Lives
+// until the handler completes. The handler runs on the admission pool and
+// gives its thread back at every co_await, so blocking calls go through
+// blocking() and waits through sleep()
+struct RequestContext {
+private:
+    SharedHttpSession session;
+    std::shared_ptr<Server> server;
+    std::string body;
+    folly::Executor::KeepAlive<> blockingExecutor;
+    mutable std::atomic<bool> responded{false};
+
+public:
+    RequestContext(SharedHttpSession session, std::shared_ptr<Server> server,
+                   std::string body,
+                   folly::Executor::KeepAlive<> blockingExecutor);
+
+    [[nodiscard]] const SharedHttpSession &getSession() const;
+
+    [[nodiscard]] const std::shared_ptr<Server> &getServer() const;
+
+    [[nodiscard]] std::shared_ptr<const restbed::Request> getRequest() const;
+
+    // Empty unless the request had a Content-Length
+    [[nodiscard]] const std::string &getBody() const;
+
+    // Final reply, see restbes::respond()
+    void respond(const std::string &data, const std::string &content_type) const;
+
+    // True once respond() or write() has put something on the connection,
+    // an error reply can't follow then
+    [[nodiscard]] bool hasResponded() const;
+
+    // Resumes once the data is written. The connection stays with the
+    // handler: it has to respond() or close the session afterwards
+    task<void> write(restbed::Bytes data) const;
+
+    // Runs a blocking call, like a database query, on the server's blocking
+    // pool and resumes with its result
+    template <class Call>
+    task<std::invoke_result_t<Call>> blocking(Call call) const {
+        if constexpr (std::is_void_v<std::invoke_result_t<Call>>)
+            co_await folly::via(blockingExecutor, std::move(call));
+        else
+            co_return co_await folly::via(blockingExecutor, std::move(call));
+    }
+
+    task<void> sleep(std::chrono::milliseconds duration) const;
+};
+
+} // namespace restbes
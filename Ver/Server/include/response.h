@@ -0,0 +1,42 @@
+#pragma once
+
+#include "fwd.h"
+
+#include <restbed>
+
+#include <memory>
+#include <string>
+
+namespace restbes {
+
+// Fully serialized HTTP response. It is immutable, so one instance can be
+// written to any number of sessions without copying
+struct SerializedResponse {
+private:
+    restbed::Bytes bytes;
+    std::size_t headLength;
+
+public:
+    explicit SerializedResponse(const restbed::Response &response);
+
+    [[nodiscard]] const restbed::Bytes &getBytes() const;
+
+    [[nodiscard]] std::size_t size() const;
+
+    // extraHeaders must be a sequence of complete "Name: value\r\n" lines
+    void appendTo(restbed::Bytes &out,
+                  const std::string &extraHeaders = "") const;
+};
+
+using SharedResponse = std::shared_ptr<const SerializedResponse>;
+
+[[nodiscard]] std::shared_ptr<restbed::Response> acquireResponse();
+
+[[nodiscard]] SharedResponse serializeResponse(const restbed::Response &response);
+
+[[nodiscard]] SharedResponse
+generateSerializedResponse(const std::string &body,
+                           const std::string &content_type,
+                           Connection connection = Connection::KEEP_ALIVE);
+
+} // namespace restbes
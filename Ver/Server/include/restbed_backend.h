@@ -0,0 +1,36 @@
+#pragma once
+
+#include "backend.h"
+
+#include <restbed>
+
+#include <memory>
+
+namespace restbes {
+
+// Backend on restbed::Service. Binds its own sockets, so a graceful upgrade
+// rebinds the port instead of adopting the handed sockets
+struct RestbedBackend : Backend {
+private:
+    std::shared_ptr<restbed::Service> service;
+
+public:
+    RestbedBackend();
+
+    void publish(std::shared_ptr<const Resource> resource) override;
+
+    void schedule(Task task, std::chrono::milliseconds interval) override;
+
+    bool adopt(const std::vector<int> &sockets) override;
+
+    void start(const std::shared_ptr<restbed::Settings> &settings,
+               Task ready) override;
+
+    void stopAccepting() override;
+
+    [[nodiscard]] bool hasNativeSessions() const override;
+
+    void stop() override;
+};
+
+} // namespace restbes
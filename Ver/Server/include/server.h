@@ -1,109 +1,441 @@
 #pragma once
 
+#include "admission.h"
+#include "backend.h"
+#include "core_loops.h"
 #include "fwd.h"
-
-#include <folly/Synchronized.h>
+#include "mpsc_queue.h"
+#include "notification.h"
+#include "rate_limiter.h"
+#include "request_context.h"
+#include "response.h"
+#include "session.h"
+#include "slot_map.h"
+#include "timer_wheel.h"
+#include "worker_group.h"
+
+#include <folly/concurrency/ConcurrentHashMap.h>
+#include <folly/executors/CPUThreadPoolExecutor.h>
 #include <restbed>
 
+#include <atomic>
+#include <cstdint>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace restbes {
 
-using restbed_HTTP_Handler =
-    std::function<void(std::shared_ptr<restbed::Session>)>;
-using restbed_ErrorHandler = std::function<void(
-    const int, const std::exception &, std::shared_ptr<restbed::Session>)>;
+enum ResponseCode {
+  OK = 200,
+  TOO_MANY_REQUESTS = 429,
+  INTERNAL_SERVER_ERROR = 500,
+  SERVICE_UNAVAILABLE = 503
+};
 
-enum ResponseCode { OK = 200 };
+// How often an open session is checked for being closed by the peer
+inline constexpr std::chrono::seconds SESSION_CHECK_INTERVAL{60};
+// How long a closed session is kept so the client can reconnect to it
+inline constexpr std::chrono::seconds SESSION_RECONNECT_GRACE{2};
+// How long a user without sessions is kept before it is evicted
+inline constexpr std::chrono::minutes USER_IDLE_TTL{5};
+// Users kept in memory before the least recently active ones without
+// sessions are evicted ahead of their TTL
+inline constexpr std::size_t MAX_USERS = 100000;
+// Number of sessions or users one fan-out task pushes a broadcast to
+inline constexpr std::size_t FAN_OUT_BATCH_SIZE = 256;
+// Threads running request handlers behind the admission scheduler
+inline constexpr std::size_t HANDLER_THREADS = 10;
+// Threads running the blocking calls of coroutine handlers
+inline constexpr std::size_t BLOCKING_THREADS = 16;
+// Session ids carry the index of their worker process in the bits above the
+// slot index, so a worker recognizes the ids issued by the others
+inline constexpr int SESSION_WORKER_SHIFT = 24;
+
+// Graceful upgrade: how the old process lets its clients go
+struct DrainLimits {
+  // Reconnect hints are spread evenly over this time
+  std::chrono::milliseconds spread{5000};
+  // Longest wait for the admitted requests to complete
+  std::chrono::milliseconds timeout{10000};
+};
 
 struct Server {
-  using GET_Handler = std::function<void(std::shared_ptr<restbed::Session>,
+  using GET_Handler = std::function<void(SharedHttpSession,
                                          std::shared_ptr<Server> server)>;
   using POST_Handler =
-      std::function<void(std::shared_ptr<restbed::Session>, const std::string &,
+      std::function<void(SharedHttpSession, const std::string &,
                          std::shared_ptr<Server> server)>;
   using ErrorHandler = std::function<void(const int, const std::exception &,
-                                          std::shared_ptr<restbed::Session>,
+                                          SharedHttpSession,
                                           std::shared_ptr<Server>)>;
+  // Handlers written against restbed's session run unchanged, on the restbed
+  // backend only
+  using RestbedGET_Handler =
+      std::function<void(std::shared_ptr<restbed::Session>,
+                         std::shared_ptr<Server> server)>;
+  using RestbedPOST_Handler =
+      std::function<void(std::shared_ptr<restbed::Session>,
+                         const std::string &, std::shared_ptr<Server> server)>;
+  using RestbedErrorHandler =
+      std::function<void(const int, const std::exception &,
+                         std::shared_ptr<restbed::Session>,
+                         std::shared_ptr<Server>)>;
+  // Returns at its first co_await, the rest runs on the server's executors
+  using CoroutineHandler = std::function<task<void>(RequestContext &)>;
+  using WebSocketHandler =
+      std::function<void(std::shared_ptr<Session>, const std::string &,
+                         std::shared_ptr<Server> server)>;
   using ScheduledTask = std::function<void(std::shared_ptr<Server> server)>;
-  using UserCollection = std::unordered_map<std::string, std::shared_ptr<User>>;
-  using SessionCollection =
-      std::unordered_map<unsigned int, std::shared_ptr<Session>>;
+  // Called once a broadcast was pushed to every recipient
+  using BroadcastListener =
+      std::function<void(const Notification &, std::size_t recipients,
+                         std::chrono::microseconds latency)>;
+  using UserCollection =
+      folly::ConcurrentHashMap<std::string, std::shared_ptr<User>>;
+  using SessionCollection = SlotMap<Session>;
+  // Called for broadcasts received from the other worker processes before
+  // they are pushed to the local sessions
+  using PeerBroadcastListener = std::function<void(const Notification &)>;
+  using RateLimiterCollection =
+      folly::ConcurrentHashMap<std::string, std::shared_ptr<RateLimiter>>;
 
 private:
-  folly::Synchronized<UserCollection> users;
-  folly::Synchronized<SessionCollection> sessions;
+  UserCollection users;
+  SessionCollection sessions;
+  // Only the latest check of a session counts, see Session::rearmExpiry()
+  struct SessionCheck {
+    SessionId session_id;
+    std::uint64_t generation;
+  };
+
+  TimerWheel<SessionCheck> sessionExpiry{64, std::chrono::seconds(1)};
+  TimerWheel<std::string> userExpiry{64, std::chrono::seconds(1)};
+  std::chrono::seconds userIdleTtl{USER_IDLE_TTL};
+  std::size_t maxUsers = MAX_USERS;
+  // Users without sessions, least recently active first
+  std::mutex idleUsersMutex;
+  std::list<std::pair<const User *, std::weak_ptr<User>>> idleUsers;
+  std::unordered_map<const User *, decltype(idleUsers)::iterator> idlePositions;
+  std::chrono::milliseconds flushWindow{0};
+  MpscQueue<SessionId> deferredFlushes;
+  QueueLimits queueLimits;
+  std::shared_ptr<folly::CPUThreadPoolExecutor> fanOutPool;
+  // Started on first use, so that setCoreLoops() starts the loops only once
+  std::size_t coreLoopCount = 0;
+  mutable std::once_flag coreLoopsStarted;
+  mutable std::unique_ptr<CoreLoops> coreLoops;
+  std::unique_ptr<AdmissionScheduler> admission;
+  std::shared_ptr<folly::CPUThreadPoolExecutor> blockingPool;
+  BroadcastListener broadcastListener;
+  // One limiter per resource path
+  RateLimiterCollection rateLimiters;
+  std::unique_ptr<WorkerGroup> workerGroup;
+  PeerBroadcastListener peerBroadcastListener;
+  SessionId workerTag = 0;
+  std::string upgradeSocket;
+  DrainLimits drainLimits;
+  // Set once the server started to drain, its replies then close connections
+  std::atomic<bool> draining{false};
+  // Dropped notifications of the sessions that were already erased
+  std::atomic<std::uint64_t> droppedByErased{0};
+  // Orders broadcasts to sessions, see Delivery::sequence
+  std::atomic<std::uint64_t> broadcastSequence{0};
+  std::atomic<std::uint64_t> failedPushes{0};
 
   std::shared_ptr<restbed::Settings> settings;
-  std::shared_ptr<restbed::Service> service;
+  std::unique_ptr<Backend> backend;
+
+  void broadcast(const SharedNotification &notification,
+                 std::vector<std::shared_ptr<Session>> sessions,
+                 std::vector<std::shared_ptr<User>> users);
+
+  void pushToLocalSessions(const SharedNotification &notification);
+
+  // Evicts idle users, least recently active first, until the registry is
+  // back at maxUsers
+  void evictLeastRecentlyIdle();
+
+  // Replaces the pending expiry check of the session
+  void scheduleSessionCheck(const std::shared_ptr<Session> &session,
+                            std::chrono::steady_clock::duration delay);
 
-  inline static std::atomic<unsigned int> sessionCounter{0};
+  // Answers with Connection: close, hints every session to reconnect and
+  // stops the backend once they had the time to
+  void drain();
 
-  [[nodiscard]] static restbed_HTTP_Handler
+  [[nodiscard]] static HttpHandler
   generatePostMethodHandler(const POST_Handler &callback,
-                            std::shared_ptr<Server> server);
+                            const ErrorHandler &errorHandler,
+                            std::shared_ptr<Server> server,
+                            std::shared_ptr<RateLimiter> limiter,
+                            Priority priority);
 
-  [[nodiscard]] static restbed_HTTP_Handler
+  [[nodiscard]] static HttpHandler
   generateGetMethodHandler(const GET_Handler &callback,
-                           std::shared_ptr<Server> server);
+                           const ErrorHandler &errorHandler,
+                           std::shared_ptr<Server> server,
+                           std::shared_ptr<RateLimiter> limiter,
+                           Priority priority);
+
+  [[nodiscard]] static HttpHandler
+  generateCoroutineHandler(const CoroutineHandler &callback,
+                           const ErrorHandler &errorHandler,
+                           std::shared_ptr<Server> server,
+                           std::shared_ptr<RateLimiter> limiter,
+                           Priority priority);
+
+  [[nodiscard]] static HttpHandler
+  generateWebSocketHandler(const WebSocketHandler &callback,
+                           std::shared_ptr<Server> server,
+                           std::shared_ptr<RateLimiter> limiter);
 
   [[nodiscard]] static std::function<void(void)>
   generateScheduledTask(const ScheduledTask &task,
                         std::shared_ptr<Server> server);
 
-  [[nodiscard]] static restbed_ErrorHandler
+  [[nodiscard]] static HttpErrorHandler
   generateErrorHandler(const ErrorHandler &callback,
                        std::shared_ptr<Server> server);
 
-  friend std::shared_ptr<restbed::Resource>
+  friend std::shared_ptr<Resource>
   createResource(const std::string &path,
                  const std::optional<GET_Handler> &getMethodHandler,
                  const std::optional<POST_Handler> &postMethodHandler,
                  const ErrorHandler &errorHandler,
-                 std::shared_ptr<Server> server);
+                 std::shared_ptr<Server> server, Priority priority);
+
+  // Throws std::logic_error unless the backend is restbed
+  friend std::shared_ptr<Resource>
+  createResource(const std::string &path,
+                 const std::optional<RestbedGET_Handler> &getMethodHandler,
+                 const std::optional<RestbedPOST_Handler> &postMethodHandler,
+                 const RestbedErrorHandler &errorHandler,
+                 std::shared_ptr<Server> server, Priority priority);
+
+  friend std::shared_ptr<Resource>
+  createCoroutineResource(const std::string &path,
+                          const std::optional<CoroutineHandler> &getMethodHandler,
+                          const std::optional<CoroutineHandler> &postMethodHandler,
+                          const ErrorHandler &errorHandler,
+                          std::shared_ptr<Server> server, Priority priority);
+
+  // Every message counts against the rate limit of limitedPath, so that
+  // commands sent over the socket share the limit of their HTTP resource
+  friend std::shared_ptr<Resource>
+  createWebSocketResource(const std::string &path,
+                          const WebSocketHandler &messageHandler,
+                          const ErrorHandler &errorHandler,
+                          std::shared_ptr<Server> server,
+                          const std::string &limitedPath);
 
 public:
   Server();
 
-  [[nodiscard]] folly::Synchronized<UserCollection>::ConstRLockedPtr
-  getUsers() const;
+  [[nodiscard]] const UserCollection &getUsers() const;
 
-  folly::Synchronized<UserCollection>::WLockedPtr getUsersW();
+  [[nodiscard]] const SessionCollection &getSessions() const;
 
-  [[nodiscard]] folly::Synchronized<SessionCollection>::ConstRLockedPtr
-  getSessions() const;
-
-  [[nodiscard]] folly::Synchronized<SessionCollection>::WLockedPtr
-  getSessionsW();
+  [[nodiscard]] SessionCollection &getSessions();
 
   [[nodiscard]] std::shared_ptr<Session>
-  getSession(unsigned int session_id) const;
+  getSession(SessionId session_id) const;
+
+  SessionId addSession(SharedHttpSession session,
+                       std::string user_id,
+                       Transport transport = Transport::LONG_POLL);
+
+  // Gives the client SESSION_RECONNECT_GRACE to reattach, from now. Later
+  // calls for the same close do nothing
+  void sessionClosed(SessionId session_id);
+
+  void expireSessions();
+
+  // Notifications pushed to a session within the window are coalesced and
+  // written together by flushSessions(). Zero writes them right away
+  void setFlushWindow(std::chrono::milliseconds window);
+
+  [[nodiscard]] std::chrono::milliseconds getFlushWindow() const;
 
-  unsigned int addSession(std::shared_ptr<restbed::Session> session,
-                          std::string user_id);
+  void flushSessions();
 
-  void assignSession(unsigned int session_id, const std::string &user_id) const;
+  void setQueueLimits(QueueLimits limits);
+
+  [[nodiscard]] const QueueLimits &getQueueLimits() const;
+
+  // Queues the session for the next flushSessions()
+  void deferFlush(SessionId session_id);
+
+  // Notifications lost to session queue overflow since the start
+  [[nodiscard]] std::uint64_t getDroppedCount() const;
+
+  // Broadcast recipients whose push threw since the start
+  [[nodiscard]] std::uint64_t getFailedPushCount() const;
+
+  // Messages to the other worker processes dropped since the start, their
+  // users are asked to resync
+  [[nodiscard]] std::uint64_t getPeerDroppedCount() const;
+
+  void assignSession(SessionId session_id, const std::string &user_id) const;
+
+  void replayEvents(SessionId session_id, const std::string &user_id,
+                    std::uint64_t lastEventId) const;
 
   [[nodiscard]] std::shared_ptr<User> getUser(const std::string &name) const;
 
+  std::shared_ptr<User> getOrCreateUser(const std::string &name);
+
+  static std::shared_ptr<User>
+  getOrCreateUser(const std::string &name, const std::shared_ptr<Server> &serv);
+
+  void setUserIdleTtl(std::chrono::seconds ttl);
+
+  [[nodiscard]] std::chrono::seconds getUserIdleTtl() const;
+
+  // Checks the user for eviction once the delay has passed
+  void scheduleUserExpiry(const std::string &name,
+                          std::chrono::steady_clock::duration delay);
+
+  // Evicts users that have had no sessions for the idle TTL. They are
+  // recreated on demand, with a fresh event history
+  void expireUsers();
+
+  // Removes the user from the registry unless it was already replaced
+  bool eraseUser(const std::string &name, const std::shared_ptr<User> &user);
+
+  // 0 for no limit
+  void setMaxUsers(std::size_t count);
+
+  // The user has no sessions left and may be evicted early
+  void markUserIdle(const std::shared_ptr<User> &user);
+
+  // The user got a session or was evicted
+  void unmarkUserIdle(const User &user);
+
   static void addUser(const std::string &name, std::shared_ptr<Server> serv);
 
-  void addResource(std::shared_ptr<restbed::Resource> resource);
+  void addResource(std::shared_ptr<Resource> resource);
 
   void setSettings(std::shared_ptr<restbed::Settings> newSettings);
 
+  // restbed unless replaced. Must be called before any resource is added or
+  // task scheduled
+  void setBackend(std::unique_ptr<Backend> newBackend);
+
+  // See Backend::enableKernelTls, false unless the backend supports it
+  bool enableKernelTls();
+
   void schedule(const ScheduledTask &task, std::shared_ptr<Server> server,
                 const std::chrono::duration<int64_t, std::ratio<1, 1000>>
                     &interval = std::chrono::milliseconds::zero());
 
   void startServer();
 
-  void pushToAllSessions(std::shared_ptr<restbed::Response> response);
+  void setFanOutThreads(std::size_t threads);
+
+  // Must be called before any user is created: users keep the index of
+  // their loop. Has no effect once the loops started
+  void setCoreLoops(std::size_t count);
+
+  [[nodiscard]] const CoreLoops &getCoreLoops() const;
+
+  void setBroadcastListener(BroadcastListener listener);
+
+  // Must be called before any session is added: session ids are tagged with
+  // the index of the worker
+  void setWorkerGroup(std::unique_ptr<WorkerGroup> group);
+
+  // True for the local sessions and for the ids issued by the other workers
+  [[nodiscard]] bool hasSession(SessionId session_id) const;
+
+  // 0 when the server runs as a single process
+  [[nodiscard]] std::size_t getWorkerIndex() const;
+
+  void setPeerBroadcastListener(PeerBroadcastListener listener);
+
+  // Records in the worker directory whether the user has sessions here
+  void userOnline(const std::string &name) const;
+
+  void userOffline(const std::string &name) const;
+
+  // True if the user is known here or may have sessions in another worker
+  [[nodiscard]] bool hasUser(const std::string &name) const;
+
+  // Pushes to the user's sessions in every worker process
+  void pushToUser(const std::string &name,
+                  const SharedNotification &notification,
+                  SessionId origin = 0);
+
+  // Handlers of createResource() resources run on this many threads, in
+  // the order of their resource priority
+  void setHandlerThreads(std::size_t threads);
+
+  // Beyond the limits, requests are answered with 503 starting from the
+  // lowest priority
+  void setAdmissionLimits(AdmissionLimits limits);
+
+  [[nodiscard]] std::uint64_t getShedCount() const;
+
+  [[nodiscard]] std::chrono::microseconds getAdmissionDelay() const;
+
+  // Bounds the blocking calls, like database queries, that coroutine
+  // handlers run at once
+  void setBlockingThreads(std::size_t threads);
+
+  [[nodiscard]] folly::Executor::KeepAlive<> getBlockingExecutor() const;
+
+  // Limiter of the resource at the path, created without a limit on first use
+  std::shared_ptr<RateLimiter> getRateLimiter(const std::string &path);
+
+  // Requests to the resource are limited per User-ID, or Session-ID, or
+  // client address when neither is sent. Takes effect immediately
+  void setRateLimit(const std::string &path, RateLimit limit);
+
+  void expireRateLimits();
+
+  // The server waits on the Unix socket for its replacement, see upgrade.h.
+  // Before it starts, it takes over from the process already waiting there.
+  // Only a backend that adopts sockets keeps the port open in between, with
+  // restbed the inherited sockets are closed and the port is bound again
+  void setUpgradeSocket(const std::string &path, DrainLimits limits = {});
+
+  [[nodiscard]] bool isDraining() const;
+
+  // Broadcasts return right away, the recipients are snapshotted and pushed
+  // to in batches by the fan-out pool
+  void pushToAllSessions(const SharedNotification &notification);
+
+  void pushToStreamingSessions(const SharedNotification &notification);
 };
 
 [[nodiscard]] std::shared_ptr<restbed::Response>
 generateResponse(const std::string &body, const std::string &content_type,
-                 Connection connection = Connection::CLOSE);
+                 Connection connection = Connection::CLOSE,
+                 Encoding encoding = Encoding::IDENTITY);
+
+[[nodiscard]] std::shared_ptr<restbed::Response>
+generateResponse(const CompressedBody &body, const std::string &content_type,
+                 Connection connection = Connection::CLOSE,
+                 Encoding encoding = Encoding::IDENTITY);
+
+[[nodiscard]] Encoding
+acceptedEncoding(const SharedHttpSession &session);
+
+// Keep-alive unless the client asked to close the connection or the server
+// is draining
+[[nodiscard]] Connection
+requestedConnection(const SharedHttpSession &session, const Server &server);
+
+// Replies with the connection kept open when the client allows it
+void respond(const SharedHttpSession &session, const Server &server,
+             const std::string &body, const std::string &content_type);
+
+void respond(const SharedHttpSession &session, const Server &server,
+             const CompressedBody &body, const std::string &content_type);
 
 std::shared_ptr<restbed::Settings>
 createSettingsWithSSL(const std::string &SSL_ServerKey,
@@ -1,30 +1,108 @@
 #pragma once
 
 #include "fwd.h"
+#include "http_session.h"
+#include "mpsc_queue.h"
+#include "notification.h"
 
 #include <restbed>
-#include <folly/Synchronized.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <memory>
-#include <queue>
+#include <string>
+#include <unordered_map>
 
 namespace restbes {
 
-struct Session {
-private:
-    std::shared_ptr<restbed::Session> session;
-    folly::Synchronized<std::string> user_id;
-    folly::Synchronized<unsigned int> session_id;
-    folly::Synchronized<std::queue<std::shared_ptr<restbed::Response>>> responseQueue;
+// Bounds of the notifications queued for a session that were not written yet
+// or not acknowledged by the socket. 0 means no limit. On overflow the queue
+// either loses its oldest events, collapses into one resync_required event,
+// or the connection is closed and the client gets resync_required on
+// reconnect
+struct QueueLimits {
+    std::size_t maxCount = 0;
+    std::size_t maxBytes = 0;
+    OverflowPolicy policy = OverflowPolicy::COALESCE;
+};
 
-    void yieldFromQueue();
+struct Session : std::enable_shared_from_this<Session> {
+private:
+    struct Attachment {
+        SharedHttpSession session;
+        Transport transport;
+        SharedWebSocket socket;
+        bool deflate = false;
+        bool binary = false;
+        // Bytes handed to this connection whose write has not completed yet.
+        // Per attachment, so that writes to a replaced connection do not
+        // count against the new one
+        mutable std::atomic<std::size_t> unacknowledged{0};
+
+        Attachment(SharedHttpSession session, Transport transport,
+                   SharedWebSocket socket = nullptr, bool deflate = false,
+                   bool binary = false);
+
+        [[nodiscard]] bool is_open() const;
+
+        [[nodiscard]] bool is_closed() const;
+    };
+
+    std::shared_ptr<const Attachment> attachment;
+    std::shared_ptr<const std::string> user_id;
+    const SessionId session_id;
+    MpscQueue<Delivery> incoming;
+    std::atomic<unsigned int> drainRequests{0};
+    std::atomic<std::chrono::steady_clock::rep> lastActivity;
+    std::atomic<bool> closeReported{false};
+    // Generation of the pending expiry check, older checks are ignored
+    std::atomic<std::uint64_t> expiryGeneration{0};
+    // Owns the session table this session lives in
+    Server *server;
+    std::atomic<bool> flushScheduled{false};
+    std::atomic<std::uint64_t> dropped{0};
+
+    // Owned by the drainer
+    std::deque<Delivery> pending;
+    std::shared_ptr<const Attachment> drained;
+    // Latest broadcast sequence seen per notification key
+    std::unordered_map<std::string, std::uint64_t> broadcastSequences;
+
+    void scheduleDrain();
+
+    void drain();
+
+    void enqueue(Delivery &&delivery);
+
+    [[nodiscard]] bool overLimits(const Attachment &current) const;
+
+    void enforceLimits(const Attachment &current);
+
+    // Counts the data towards the attachment's unacknowledged bytes until
+    // written is called
+    std::function<void()>
+    trackWrite(const std::shared_ptr<const Attachment> &current,
+               std::size_t size);
+
+    void sendToSocket(const std::shared_ptr<const Attachment> &current,
+                      const std::string &data, const std::string &deflated);
+
+    [[nodiscard]] std::shared_ptr<const Attachment> getAttachment() const;
 
 public:
-    Session(std::shared_ptr<restbed::Session> ss, std::string uid);
+    Session(SharedHttpSession ss, std::string uid,
+            SessionId id, Server *owner,
+            Transport transport = Transport::LONG_POLL);
 
     void setUser(std::string uid);
 
-    void setSession(std::shared_ptr<restbed::Session> ss);
+    void setSession(SharedHttpSession ss,
+                    Transport transport = Transport::LONG_POLL);
+
+    void setWebSocket(SharedWebSocket socket, bool deflate, bool binary);
 
     [[nodiscard]] bool is_open() const;
 
@@ -32,15 +110,39 @@ public:
 
     [[nodiscard]] std::string getPath() const;
 
-    void push(std::shared_ptr<restbed::Response> response);
+    void push(SharedNotification notification);
+
+    void push(Delivery delivery);
+
+    // Writes everything queued since the deferred flush was requested
+    void flush();
+
+    // Queues a reply for the WebSocket as an un-numbered event, so that it is
+    // written by the drainer in order with the notifications
+    void sendMessage(const std::string &data);
 
     [[nodiscard]] std::string getUserId() const;
 
-    [[nodiscard]] std::shared_ptr<restbed::Session> getSession() const;
+    [[nodiscard]] SharedHttpSession getSession() const;
+
+    [[nodiscard]] Transport getTransport() const;
+
+    [[nodiscard]] SessionId getId() const;
+
+    // Time since the last attach or, once the close was reported, since the
+    // close
+    [[nodiscard]] std::chrono::steady_clock::duration idleFor() const;
+
+    // True only for the first report of the current attachment's close
+    bool reportClosed();
 
-    [[nodiscard]] unsigned int getId() const;
+    // Generation for a new expiry check, superseding the pending one
+    std::uint64_t rearmExpiry();
 
+    [[nodiscard]] bool isExpiryCurrent(std::uint64_t generation) const;
 
+    // Number of notifications lost to queue overflow
+    [[nodiscard]] std::uint64_t getDroppedCount() const;
 };
 
 } // namespace restbes
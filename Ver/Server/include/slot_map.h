@@ -0,0 +1,156 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace restbes {
+
+// Table of objects addressed by 64-bit ids: the low half is the index of a
+// slot, the high half is the generation of the slot, which changes whenever
+// it is freed. Lookups are an array index and a generation check and do not
+// take the map's mutex, so stale ids are rejected cheaply. The objects are
+// still separately allocated and held by shared_ptr, copied out under a spin
+// lock of the slot, so a lookup only contends with a writer of the same slot.
+// emplace() and erase() serialize on a mutex and reuse freed slots. Slots are
+// allocated in chunks that are never moved or freed while the map is alive.
+// Generations start at the value given to the constructor, so ids of another
+// map, e.g. the one of a process this one replaced, are unlikely to resolve
+// here
+template <class T>
+struct SlotMap {
+    using Id = std::uint64_t;
+
+    static constexpr std::size_t CHUNK_SIZE = 4096;
+    static constexpr std::size_t MAX_CHUNKS = 4096;
+
+private:
+    struct Slot {
+        std::atomic<std::uint32_t> generation{1};
+        // Guards value, held only to copy or swap it
+        mutable std::atomic_flag busy;
+        std::shared_ptr<T> value;
+
+        [[nodiscard]] std::shared_ptr<T> load() const {
+            while (busy.test_and_set(std::memory_order_acquire)) {
+            }
+            auto copy = value;
+            busy.clear(std::memory_order_release);
+            return copy;
+        }
+
+        void store(std::shared_ptr<T> replacement) {
+            while (busy.test_and_set(std::memory_order_acquire)) {
+            }
+            value.swap(replacement);
+            busy.clear(std::memory_order_release);
+            // The old object is released outside the lock
+        }
+    };
+
+    using Chunk = std::array<Slot, CHUNK_SIZE>;
+
+    std::array<std::atomic<Chunk *>, MAX_CHUNKS> chunks{};
+    std::atomic<std::size_t> chunkCount{0};
+    std::atomic<std::size_t> count{0};
+    std::mutex mutex;
+    std::vector<std::uint32_t> freeSlots;
+    std::uint32_t nextSlot = 0;
+    const std::uint32_t firstGeneration;
+
+    [[nodiscard]] Slot *slot(Id id) const {
+        auto index = static_cast<std::uint32_t>(id);
+        if (index / CHUNK_SIZE >= MAX_CHUNKS) return nullptr;
+        Chunk *chunk = chunks[index / CHUNK_SIZE].load(std::memory_order_acquire);
+        if (chunk == nullptr) return nullptr;
+        return &(*chunk)[index % CHUNK_SIZE];
+    }
+
+public:
+    explicit SlotMap(std::uint32_t firstGeneration = 1)
+            : firstGeneration(firstGeneration == 0 ? 1 : firstGeneration) {}
+
+    SlotMap(const SlotMap &) = delete;
+
+    SlotMap &operator=(const SlotMap &) = delete;
+
+    ~SlotMap() {
+        for (auto &chunk: chunks) delete chunk.load();
+    }
+
+    // make(id) creates the object stored under the new id. Returns 0 when
+    // the map is full
+    template <class Make>
+    Id emplace(Make &&make) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::uint32_t index;
+        if (!freeSlots.empty()) {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            if (nextSlot / CHUNK_SIZE >= MAX_CHUNKS) return 0;
+            if (nextSlot % CHUNK_SIZE == 0) {
+                auto chunk = new Chunk();
+                for (auto &entry: *chunk)
+                    entry.generation.store(firstGeneration,
+                                           std::memory_order_relaxed);
+                chunks[nextSlot / CHUNK_SIZE].store(chunk,
+                                                    std::memory_order_release);
+                ++chunkCount;
+            }
+            index = nextSlot++;
+        }
+        Slot *free = slot(index);
+        Id id = static_cast<Id>(free->generation.load()) << 32 | index;
+        free->store(std::shared_ptr<T>(make(id)));
+        ++count;
+        return id;
+    }
+
+    [[nodiscard]] std::shared_ptr<T> find(Id id) const {
+        Slot *found = slot(id);
+        if (found == nullptr) return nullptr;
+        auto value = found->load();
+        if (found->generation.load(std::memory_order_acquire) != id >> 32)
+            return nullptr;
+        return value;
+    }
+
+    bool erase(Id id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Slot *found = slot(id);
+        if (found == nullptr || found->generation.load() != id >> 32 ||
+            found->load() == nullptr)
+            return false;
+        found->store(nullptr);
+        auto generation = found->generation.load() + 1;
+        found->generation.store(generation == 0 ? 1 : generation,
+                                std::memory_order_release);
+        freeSlots.push_back(static_cast<std::uint32_t>(id));
+        --count;
+        return true;
+    }
+
+    [[nodiscard]] std::size_t size() const {
+        return count.load();
+    }
+
+    // Visits every stored object. Objects inserted or erased concurrently may
+    // or may not be visited
+    template <class Callback>
+    void forEach(Callback &&callback) const {
+        auto allocated = chunkCount.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < allocated; ++i) {
+            Chunk *chunk = chunks[i].load(std::memory_order_acquire);
+            for (auto &entry: *chunk) {
+                auto value = entry.load();
+                if (value != nullptr) callback(value);
+            }
+        }
+    }
+};
+
+} // namespace restbes
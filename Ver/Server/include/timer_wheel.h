@@ -0,0 +1,79 @@
+#pragma once
+
+#include "mpsc_queue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+namespace restbes {
+
+// Hashed timer wheel. schedule() is lock-free and may be called from any
+// thread, advance() must be called periodically from a single thread and only
+// touches the slots that have elapsed since the previous call. A timer fires
+// on the first advance() at least its delay after schedule(), rounded up to
+// whole ticks
+template <class Key, class WheelClock = std::chrono::steady_clock>
+struct TimerWheel {
+    using Clock = WheelClock;
+    using Duration = typename Clock::duration;
+    using TimePoint = typename Clock::time_point;
+
+private:
+    struct Timer {
+        Key key;
+        TimePoint deadline;
+    };
+
+    struct Entry {
+        Key key;
+        std::size_t rounds;
+    };
+
+    std::vector<std::vector<Entry>> slots;
+    Duration tick;
+    TimePoint current;
+    std::size_t cursor = 0;
+    MpscQueue<Timer> incoming;
+
+    void place(Timer &&timer) {
+        auto ticks = std::max<typename Clock::rep>(
+                1, (timer.deadline - current + tick - Duration(1)) / tick);
+        auto offset = static_cast<std::size_t>(ticks);
+        slots[(cursor + offset) % slots.size()].push_back(
+                {std::move(timer.key), (offset - 1) / slots.size()});
+    }
+
+public:
+    explicit TimerWheel(std::size_t size, Duration tickDuration)
+            : slots(size), tick(tickDuration), current(Clock::now()) {}
+
+    void schedule(Key key, Duration delay) {
+        incoming.push({std::move(key), Clock::now() + delay});
+    }
+
+    template <class Callback>
+    void advance(Callback &&onExpired) {
+        incoming.consumeAll([this](Timer &&timer) { place(std::move(timer)); });
+        auto now = Clock::now();
+        while (current + tick <= now) {
+            current += tick;
+            cursor = (cursor + 1) % slots.size();
+            auto &slot = slots[cursor];
+            std::vector<Entry> expired;
+            for (auto entry = slot.begin(); entry != slot.end();) {
+                if (entry->rounds == 0) {
+                    expired.push_back(std::move(*entry));
+                    entry = slot.erase(entry);
+                } else {
+                    --entry->rounds;
+                    ++entry;
+                }
+            }
+            for (auto &entry: expired) onExpired(entry.key);
+        }
+    }
+};
+
+} // namespace restbes
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <openssl/ssl.h>
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace restbes {
+
+// How long a ticket key issues tickets. The previous key still opens them
+// and the client gets a new ticket, so a ticket lives up to twice as long
+inline constexpr std::chrono::minutes TICKET_KEY_ROTATION{60};
+
+// Keys that encrypt the session tickets of a TLS context (RFC 5077). Every
+// process has its own, a ticket only resumes on the process that issued it
+struct TicketKeys {
+    struct Key {
+        std::array<unsigned char, 16> name;
+        std::array<unsigned char, 32> cipher;
+        std::array<unsigned char, 32> mac;
+    };
+
+private:
+    mutable std::mutex mutex;
+    // Newest first
+    std::deque<Key> keys;
+
+public:
+    TicketKeys();
+
+    // Issues tickets with a new key from now on and forgets the keys older
+    // than the previous one
+    void rotate();
+
+    [[nodiscard]] Key current() const;
+
+    // The key of a ticket and whether it is the current one
+    [[nodiscard]] std::optional<std::pair<Key, bool>>
+    find(const unsigned char *name) const;
+};
+
+// Settings of the contexts the server builds itself: a server side session
+// cache, session tickets under keys, which must outlive the context, and
+// ECDHE key exchange with AEAD ciphers in the server's order
+void configureTls(SSL_CTX *context, TicketKeys &keys);
+
+} // namespace restbes
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace restbes {
+
+// Graceful upgrade: the running process waits on a Unix socket, a new process
+// started with the same path connects to it and receives the listening
+// sockets (SCM_RIGHTS). The old process stops accepting on them before it
+// closes the connection, then drains its sessions while the new one serves
+
+// Listening TCP sockets of this process
+[[nodiscard]] std::vector<int> listeningSockets();
+
+// Keeps the descriptors valid but makes them refer to sockets nobody connects
+// to, so the loop waiting on them stops accepting without seeing an error.
+// The original sockets stay open in the process they were handed to
+void stopAccepting(const std::vector<int> &sockets);
+
+// Receives the listening sockets of the process waiting on the path and
+// returns once it has stopped accepting on them. Empty when nobody waits there
+[[nodiscard]] std::vector<int> takeOverSockets(const std::string &path);
+
+// Waits on the path for the next process, hands it the listening sockets and
+// calls stop with them before letting it go. Returns false if the path could
+// not be bound or the handoff failed
+bool awaitUpgrade(const std::string &path,
+                  const std::function<void(const std::vector<int> &)> &stop);
+
+} // namespace restbes
@@ -1,36 +1,76 @@
 #pragma once
 
 #include "fwd.h"
+#include "notification.h"
 
 #include <corvusoft/restbed/session.hpp>
-#include <folly/Synchronized.h>
 
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <string>
 #include <unordered_set>
 #include <memory>
-#include <queue>
 
 namespace restbes {
 
-struct User {
+// Number of recent events kept per user for replay on reconnect
+inline constexpr std::size_t EVENT_HISTORY_SIZE = 128;
+
+// Every member function posts to the user's core loop, so the state below is
+// only touched from that loop and needs no locks
+struct User : std::enable_shared_from_this<User> {
 private:
-    std::shared_ptr<Server> server;
-    folly::Synchronized<std::string> id;
-    folly::Synchronized<std::unordered_set<unsigned int>> activeSessions;
+    struct EventHistory {
+        // Id the history started from, no event has it
+        std::uint64_t firstId;
+        std::uint64_t lastId;
+        std::deque<Delivery> events;
+    };
+
+    // Owns the user registry, outlives every user
+    Server *server;
+    const std::string id;
+    const std::size_t owner;
+    std::unordered_set<SessionId> activeSessions;
+    EventHistory history;
+    std::chrono::steady_clock::time_point idleSince;
+    bool evicted = false;
+
+    void replayNow(const std::shared_ptr<Session> &session,
+                   std::uint64_t lastEventId) const;
 
 public:
-    explicit User(std::string nm, std::shared_ptr<Server> serv);
+    explicit User(std::string nm, Server *serv);
+
+    // origin is the session that made the change, 0 if none
+    void push(const SharedNotification &notification, SessionId origin = 0);
+
+    // push() for callers that already run on the owner loop
+    void deliver(const SharedNotification &notification, SessionId origin);
+
+    // Queues every event after lastEventId for the session, or a
+    // resync_required event if some of them were already dropped
+    void replay(const std::shared_ptr<Session> &session,
+                std::uint64_t lastEventId);
+
+    // Queues a reconnect hint carrying the id of the last event queued for
+    // the session
+    void requestReconnect(const std::shared_ptr<Session> &session,
+                          std::chrono::milliseconds retry);
 
-    void push(std::shared_ptr<restbed::Response> response);
+    void addSession(SessionId session_id);
 
-    void addSession(unsigned int session_id);
+    void eraseSession(SessionId session_id);
 
-    void eraseInactiveSessions();
+    // Removes the user from the registry if it has had no sessions for ttl,
+    // otherwise checks again when it may have been idle for that long
+    void evictIfIdle(std::chrono::steady_clock::duration ttl);
 
-    [[nodiscard]] std::shared_ptr<Session>
-    getSession(unsigned int session_id) const;
+    [[nodiscard]] const std::string &getId() const;
 
-    [[nodiscard]] std::string getId() const;
+    // Index of the core loop the user's state lives on
+    [[nodiscard]] std::size_t getOwner() const;
 };
 
 } //restbes
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+namespace restbes {
+
+inline constexpr const char *PER_MESSAGE_DEFLATE =
+        "permessage-deflate; server_no_context_takeover; "
+        "client_no_context_takeover";
+
+[[nodiscard]] std::string webSocketAccept(const std::string &key);
+
+[[nodiscard]] bool offersPerMessageDeflate(const std::string &extensions);
+
+// Raw DEFLATE payload of a permessage-deflate message (RFC 7692)
+[[nodiscard]] std::string deflateMessage(const std::string &data);
+
+[[nodiscard]] std::string inflateMessage(const std::string &data);
+
+} // namespace restbes
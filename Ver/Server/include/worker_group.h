@@ -0,0 +1,124 @@
+#pragma once
+
+#include "notification.h"
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace restbes {
+
+// Bits of the worker mask in the user directory
+inline constexpr std::size_t MAX_WORKERS = 64;
+// Online users the shared directory can hold, others are reached through
+// every worker that has some of them
+inline constexpr std::size_t USER_DIRECTORY_SIZE = 1 << 16;
+
+struct UserDirectory;
+
+// Message from another worker process
+struct PeerMessage {
+    enum Kind : char {
+        USER = 'u',
+        BROADCAST = 'b',
+        ASSIGN = 'a',
+        // Messages for the user were lost on the way, for every user if empty
+        RESYNC = 'r'
+    };
+
+    Kind kind;
+    // Empty for BROADCAST
+    std::string user;
+    // nullptr for ASSIGN and RESYNC
+    SharedNotification notification;
+    // Origin of a USER notification, the session to assign for ASSIGN
+    SessionId session = 0;
+};
+
+// Worker processes of one server. Every worker keeps its own sessions and
+// users; a directory in shared memory records which workers have sessions of
+// a user, and notifications reach the other workers as datagrams over a local
+// socket. A datagram the peer can't take is dropped, the peer is then asked
+// to resync the users it missed as soon as it accepts messages again
+struct WorkerGroup {
+    using Receiver = std::function<void(PeerMessage &&)>;
+
+private:
+    std::size_t index;
+    std::size_t count;
+    pid_t supervisor;
+    UserDirectory *directory;
+    int channel;
+    std::thread receiver;
+    mutable std::atomic<std::uint64_t> dropped{0};
+    // Users each worker has to resync, an empty name for all of them
+    mutable std::mutex lostMutex;
+    mutable std::vector<std::unordered_set<std::string>> lost;
+    mutable std::atomic<bool> anyLost{false};
+    // Users of this worker that did not fit into the directory
+    std::mutex unlistedMutex;
+    std::unordered_set<std::string> unlisted;
+
+    WorkerGroup(std::size_t index, std::size_t count, pid_t supervisor,
+                UserDirectory *directory);
+
+    // False if the datagram was not taken
+    bool send(std::size_t worker, const std::string &message) const;
+
+    void markLost(std::size_t worker, const std::string &user) const;
+
+    // Sends the pending resyncs to the workers that accept them
+    void resyncLost() const;
+
+public:
+    // Forks count workers and returns in each of them. The calling process
+    // stays behind to restart crashed workers and exits once they all have
+    // stopped. Must run before any thread is started. For count <= 1 nothing
+    // is forked and nullptr is returned
+    static std::unique_ptr<WorkerGroup> start(std::size_t count);
+
+    WorkerGroup(const WorkerGroup &) = delete;
+
+    WorkerGroup &operator=(const WorkerGroup &) = delete;
+
+    ~WorkerGroup();
+
+    [[nodiscard]] std::size_t getIndex() const;
+
+    [[nodiscard]] std::size_t size() const;
+
+    void userOnline(const std::string &user);
+
+    void userOffline(const std::string &user);
+
+    // True if some worker may have sessions of the user
+    [[nodiscard]] bool isOnline(const std::string &user) const;
+
+    // Sends the notification to the other workers that have sessions of the
+    // user
+    void sendToUser(const std::string &user, const Notification &notification,
+                    SessionId origin = 0) const;
+
+    void sendToAll(const Notification &notification) const;
+
+    // Asks the worker that issued the session to assign it to the user
+    void assignSession(std::size_t worker, SessionId session,
+                       const std::string &user) const;
+
+    // Messages to the other workers dropped since the start
+    [[nodiscard]] std::uint64_t getDroppedCount() const;
+
+    // Starts the thread delivering messages from the other workers
+    void listen(Receiver callback);
+};
+
+} // namespace restbes
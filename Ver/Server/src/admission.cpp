@@ -0,0 +1,124 @@
+#include "admission.h"
+
+#include <folly/ScopeGuard.h>
+#include <folly/executors/ExecutorWithPriority.h>
+
+#include <utility>
+
+namespace restbes {
+
+namespace {
+
+// The newest sample moves the average by 1 / DELAY_SMOOTHING of the difference
+constexpr std::chrono::microseconds::rep DELAY_SMOOTHING = 8;
+
+// folly priorities are centered around zero, higher runs first
+int8_t priorityLevel(Priority priority) {
+    return static_cast<int8_t>(static_cast<int>(priority) -
+                               static_cast<int>(PRIORITY_COUNT / 2));
+}
+
+} // namespace
+
+AdmissionScheduler::AdmissionScheduler(std::size_t threads,
+                                       AdmissionLimits limits)
+        : maxQueued(limits.maxQueued),
+          maxDelay(std::chrono::microseconds(limits.maxDelay).count()),
+          pool(std::make_shared<folly::CPUThreadPoolExecutor>(
+                  threads, static_cast<int8_t>(PRIORITY_COUNT))) {}
+
+bool AdmissionScheduler::admits(Priority priority) const {
+    auto waiting = queued.load(std::memory_order_relaxed);
+    // An idle pool admits everything, the average may be stale
+    if (waiting == 0) return true;
+    auto share = static_cast<std::size_t>(priority) + 1;
+    auto queueLimit = maxQueued.load(std::memory_order_relaxed) * share;
+    auto delayLimit = maxDelay.load(std::memory_order_relaxed) *
+                      static_cast<std::chrono::microseconds::rep>(share);
+    return waiting * PRIORITY_COUNT < queueLimit &&
+           delay.load(std::memory_order_relaxed) *
+                           static_cast<std::chrono::microseconds::rep>(
+                                   PRIORITY_COUNT) <
+                   delayLimit;
+}
+
+bool AdmissionScheduler::submit(Priority priority, folly::Func task) {
+    return submitAsync(priority,
+                       [task = std::move(task)](folly::Func done) mutable {
+                           // A throwing task must not keep a draining server
+                           // waiting for it
+                           auto guard = folly::makeGuard(std::move(done));
+                           task();
+                       });
+}
+
+bool AdmissionScheduler::submitAsync(
+        Priority priority, folly::Function<void(folly::Func done)> task) {
+    if (!admits(priority)) {
+        shed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    queued.fetch_add(1, std::memory_order_relaxed);
+    inFlight.fetch_add(1, std::memory_order_relaxed);
+    auto enqueued = std::chrono::steady_clock::now();
+    pool->addWithPriority(
+            [this, enqueued, task = std::move(task)]() mutable {
+                queued.fetch_sub(1, std::memory_order_relaxed);
+                auto waited = std::chrono::duration_cast<
+                        std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - enqueued).count();
+                // Lost updates under contention only make the average a
+                // little noisier
+                auto average = delay.load(std::memory_order_relaxed);
+                delay.store(average + (waited - average) / DELAY_SMOOTHING,
+                            std::memory_order_relaxed);
+                task([this]() {
+                    if (inFlight.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                        return;
+                    // Taken so the wake up can't fall between the check and
+                    // the wait in waitIdle()
+                    std::lock_guard lock(idleMutex);
+                    idle.notify_all();
+                });
+            },
+            priorityLevel(priority));
+    return true;
+}
+
+folly::Executor::KeepAlive<>
+AdmissionScheduler::getExecutor(Priority priority) const {
+    return folly::ExecutorWithPriority::create(
+            folly::getKeepAliveToken(pool.get()), priorityLevel(priority));
+}
+
+void AdmissionScheduler::setLimits(AdmissionLimits limits) {
+    maxQueued.store(limits.maxQueued, std::memory_order_relaxed);
+    maxDelay.store(std::chrono::microseconds(limits.maxDelay).count(),
+                   std::memory_order_relaxed);
+}
+
+void AdmissionScheduler::setThreads(std::size_t threads) {
+    pool->setNumThreads(threads);
+}
+
+std::chrono::microseconds AdmissionScheduler::getDelay() const {
+    return std::chrono::microseconds(delay.load(std::memory_order_relaxed));
+}
+
+std::size_t AdmissionScheduler::getInFlight() const {
+    return inFlight.load(std::memory_order_acquire);
+}
+
+bool AdmissionScheduler::waitIdle(
+        std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock lock(idleMutex);
+    return idle.wait_until(lock, deadline, [this]() {
+        return inFlight.load(std::memory_order_acquire) == 0;
+    });
+}
+
+std::uint64_t AdmissionScheduler::getShedCount() const {
+    return shed.load(std::memory_order_relaxed);
+}
+
+} // namespace restbes
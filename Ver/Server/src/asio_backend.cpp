@@ -0,0 +1,1048 @@
+#include "asio_backend.h"
+#include "kernel_tls.h"
+#include "response.h"
+
+#include <folly/Synchronized.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+namespace restbes {
+
+namespace {
+
+constexpr std::size_t READ_BUFFER_SIZE = 16 * 1024;
+constexpr std::size_t READ_BUFFER_POOL_SIZE = 1024;
+// Longer request heads are answered with 431
+constexpr std::size_t MAX_HEAD_SIZE = 64 * 1024;
+// Longer request bodies are answered with 413, longer WebSocket messages
+// close the socket
+constexpr std::size_t MAX_BODY_SIZE = 16 * 1024 * 1024;
+// WebSocket close codes (RFC 6455, 7.4.1)
+constexpr std::uint16_t PROTOCOL_ERROR = 1002;
+constexpr std::uint16_t MESSAGE_TOO_BIG = 1009;
+
+using ReadBuffer = std::array<char, READ_BUFFER_SIZE>;
+
+folly::Synchronized<std::vector<ReadBuffer *>> &getReadBufferPool() {
+    static folly::Synchronized<std::vector<ReadBuffer *>> pool;
+    return pool;
+}
+
+void releaseReadBuffer(ReadBuffer *buffer) {
+    {
+        auto lockedPool = getReadBufferPool().wlock();
+        if (lockedPool->size() < READ_BUFFER_POOL_SIZE) {
+            lockedPool->push_back(buffer);
+            return;
+        }
+    }
+    delete buffer;
+}
+
+std::shared_ptr<ReadBuffer> acquireReadBuffer() {
+    ReadBuffer *buffer = nullptr;
+    {
+        auto lockedPool = getReadBufferPool().wlock();
+        if (!lockedPool->empty()) {
+            buffer = lockedPool->back();
+            lockedPool->pop_back();
+        }
+    }
+    if (buffer == nullptr) buffer = new ReadBuffer;
+    return std::shared_ptr<ReadBuffer>(buffer, releaseReadBuffer);
+}
+
+const char *statusMessage(int status) {
+    switch (status) {
+        case 101:
+            return "Switching Protocols";
+        case 400:
+            return "Bad Request";
+        case 404:
+            return "Not Found";
+        case 405:
+            return "Method Not Allowed";
+        case 413:
+            return "Payload Too Large";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 501:
+            return "Not Implemented";
+        default:
+            return "Internal Server Error";
+    }
+}
+
+restbed::Bytes statusResponse(int status) {
+    restbed::Response response;
+    response.set_status_code(status);
+    response.set_status_message(statusMessage(status));
+    response.set_header("Content-Length", "0");
+    response.set_header("Connection", "close");
+    return SerializedResponse(response).getBytes();
+}
+
+// Server frames are neither masked nor fragmented
+restbed::Bytes serializeFrame(const restbed::WebSocketMessage &message) {
+    const auto data = message.get_data();
+    restbed::Bytes frame;
+    frame.reserve(data.size() + 10);
+    frame.push_back(static_cast<restbed::Byte>(
+            0x80 | (message.get_rsv1_flag() ? 0x40 : 0) |
+            message.get_opcode()));
+    if (data.size() < 126) {
+        frame.push_back(static_cast<restbed::Byte>(data.size()));
+    } else if (data.size() <= 0xffff) {
+        frame.push_back(126);
+        frame.push_back(static_cast<restbed::Byte>(data.size() >> 8));
+        frame.push_back(static_cast<restbed::Byte>(data.size()));
+    } else {
+        frame.push_back(127);
+        std::uint64_t size = data.size();
+        for (int shift = 56; shift >= 0; shift -= 8)
+            frame.push_back(static_cast<restbed::Byte>(size >> shift));
+    }
+    frame.insert(frame.end(), data.begin(), data.end());
+    return frame;
+}
+
+restbed::Bytes closeFrame(std::uint16_t code) {
+    if (code == 0) return {0x88, 0x00};
+    return {0x88, 0x02, static_cast<restbed::Byte>(code >> 8),
+            static_cast<restbed::Byte>(code)};
+}
+
+std::string trim(const std::string &text) {
+    auto begin = text.find_first_not_of(" \t");
+    if (begin == std::string::npos) return "";
+    return text.substr(begin, text.find_last_not_of(" \t") - begin + 1);
+}
+
+std::string normalizePath(std::string path) {
+    if (path.size() > 1 && path.back() == '/') path.pop_back();
+    return path;
+}
+
+// head is the request line and the header lines, without the empty line
+std::shared_ptr<restbed::Request> parseRequest(const std::string &head) {
+    auto lineEnd = std::min(head.find("\r\n"), head.size());
+    auto methodEnd = head.find(' ');
+    auto targetEnd = head.rfind(' ', lineEnd);
+    if (methodEnd == std::string::npos || methodEnd >= targetEnd ||
+        head.compare(targetEnd + 1, 5, "HTTP/") != 0)
+        return nullptr;
+    auto request = std::make_shared<restbed::Request>();
+    request->set_method(head.substr(0, methodEnd));
+    request->set_protocol("HTTP");
+    request->set_version(std::strtod(head.c_str() + targetEnd + 6, nullptr));
+
+    auto target = head.substr(methodEnd + 1, targetEnd - methodEnd - 1);
+    auto queryStart = target.find('?');
+    request->set_path(restbed::Uri::decode(target.substr(0, queryStart)));
+    while (queryStart != std::string::npos) {
+        auto start = queryStart + 1;
+        queryStart = target.find('&', start);
+        auto parameter = target.substr(start, queryStart - start);
+        if (parameter.empty()) continue;
+        auto equals = parameter.find('=');
+        request->set_query_parameter(
+                restbed::Uri::decode(parameter.substr(0, equals)),
+                equals == std::string::npos
+                        ? ""
+                        : restbed::Uri::decode(parameter.substr(equals + 1)));
+    }
+
+    for (auto start = lineEnd + 2; start < head.size();) {
+        auto end = std::min(head.find("\r\n", start), head.size());
+        auto colon = head.find(':', start);
+        if (colon >= end) return nullptr;
+        request->add_header(trim(head.substr(start, colon - start)),
+                            trim(head.substr(colon + 1, end - colon - 1)));
+        start = end + 2;
+    }
+    return request;
+}
+
+// TLS stream whose SSL object reads and writes the socket itself, so that
+// OpenSSL can hand the records to the kernel (see kernel_tls.h), which it
+// can't behind asio::ssl::stream's memory BIO pair. OpenSSL asks for
+// readiness through SSL_ERROR_WANT_READ/WRITE, the stream waits for it on the
+// socket and retries
+struct SocketTlsStream {
+    using Socket = asio::ip::tcp::socket;
+    using executor_type = Socket::executor_type;
+
+private:
+    Socket socket;
+    SSL *ssl;
+    // OpenSSL reported a fatal error, no close_notify may follow
+    bool failed = false;
+
+    // Runs step until OpenSSL stops asking for readiness. Completions are
+    // posted, never run inside the initiating call
+    template <class Step, class Handler>
+    void drive(Step step, Handler handler) {
+        ERR_clear_error();
+        int result = step();
+        if (result > 0) {
+            asio::post(socket.get_executor(),
+                       [handler = std::move(handler), result]() mutable {
+                           handler(asio::error_code(),
+                                   static_cast<std::size_t>(result));
+                       });
+            return;
+        }
+        // The handler moves into the retry only when there will be one
+        auto retry = [this, &step, &handler]() {
+            return [this, step, handler = std::move(handler)](
+                    const asio::error_code &error) mutable {
+                if (error) handler(error, 0);
+                else drive(std::move(step), std::move(handler));
+            };
+        };
+        switch (SSL_get_error(ssl, result)) {
+            case SSL_ERROR_WANT_READ:
+                socket.async_wait(Socket::wait_read, retry());
+                return;
+            case SSL_ERROR_WANT_WRITE:
+                socket.async_wait(Socket::wait_write, retry());
+                return;
+            case SSL_ERROR_ZERO_RETURN:
+                fail(std::move(handler), asio::error::eof);
+                return;
+            default:
+                failed = true;
+                fail(std::move(handler), asio::error::connection_reset);
+                return;
+        }
+    }
+
+    template <class Handler>
+    void fail(Handler handler, asio::error_code error) {
+        asio::post(socket.get_executor(),
+                   [handler = std::move(handler), error]() mutable {
+                       handler(error, 0);
+                   });
+    }
+
+public:
+    SocketTlsStream(Socket accepted, SSL_CTX *context)
+            : socket(std::move(accepted)), ssl(SSL_new(context)) {
+        if (ssl == nullptr) throw std::runtime_error("Can't create SSL");
+        SSL_set_fd(ssl, socket.native_handle());
+        socket.non_blocking(true);
+    }
+
+    SocketTlsStream(const SocketTlsStream &) = delete;
+
+    SocketTlsStream &operator=(const SocketTlsStream &) = delete;
+
+    ~SocketTlsStream() {
+        SSL_free(ssl);
+    }
+
+    executor_type get_executor() {
+        return socket.get_executor();
+    }
+
+    Socket &next_layer() {
+        return socket;
+    }
+
+    SSL *native_handle() {
+        return ssl;
+    }
+
+    // Sends close_notify if the socket takes it right away. OpenSSL drops a
+    // session from the server cache when its connection ends without one
+    void close_notify() {
+        if (failed || !SSL_is_init_finished(ssl)) return;
+        ERR_clear_error();
+        SSL_shutdown(ssl);
+    }
+
+    // Handlers are taken by reference like asio's own streams do: composed
+    // operations move themselves into the handler argument
+    template <class Handler>
+    void async_accept(Handler &&handler) {
+        drive([this]() { return SSL_accept(ssl); },
+              [handler = std::forward<Handler>(handler)](
+                      const asio::error_code &error, std::size_t) mutable {
+                  handler(error);
+              });
+    }
+
+    template <class Buffers, class Handler>
+    void async_read_some(const Buffers &buffers, Handler &&handler) {
+        asio::mutable_buffer buffer = *asio::buffer_sequence_begin(buffers);
+        drive([this, buffer]() {
+                  return SSL_read(ssl, buffer.data(),
+                                  static_cast<int>(buffer.size()));
+              },
+              std::forward<Handler>(handler));
+    }
+
+    // Writes from the first buffer only, like any write_some may
+    template <class Buffers, class Handler>
+    void async_write_some(const Buffers &buffers, Handler &&handler) {
+        asio::const_buffer buffer;
+        for (auto it = asio::buffer_sequence_begin(buffers);
+             it != asio::buffer_sequence_end(buffers); ++it) {
+            buffer = *it;
+            if (buffer.size() != 0) break;
+        }
+        if (buffer.size() == 0) {
+            asio::post(socket.get_executor(),
+                       [handler = std::forward<Handler>(handler)]() mutable {
+                           handler(asio::error_code(), 0);
+                       });
+            return;
+        }
+        drive([this, buffer]() {
+                  return SSL_write(ssl, buffer.data(),
+                                   static_cast<int>(buffer.size()));
+              },
+              std::forward<Handler>(handler));
+    }
+};
+
+} // namespace
+
+struct AsioSession;
+
+// WebSocket of an upgraded AsioSession. The handlers are used on the strand of
+// the connection only
+struct AsioWebSocket : WebSocketConnection {
+    const std::shared_ptr<AsioSession> session;
+    MessageHandler onMessage;
+    Callback onClose;
+    ErrorHandler onError;
+
+    explicit AsioWebSocket(std::shared_ptr<AsioSession> session);
+
+    bool is_open() const override;
+
+    bool is_closed() const override;
+
+    void send(const Message &message, Callback sent) override;
+
+    void close() override;
+
+    void set_message_handler(MessageHandler handler) override;
+
+    void set_close_handler(Callback handler) override;
+
+    void set_error_handler(ErrorHandler handler) override;
+};
+
+// One per connection, like restbed's sessions. Everything but the public
+// members runs on the strand of the socket
+struct AsioSession : HttpSession {
+    using Socket = asio::ip::tcp::socket;
+    using TlsStream = SocketTlsStream;
+
+private:
+    // What follows a write
+    enum class Then { READ, CALLBACK, CLOSE };
+
+    enum class Frame { TAKEN, INCOMPLETE, INVALID, TOO_BIG };
+
+    struct Write {
+        restbed::Bytes data;
+        Callback callback;
+        Then then;
+    };
+
+    AsioBackend &backend;
+    Socket socket;
+    // Owns the socket when the backend serves TLS
+    std::unique_ptr<TlsStream> tls;
+    asio::steady_timer deadline;
+    std::string origin;
+    std::shared_ptr<const restbed::Request> request;
+    std::atomic<bool> open{true};
+    // Read past the current request head. Empty while the connection is idle
+    std::string buffered;
+    std::deque<Write> queued;
+    bool reading = false;
+    bool writing = false;
+    // Set by upgrade(), the connection carries WebSocket frames from then on.
+    // It refers back to the session until the connection is shut down
+    std::shared_ptr<AsioWebSocket> webSocket;
+    // Data frames of the message being received
+    std::string fragments;
+    restbed::WebSocketMessage::OpCode fragmentOpcode =
+            restbed::WebSocketMessage::CONTINUATION_FRAME;
+    bool fragmented = false;
+    bool fragmentDeflated = false;
+    // A close frame is queued, nothing is read any more
+    bool closing = false;
+
+    friend struct AsioWebSocket;
+
+    std::shared_ptr<AsioSession> self() {
+        return std::static_pointer_cast<AsioSession>(shared_from_this());
+    }
+
+    Socket &lowest() {
+        return tls ? tls->next_layer() : socket;
+    }
+
+    template <class Operation>
+    void withStream(Operation &&operation) {
+        if (tls) operation(*tls);
+        else operation(socket);
+    }
+
+    template <class Task>
+    void onStrand(Task &&task) {
+        asio::dispatch(lowest().get_executor(), std::forward<Task>(task));
+    }
+
+    // A request has to arrive within the timeout once it has started
+    void armDeadline() {
+        if (deadline.expiry() != asio::steady_timer::time_point::max()) return;
+        deadline.expires_after(backend.requestTimeout);
+        deadline.async_wait([weak = std::weak_ptr<AsioSession>(self())](
+                const asio::error_code &error) {
+            auto session = weak.lock();
+            if (!error && session != nullptr &&
+                session->deadline.expiry() <=
+                        asio::steady_timer::clock_type::now())
+                session->shutdown();
+        });
+    }
+
+    void disarmDeadline() {
+        deadline.expires_at(asio::steady_timer::time_point::max());
+    }
+
+    void awaitRequest() {
+        if (reading || !open) return;
+        reading = true;
+        if (dispatchBuffered()) return;
+        if (!buffered.empty() ||
+            (tls && SSL_pending(tls->native_handle()) > 0)) {
+            readHead();
+            return;
+        }
+        // Idle: no buffer until the client sends something
+        lowest().async_wait(Socket::wait_read, [self = self()](
+                const asio::error_code &error) {
+            if (error) self->shutdown();
+            else self->readHead();
+        });
+    }
+
+    void readHead() {
+        armDeadline();
+        auto buffer = acquireReadBuffer();
+        withStream([&](auto &stream) {
+            stream.async_read_some(asio::buffer(*buffer), [self = self(), buffer](
+                    const asio::error_code &error, std::size_t size) {
+                if (error) {
+                    self->shutdown();
+                    return;
+                }
+                self->buffered.append(buffer->data(), size);
+                if (self->dispatchBuffered()) return;
+                if (self->buffered.size() > MAX_HEAD_SIZE) {
+                    self->reading = false;
+                    self->reply(431);
+                    return;
+                }
+                self->readHead();
+            });
+        });
+    }
+
+    bool dispatchBuffered() {
+        auto end = buffered.find("\r\n\r\n");
+        if (end == std::string::npos) return false;
+        disarmDeadline();
+        reading = false;
+        auto parsed = parseRequest(buffered.substr(0, end));
+        buffered.erase(0, end + 4);
+        if (buffered.empty()) std::string().swap(buffered);
+        if (parsed == nullptr) {
+            reply(400);
+            return true;
+        }
+        std::atomic_store(&request,
+                          std::shared_ptr<const restbed::Request>(parsed));
+
+        auto resource = backend.resources.find(normalizePath(parsed->get_path()));
+        if (resource == backend.resources.end()) {
+            reply(404);
+            return true;
+        }
+        const auto &methods = resource->second->methods;
+        auto handler = methods.find(parsed->get_method());
+        if (handler == methods.end()) {
+            reply(405);
+            return true;
+        }
+        try {
+            handler->second(self());
+        } catch (const std::exception &exception) {
+            if (resource->second->errorHandler)
+                resource->second->errorHandler(500, exception, self());
+            else
+                reply(500);
+        }
+        return true;
+    }
+
+    void fetchNow(std::size_t length, const FetchCallback &callback) {
+        if (length > MAX_BODY_SIZE) {
+            reply(413);
+            return;
+        }
+        if (buffered.size() >= length) {
+            disarmDeadline();
+            restbed::Bytes body(buffered.begin(), buffered.begin() + length);
+            buffered.erase(0, length);
+            if (buffered.empty()) std::string().swap(buffered);
+            callback(self(), body);
+            return;
+        }
+        if (!open) return;
+        armDeadline();
+        auto buffer = acquireReadBuffer();
+        withStream([&](auto &stream) {
+            stream.async_read_some(asio::buffer(*buffer), [self = self(), buffer,
+                                                           length, callback](
+                    const asio::error_code &error, std::size_t size) {
+                if (error) {
+                    self->shutdown();
+                    return;
+                }
+                self->buffered.append(buffer->data(), size);
+                self->fetchNow(length, callback);
+            });
+        });
+    }
+
+    void reply(int status) {
+        enqueue(Write{statusResponse(status), nullptr, Then::CLOSE});
+    }
+
+    void enqueue(Write &&write) {
+        if (!open) return;
+        queued.push_back(std::move(write));
+        if (!writing) flushWrites();
+    }
+
+    void flushWrites() {
+        if (queued.empty() || !open) return;
+        writing = true;
+        auto batch = std::make_shared<std::vector<Write>>(
+                std::make_move_iterator(queued.begin()),
+                std::make_move_iterator(queued.end()));
+        queued.clear();
+        auto written = [self = self(), batch](const asio::error_code &error,
+                                              std::size_t) {
+            self->completeWrites(error, *batch);
+        };
+        if (tls && batch->size() > 1) {
+            // TLS seals every buffer of a sequence separately, one buffer
+            // makes the fewest records
+            auto joined = std::make_shared<restbed::Bytes>();
+            for (const auto &write: *batch)
+                joined->insert(joined->end(), write.data.begin(),
+                               write.data.end());
+            asio::async_write(*tls, asio::buffer(*joined),
+                              [written, joined](const asio::error_code &error,
+                                                std::size_t size) {
+                                  written(error, size);
+                              });
+            return;
+        }
+        std::vector<asio::const_buffer> buffers;
+        buffers.reserve(batch->size());
+        for (const auto &write: *batch) buffers.push_back(asio::buffer(write.data));
+        // One writev for everything queued since the previous write
+        withStream([&](auto &stream) {
+            asio::async_write(stream, buffers, written);
+        });
+    }
+
+    void completeWrites(const asio::error_code &error, std::vector<Write> &batch) {
+        writing = false;
+        if (error) {
+            shutdown();
+            return;
+        }
+        bool readNext = false;
+        for (auto &write: batch) {
+            switch (write.then) {
+                case Then::READ:
+                    if (write.callback) write.callback(self());
+                    readNext = true;
+                    break;
+                case Then::CALLBACK:
+                    write.callback(self());
+                    break;
+                case Then::CLOSE:
+                    shutdown();
+                    return;
+            }
+        }
+        if (!writing) flushWrites();
+        if (readNext) awaitRequest();
+    }
+
+    // Reads frames while the socket has them, an idle socket only waits for
+    // readiness like an idle HTTP connection
+    void awaitFrames() {
+        while (open && !closing) {
+            auto frame = takeFrame();
+            if (frame == Frame::INCOMPLETE) break;
+            if (frame == Frame::INVALID) closeWebSocket(PROTOCOL_ERROR);
+            if (frame == Frame::TOO_BIG) closeWebSocket(MESSAGE_TOO_BIG);
+        }
+        if (!open || closing) return;
+        if (!buffered.empty() ||
+            (tls && SSL_pending(tls->native_handle()) > 0)) {
+            readFrames();
+            return;
+        }
+        lowest().async_wait(Socket::wait_read, [self = self()](
+                const asio::error_code &error) {
+            if (error) self->shutdown(error);
+            else self->readFrames();
+        });
+    }
+
+    void readFrames() {
+        auto buffer = acquireReadBuffer();
+        withStream([&](auto &stream) {
+            stream.async_read_some(asio::buffer(*buffer), [self = self(), buffer](
+                    const asio::error_code &error, std::size_t size) {
+                if (error) {
+                    self->shutdown(error);
+                    return;
+                }
+                self->buffered.append(buffer->data(), size);
+                self->awaitFrames();
+            });
+        });
+    }
+
+    // Takes one frame off the buffered bytes and delivers the message once
+    // its last frame is in (RFC 6455, 5.2)
+    Frame takeFrame() {
+        if (buffered.size() < 2) return Frame::INCOMPLETE;
+        auto byte = [this](std::size_t i) {
+            return static_cast<std::uint8_t>(buffered[i]);
+        };
+        bool final = byte(0) & 0x80;
+        bool deflated = byte(0) & 0x40;
+        auto opcode = static_cast<restbed::WebSocketMessage::OpCode>(
+                byte(0) & 0x0f);
+        // Clients mask every frame
+        if (!(byte(1) & 0x80)) return Frame::INVALID;
+        std::uint64_t length = byte(1) & 0x7f;
+        std::size_t offset = 2;
+        if (length == 126) {
+            if (buffered.size() < 4) return Frame::INCOMPLETE;
+            length = byte(2) << 8 | byte(3);
+            offset = 4;
+        } else if (length == 127) {
+            if (buffered.size() < 10) return Frame::INCOMPLETE;
+            length = 0;
+            for (std::size_t i = 2; i < 10; ++i) length = length << 8 | byte(i);
+            offset = 10;
+        }
+        if (length > MAX_BODY_SIZE) return Frame::TOO_BIG;
+        if (buffered.size() < offset + 4 + length) return Frame::INCOMPLETE;
+
+        std::string payload = buffered.substr(offset + 4, length);
+        for (std::size_t i = 0; i < payload.size(); ++i)
+            payload[i] ^= buffered[offset + i % 4];
+        buffered.erase(0, offset + 4 + length);
+        if (buffered.empty()) std::string().swap(buffered);
+
+        switch (opcode) {
+            case restbed::WebSocketMessage::CONTINUATION_FRAME:
+            case restbed::WebSocketMessage::TEXT_FRAME:
+            case restbed::WebSocketMessage::BINARY_FRAME:
+            case restbed::WebSocketMessage::CONNECTION_CLOSE_FRAME:
+            case restbed::WebSocketMessage::PING_FRAME:
+            case restbed::WebSocketMessage::PONG_FRAME:
+                break;
+            default:
+                return Frame::INVALID;
+        }
+        if (opcode >= restbed::WebSocketMessage::CONNECTION_CLOSE_FRAME) {
+            // Control frames may come between the fragments of a message
+            if (!final || payload.size() > 125) return Frame::INVALID;
+            deliver(opcode, payload, false);
+            return Frame::TAKEN;
+        }
+        if (opcode == restbed::WebSocketMessage::CONTINUATION_FRAME) {
+            if (!fragmented) return Frame::INVALID;
+            if (fragments.size() + payload.size() > MAX_BODY_SIZE)
+                return Frame::TOO_BIG;
+            fragments += payload;
+        } else {
+            if (fragmented) return Frame::INVALID;
+            fragmentOpcode = opcode;
+            fragmentDeflated = deflated;
+            fragments = std::move(payload);
+        }
+        fragmented = !final;
+        if (final) {
+            deliver(fragmentOpcode, fragments, fragmentDeflated);
+            std::string().swap(fragments);
+        }
+        return Frame::TAKEN;
+    }
+
+    void deliver(restbed::WebSocketMessage::OpCode opcode,
+                 const std::string &payload, bool deflated) {
+        auto message = std::make_shared<restbed::WebSocketMessage>(
+                opcode, restbed::Bytes(payload.begin(), payload.end()));
+        message->set_rsv1_flag(deflated);
+        if (webSocket->onMessage) webSocket->onMessage(webSocket, message);
+    }
+
+    // Without a code the close frame has no body
+    void closeWebSocket(std::uint16_t code = 0) {
+        if (closing) return;
+        closing = true;
+        enqueue(Write{closeFrame(code), nullptr, Then::CLOSE});
+    }
+
+    // A WebSocket hears of the shutdown through its error handler if there
+    // was an error, through its close handler otherwise
+    void shutdown(const asio::error_code &error = asio::error_code()) {
+        if (!open.exchange(false)) return;
+        asio::error_code ignored;
+        deadline.cancel();
+        if (tls) tls->close_notify();
+        lowest().shutdown(Socket::shutdown_both, ignored);
+        lowest().close(ignored);
+        queued.clear();
+        if (webSocket == nullptr) return;
+        auto socket = std::move(webSocket);
+        if (error && socket->onError) socket->onError(socket, error);
+        else if (!error && socket->onClose) socket->onClose(socket);
+    }
+
+public:
+    AsioSession(AsioBackend &backend, Socket accepted)
+            : backend(backend), socket(std::move(accepted)),
+              deadline(socket.get_executor(),
+                       asio::steady_timer::time_point::max()) {
+        asio::error_code error;
+        auto endpoint = socket.remote_endpoint(error);
+        if (!error)
+            origin = endpoint.address().to_string() + ':' +
+                     std::to_string(endpoint.port());
+        socket.set_option(asio::ip::tcp::no_delay(true), error);
+        // Finds dead peers of idle connections without a timer
+        socket.set_option(asio::socket_base::keep_alive(true), error);
+        if (backend.tls)
+            tls = std::make_unique<TlsStream>(std::move(socket),
+                                              backend.tls->native_handle());
+    }
+
+    void start() {
+        if (!tls) {
+            awaitRequest();
+            return;
+        }
+        armDeadline();
+        tls->async_accept([self = self()](const asio::error_code &error) {
+            self->disarmDeadline();
+            if (error) self->shutdown();
+            else self->awaitRequest();
+        });
+    }
+
+    std::shared_ptr<const restbed::Request> get_request() const override {
+        return std::atomic_load(&request);
+    }
+
+    std::string get_origin() const override {
+        return origin;
+    }
+
+    bool is_open() const override {
+        return open;
+    }
+
+    bool is_closed() const override {
+        return !open;
+    }
+
+    void fetch(std::size_t length, FetchCallback callback) override {
+        onStrand([self = self(), length, callback = std::move(callback)]() {
+            self->fetchNow(length, callback);
+        });
+    }
+
+    void yield(const restbed::Bytes &data, Callback callback) override {
+        onStrand([self = self(), data, callback = std::move(callback)]() mutable {
+            auto then = callback ? Then::CALLBACK : Then::READ;
+            self->enqueue(Write{std::move(data), std::move(callback), then});
+        });
+    }
+
+    void yield(const restbed::Response &response) override {
+        yield(SerializedResponse(response).getBytes(), nullptr);
+    }
+
+    void write(const restbed::Bytes &data, Callback written) override {
+        onStrand([self = self(), data, written = std::move(written)]() mutable {
+            self->enqueue(Write{std::move(data), std::move(written), Then::READ});
+        });
+    }
+
+    void close(const restbed::Bytes &data) override {
+        onStrand([self = self(), data]() mutable {
+            self->enqueue(Write{std::move(data), nullptr, Then::CLOSE});
+        });
+    }
+
+    void close(const restbed::Response &response) override {
+        close(SerializedResponse(response).getBytes());
+    }
+
+    void close(int status) override {
+        close(statusResponse(status));
+    }
+
+    void close() override {
+        close(restbed::Bytes());
+    }
+
+    void upgrade(int status,
+                 const std::multimap<std::string, std::string> &headers,
+                 UpgradeCallback callback) override {
+        restbed::Response response;
+        response.set_status_code(status);
+        response.set_status_message(statusMessage(status));
+        for (const auto &[name, value]: headers) response.add_header(name, value);
+        onStrand([self = self(), data = SerializedResponse(response).getBytes(),
+                  callback = std::move(callback)]() mutable {
+            if (!self->open) return;
+            self->webSocket = std::make_shared<AsioWebSocket>(self);
+            auto upgraded = [callback](const std::shared_ptr<HttpSession> &session) {
+                auto connection = std::static_pointer_cast<AsioSession>(session);
+                callback(connection->webSocket);
+                connection->awaitFrames();
+            };
+            self->enqueue(Write{std::move(data), upgraded, Then::CALLBACK});
+        });
+    }
+};
+
+AsioWebSocket::AsioWebSocket(std::shared_ptr<AsioSession> session)
+        : session(std::move(session)) {}
+
+bool AsioWebSocket::is_open() const {
+    return session->is_open();
+}
+
+bool AsioWebSocket::is_closed() const {
+    return session->is_closed();
+}
+
+void AsioWebSocket::send(const Message &message, Callback sent) {
+    auto written = [self = shared_from_this(), sent = std::move(sent)](
+            const std::shared_ptr<HttpSession> &) {
+        if (sent) sent(self);
+    };
+    session->onStrand([session = session, frame = serializeFrame(*message),
+                       written = std::move(written)]() mutable {
+        if (session->closing) return;
+        session->enqueue(AsioSession::Write{std::move(frame), std::move(written),
+                                            AsioSession::Then::CALLBACK});
+    });
+}
+
+void AsioWebSocket::close() {
+    session->onStrand([session = session]() { session->closeWebSocket(); });
+}
+
+void AsioWebSocket::set_message_handler(MessageHandler handler) {
+    session->onStrand([self = shared_from_this(), this,
+                       handler = std::move(handler)]() { onMessage = handler; });
+}
+
+void AsioWebSocket::set_close_handler(Callback handler) {
+    session->onStrand([self = shared_from_this(), this,
+                       handler = std::move(handler)]() { onClose = handler; });
+}
+
+void AsioWebSocket::set_error_handler(ErrorHandler handler) {
+    session->onStrand([self = shared_from_this(), this,
+                       handler = std::move(handler)]() { onError = handler; });
+}
+
+AsioBackend::AsioBackend(bool reusePort)
+        : work(asio::make_work_guard(context)), reusePort(reusePort) {}
+
+void AsioBackend::publish(std::shared_ptr<const Resource> resource) {
+    auto path = normalizePath(resource->path);
+    resources[path] = std::move(resource);
+}
+
+void AsioBackend::schedule(Task task, std::chrono::milliseconds interval) {
+    if (interval == std::chrono::milliseconds::zero()) {
+        asio::post(context, std::move(task));
+        return;
+    }
+    run(std::make_shared<Scheduled>(Scheduled{std::move(task), interval}),
+        std::make_shared<asio::steady_timer>(context));
+}
+
+void AsioBackend::run(const std::shared_ptr<Scheduled> &task,
+                      const std::shared_ptr<asio::steady_timer> &timer) {
+    timer->expires_after(task->interval);
+    timer->async_wait([this, task, timer](const asio::error_code &error) {
+        if (error) return;
+        try {
+            task->task();
+        } catch (const std::exception &) {
+            // The next run may succeed, the schedule goes on
+        }
+        run(task, timer);
+    });
+}
+
+bool AsioBackend::enableKernelTls() {
+    // Applied to the context once the certificates are known, see listen()
+    kernelTls = kernelTlsAvailable();
+    return kernelTls;
+}
+
+bool AsioBackend::adopt(const std::vector<int> &sockets) {
+    for (int fd: sockets) {
+        sockaddr_storage address{};
+        socklen_t length = sizeof(address);
+        if (getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length) !=
+            0)
+            throw std::runtime_error("Can't adopt a listening socket");
+        auto acceptor = std::make_unique<asio::ip::tcp::acceptor>(
+                asio::make_strand(context));
+        acceptor->assign(address.ss_family == AF_INET6 ? asio::ip::tcp::v6()
+                                                       : asio::ip::tcp::v4(),
+                         fd);
+        acceptors.push_back(std::move(acceptor));
+    }
+    return true;
+}
+
+void AsioBackend::listen(const std::shared_ptr<restbed::Settings> &settings) {
+    std::uint16_t port = settings->get_port();
+    std::string bindAddress = settings->get_bind_address();
+    requestTimeout = settings->get_connection_timeout();
+    auto ssl = settings->get_ssl_settings();
+    if (ssl != nullptr) {
+        // The same protocols as createSettingsWithSSL() leaves to restbed
+        tls.emplace(asio::ssl::context::tls_server);
+        tls->set_options(asio::ssl::context::default_workarounds |
+                         asio::ssl::context::no_sslv2 |
+                         asio::ssl::context::no_sslv3 |
+                         asio::ssl::context::no_tlsv1 |
+                         asio::ssl::context::no_tlsv1_1 |
+                         asio::ssl::context::no_compression |
+                         asio::ssl::context::single_dh_use);
+        tls->use_certificate_chain_file(ssl->get_certificate());
+        tls->use_private_key_file(ssl->get_private_key(),
+                                  asio::ssl::context::pem);
+        tls->use_tmp_dh_file(ssl->get_temporary_diffie_hellman());
+        // SSL_write retries with the rest of a partly written buffer
+        SSL_CTX_set_mode(tls->native_handle(),
+                         SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        configureTls(tls->native_handle(), ticketKeys);
+        if (kernelTls)
+            kernelTls = restbes::enableKernelTls(tls->native_handle());
+        port = ssl->get_port();
+        if (!ssl->get_bind_address().empty())
+            bindAddress = ssl->get_bind_address();
+    }
+    if (!acceptors.empty()) return;
+
+    asio::ip::tcp::endpoint endpoint(
+            bindAddress.empty() ? asio::ip::address(asio::ip::address_v6::any())
+                                : asio::ip::make_address(bindAddress),
+            port);
+    auto acceptor =
+            std::make_unique<asio::ip::tcp::acceptor>(asio::make_strand(context));
+    acceptor->open(endpoint.protocol());
+    acceptor->set_option(asio::socket_base::reuse_address(true));
+    if (endpoint.address().is_v6())
+        acceptor->set_option(asio::ip::v6_only(false));
+    if (reusePort) {
+        // The kernel spreads the connections over every process listening
+        int enable = 1;
+        setsockopt(acceptor->native_handle(), SOL_SOCKET, SO_REUSEPORT,
+                   &enable, sizeof(enable));
+    }
+    acceptor->bind(endpoint);
+    acceptor->listen(asio::socket_base::max_listen_connections);
+    acceptors.push_back(std::move(acceptor));
+}
+
+void AsioBackend::accept(asio::ip::tcp::acceptor &acceptor) {
+    acceptor.async_accept(
+            asio::make_strand(context),
+            [this, &acceptor](const asio::error_code &error,
+                              asio::ip::tcp::socket socket) {
+                if (!acceptor.is_open()) return;
+                if (!error)
+                    std::make_shared<AsioSession>(*this, std::move(socket))
+                            ->start();
+                accept(acceptor);
+            });
+}
+
+void AsioBackend::start(const std::shared_ptr<restbed::Settings> &settings,
+                        Task ready) {
+    listen(settings);
+    if (tls) schedule([this]() { ticketKeys.rotate(); }, TICKET_KEY_ROTATION);
+    for (auto &acceptor: acceptors) {
+        asio::post(acceptor->get_executor(),
+                   [this, &acceptor = *acceptor]() { accept(acceptor); });
+    }
+    if (ready) asio::post(context, std::move(ready));
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < std::max(1u, settings->get_worker_limit()); ++i)
+        threads.emplace_back([this]() { context.run(); });
+    context.run();
+    for (auto &thread: threads) thread.join();
+}
+
+void AsioBackend::stopAccepting() {
+    for (auto &acceptor: acceptors) {
+        std::promise<void> closed;
+        asio::post(acceptor->get_executor(), [&acceptor, &closed]() {
+            asio::error_code ignored;
+            acceptor->close(ignored);
+            closed.set_value();
+        });
+        closed.get_future().wait();
+    }
+}
+
+void AsioBackend::stop() {
+    work.reset();
+    context.stop();
+}
+
+} // namespace restbes
@@ -0,0 +1,17 @@
+#include "backend.h"
+#include "asio_backend.h"
+#include "restbed_backend.h"
+
+namespace restbes {
+
+std::unique_ptr<Backend> makeBackend(BackendKind kind, bool reusePort) {
+    switch (kind) {
+        case BackendKind::ASIO:
+            return std::make_unique<AsioBackend>(reusePort);
+        case BackendKind::RESTBED:
+            break;
+    }
+    return std::make_unique<RestbedBackend>();
+}
+
+} // namespace restbes
@@ -0,0 +1,144 @@
+#include "compression.h"
+
+#include <zlib.h>
+#ifdef RESTBES_BROTLI_SUPPORT
+#include <brotli/encode.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <set>
+#include <sstream>
+
+namespace restbes {
+
+namespace {
+
+std::string deflateWith(const std::string &body, int windowBits) {
+    z_stream stream{};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return {};
+    std::string result(deflateBound(&stream, body.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+    stream.avail_in = static_cast<uInt>(body.size());
+    stream.next_out = reinterpret_cast<Bytef *>(result.data());
+    stream.avail_out = static_cast<uInt>(result.size());
+    int code = deflate(&stream, Z_FINISH);
+    result.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (code != Z_STREAM_END) return {};
+    return result;
+}
+
+#ifdef RESTBES_BROTLI_SUPPORT
+std::string brotliCompress(const std::string &body) {
+    std::size_t size = BrotliEncoderMaxCompressedSize(body.size());
+    std::string result(size, '\0');
+    if (!BrotliEncoderCompress(
+            BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+            body.size(), reinterpret_cast<const uint8_t *>(body.data()), &size,
+            reinterpret_cast<uint8_t *>(result.data())))
+        return {};
+    result.resize(size);
+    return result;
+}
+#endif
+
+} // namespace
+
+Encoding negotiateEncoding(const std::string &accept_encoding) {
+    // Codings the client named, refused ones with q=0
+    std::set<std::string> accepted, refused;
+    std::istringstream tokens(accept_encoding);
+    std::string token;
+    while (std::getline(tokens, token, ',')) {
+        std::string coding = token.substr(0, token.find(';'));
+        coding.erase(std::remove_if(coding.begin(), coding.end(), ::isspace),
+                     coding.end());
+        std::transform(coding.begin(), coding.end(), coding.begin(), ::tolower);
+        auto q = token.find("q=");
+        if (q != std::string::npos && std::strtod(token.c_str() + q + 2,
+                                                  nullptr) <= 0)
+            refused.insert(coding);
+        else
+            accepted.insert(coding);
+    }
+    // "*" stands only for the codings the client did not name (RFC 9110,
+    // 12.5.3)
+    bool gzip = accepted.count("gzip") > 0 ||
+                (accepted.count("*") > 0 && refused.count("gzip") == 0);
+    bool deflate = accepted.count("deflate") > 0;
+    [[maybe_unused]] bool brotli = accepted.count("br") > 0;
+#ifdef RESTBES_BROTLI_SUPPORT
+    if (brotli) return Encoding::BROTLI;
+#endif
+    if (gzip) return Encoding::GZIP;
+    if (deflate) return Encoding::DEFLATE;
+    return Encoding::IDENTITY;
+}
+
+const char *encodingName(Encoding encoding) {
+    switch (encoding) {
+        case Encoding::GZIP:
+            return "gzip";
+        case Encoding::DEFLATE:
+            return "deflate";
+        case Encoding::BROTLI:
+            return "br";
+        default:
+            return "identity";
+    }
+}
+
+std::string compress(const std::string &body, Encoding encoding) {
+    switch (encoding) {
+        case Encoding::GZIP:
+            return deflateWith(body, 15 + 16);
+        case Encoding::DEFLATE:
+            return deflateWith(body, 15);
+#ifdef RESTBES_BROTLI_SUPPORT
+        case Encoding::BROTLI:
+            return brotliCompress(body);
+#endif
+        default:
+            return {};
+    }
+}
+
+CompressedBody::CompressedBody(std::string body) : identity(std::move(body)) {
+    if (identity.size() < MIN_COMPRESSED_SIZE) return;
+    gzip = compress(identity, Encoding::GZIP);
+    deflate = compress(identity, Encoding::DEFLATE);
+#ifdef RESTBES_BROTLI_SUPPORT
+    brotli = compress(identity, Encoding::BROTLI);
+#endif
+}
+
+Encoding CompressedBody::effectiveEncoding(Encoding encoding) const {
+    switch (encoding) {
+        case Encoding::GZIP:
+            return gzip.empty() ? Encoding::IDENTITY : encoding;
+        case Encoding::DEFLATE:
+            return deflate.empty() ? Encoding::IDENTITY : encoding;
+        case Encoding::BROTLI:
+            return brotli.empty() ? Encoding::IDENTITY : encoding;
+        default:
+            return Encoding::IDENTITY;
+    }
+}
+
+const std::string &CompressedBody::get(Encoding encoding) const {
+    switch (effectiveEncoding(encoding)) {
+        case Encoding::GZIP:
+            return gzip;
+        case Encoding::DEFLATE:
+            return deflate;
+        case Encoding::BROTLI:
+            return brotli;
+        default:
+            return identity;
+    }
+}
+
+} // namespace restbes
@@ -0,0 +1,53 @@
+#include "core_loops.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+namespace restbes {
+
+namespace {
+
+void pinCurrentThread(std::size_t core) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    // Affinity is an optimization only, e.g. it fails inside a restricted
+    // cpuset and the loop then runs unpinned
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+} // namespace
+
+CoreLoops::CoreLoops(std::size_t count) {
+    std::size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    if (count == 0) count = cores;
+    loops.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        loops.push_back(std::make_unique<folly::ScopedEventBaseThread>(
+                "CoreLoop" + std::to_string(i)));
+        loops.back()->getEventBase()->runInEventBaseThreadAndWait(
+                [core = i % cores]() { pinCurrentThread(core); });
+    }
+}
+
+std::size_t CoreLoops::size() const {
+    return loops.size();
+}
+
+std::size_t CoreLoops::ownerOf(const std::string &key) const {
+    return std::hash<std::string>{}(key) % loops.size();
+}
+
+void CoreLoops::run(std::size_t loop, folly::Func task) const {
+    loops[loop]->getEventBase()->runInEventBaseThread(std::move(task));
+}
+
+bool CoreLoops::isOwnerThread(std::size_t loop) const {
+    return loops[loop]->getEventBase()->isInEventBaseThread();
+}
+
+} // namespace restbes
@@ -0,0 +1,52 @@
+#include "kernel_tls.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+namespace restbes {
+
+bool kernelTlsSupported() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    // The ULP is looked up (and its module loaded) before the socket state
+    // is checked, so an unconnected socket fails with ENOTCONN only when the
+    // kernel has it
+    static const char ulp[] = "tls";
+    bool supported = setsockopt(fd, IPPROTO_TCP, TCP_ULP, ulp,
+                                sizeof(ulp) - 1) == 0 ||
+                     errno == ENOTCONN;
+    close(fd);
+    return supported;
+}
+
+bool kernelTlsAvailable() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && defined(SSL_OP_ENABLE_KTLS) &&   \
+    !defined(OPENSSL_NO_KTLS)
+    return kernelTlsSupported();
+#else
+    return false;
+#endif
+}
+
+bool enableKernelTls(SSL_CTX *context) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && defined(SSL_OP_ENABLE_KTLS) &&   \
+    !defined(OPENSSL_NO_KTLS)
+    if (context == nullptr || !kernelTlsAvailable()) return false;
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+    return true;
+#else
+    (void) context;
+    return false;
+#endif
+}
+
+} // namespace restbes
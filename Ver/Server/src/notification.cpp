@@ -0,0 +1,118 @@
+#include "notification.h"
+#include "websocket.h"
+
+#include <ctime>
+#include <sstream>
+
+namespace restbes {
+
+Notification::Notification(std::string event, const std::string &data,
+                           SharedResponse response, std::string key)
+        : event(std::move(event)), data(data), response(std::move(response)),
+          key(std::move(key)) {
+    frame = "event: " + this->event + '\n';
+    std::istringstream lines(data);
+    std::string line;
+    while (std::getline(lines, line)) frame += "data: " + line + '\n';
+    frame += '\n';
+}
+
+SharedNotification Notification::comment(const std::string &text) {
+    auto notification =
+            std::make_shared<Notification>("", "", nullptr);
+    notification->frame = ": " + text + "\n\n";
+    return notification;
+}
+
+const std::string &Notification::getEvent() const {
+    return event;
+}
+
+const std::string &Notification::getData() const {
+    return data;
+}
+
+const std::string &Notification::getKey() const {
+    return key;
+}
+
+const std::string &Notification::getDeflated() const {
+    std::call_once(deflatedOnce, [this]() { deflated = deflateMessage(data); });
+    return deflated;
+}
+
+const SharedResponse &Notification::getResponse() const {
+    return response;
+}
+
+const std::string &Notification::getFrame() const {
+    return frame;
+}
+
+bool Notification::isComment() const {
+    return event.empty();
+}
+
+NumberedMessage::NumberedMessage(std::uint64_t id,
+                                 SharedNotification notification)
+        : id(id), notification(std::move(notification)) {}
+
+const std::string &NumberedMessage::getData() const {
+    std::call_once(dataOnce, [this]() {
+        const auto &body = notification->getData();
+        auto field = R"({"event_id":)" + std::to_string(id);
+        if (body.empty() || body.front() != '{') {
+            data = field + R"(,"data":)" + (body.empty() ? "null" : body) + '}';
+            return;
+        }
+        auto next = body.find_first_not_of(" \t\r\n", 1);
+        bool emptyObject = next != std::string::npos && body[next] == '}';
+        data = field + (emptyObject ? "" : ",") + body.substr(1);
+    });
+    return data;
+}
+
+const std::string &NumberedMessage::getDeflated() const {
+    std::call_once(deflatedOnce,
+                   [this]() { deflated = deflateMessage(getData()); });
+    return deflated;
+}
+
+SharedNotification makeNotification(const std::string &event,
+                                    const std::string &data,
+                                    std::string key) {
+    return makeNotification(
+            event, data,
+            generateSerializedResponse(data, "application/json",
+                                       Connection::KEEP_ALIVE),
+            std::move(key));
+}
+
+SharedNotification makeNotification(const std::string &event,
+                                    const std::string &data,
+                                    SharedResponse response,
+                                    std::string key) {
+    return std::make_shared<const Notification>(event, data,
+                                                std::move(response),
+                                                std::move(key));
+}
+
+SharedNotification makeResyncNotification() {
+    return makeNotification("resync_required",
+                            R"({"event":"resync_required","timestamp":)" +
+                            std::to_string(std::time(nullptr)) + "}");
+}
+
+SharedNotification makeReconnectNotification(std::chrono::milliseconds retry,
+                                             std::uint64_t lastEventId) {
+    auto data = R"({"event":"reconnect","timestamp":)" +
+                std::to_string(std::time(nullptr)) + R"(,"retry_ms":)" +
+                std::to_string(retry.count()) + R"(,"last_event_id":)" +
+                std::to_string(lastEventId) + "}";
+    // The next poll has to open a connection to the new process
+    return makeNotification("reconnect", data,
+                            generateSerializedResponse(data, "application/json",
+                                                       Connection::CLOSE));
+}
+
+} // namespace restbes
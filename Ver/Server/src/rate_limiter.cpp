@@ -0,0 +1,66 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+
+namespace restbes {
+
+namespace {
+
+double refill(double tokens, std::chrono::steady_clock::duration elapsed,
+              const RateLimit &limit) {
+    std::chrono::duration<double> seconds =
+        std::max(elapsed, std::chrono::steady_clock::duration::zero());
+    return std::min(limit.burst, tokens + seconds.count() * limit.rate);
+}
+
+} // namespace
+
+void RateLimiter::setLimit(RateLimit limit) {
+    burst.store(std::max(1.0, limit.burst), std::memory_order_relaxed);
+    rate.store(limit.rate, std::memory_order_relaxed);
+}
+
+RateLimit RateLimiter::getLimit() const {
+    return {rate.load(std::memory_order_relaxed),
+            burst.load(std::memory_order_relaxed)};
+}
+
+bool RateLimiter::tryAcquire(const std::string &key, Clock::time_point now) {
+    auto limit = getLimit();
+    if (limit.rate <= 0) return true;
+
+    while (true) {
+        auto found = buckets.find(key);
+        auto bucket = found != buckets.cend()
+                          ? found->second
+                          : buckets
+                                .insert(key, std::make_shared<Bucket>(
+                                                 limit.burst, now))
+                                .first->second;
+
+        std::lock_guard lock(bucket->mutex);
+        if (bucket->expired) continue;
+        bucket->tokens = refill(bucket->tokens, now - bucket->updated, limit);
+        bucket->updated = std::max(bucket->updated, now);
+        if (bucket->tokens < 1) return false;
+        bucket->tokens -= 1;
+        return true;
+    }
+}
+
+void RateLimiter::expire(Clock::time_point now) {
+    auto limit = getLimit();
+    for (auto it = buckets.cbegin(); it != buckets.cend(); ++it) {
+        const auto &bucket = it->second;
+        // Erased under the bucket's lock: a token taken after the check
+        // would be lost with a bucket that is no longer in the map
+        std::lock_guard lock(bucket->mutex);
+        bool full = limit.rate <= 0 ||
+                    refill(bucket->tokens, now - bucket->updated, limit) >=
+                        limit.burst;
+        if (full && buckets.erase_if_equal(it->first, bucket) != 0)
+            bucket->expired = true;
+    }
+}
+
+} // namespace restbes
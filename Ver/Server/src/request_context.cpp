@@ -0,0 +1,58 @@
+#include "request_context.h"
+#include "server.h"
+
+#include <folly/experimental/coro/Sleep.h>
+
+namespace restbes {
+
+RequestContext::RequestContext(SharedHttpSession session,
+                               std::shared_ptr<Server> server,
+                               std::string body,
+                               folly::Executor::KeepAlive<> blockingExecutor)
+        : session(std::move(session)), server(std::move(server)),
+          body(std::move(body)),
+          blockingExecutor(std::move(blockingExecutor)) {}
+
+const SharedHttpSession &RequestContext::getSession() const {
+    return session;
+}
+
+const std::shared_ptr<Server> &RequestContext::getServer() const {
+    return server;
+}
+
+std::shared_ptr<const restbed::Request> RequestContext::getRequest() const {
+    return session->get_request();
+}
+
+const std::string &RequestContext::getBody() const {
+    return body;
+}
+
+void RequestContext::respond(const std::string &data,
+                             const std::string &content_type) const {
+    responded = true;
+    restbes::respond(session, *server, data, content_type);
+}
+
+bool RequestContext::hasResponded() const {
+    return responded;
+}
+
+task<void> RequestContext::write(restbed::Bytes data) const {
+    // Shared, the callback has to be copyable. If the connection goes away
+    // first, the broken promise resumes the handler with an exception
+    auto written = std::make_shared<folly::Promise<folly::Unit>>();
+    auto future = written->getSemiFuture();
+    responded = true;
+    session->yield(data, [written](const SharedHttpSession) {
+        written->setValue();
+    });
+    co_await std::move(future);
+}
+
+task<void> RequestContext::sleep(std::chrono::milliseconds duration) const {
+    co_await folly::coro::sleep(duration);
+}
+
+} // namespace restbes
@@ -0,0 +1,94 @@
+#include "response.h"
+#include "server.h"
+
+#include <folly/Synchronized.h>
+
+#include <vector>
+
+namespace restbes {
+
+namespace {
+
+constexpr std::size_t RESPONSE_POOL_SIZE = 256;
+
+folly::Synchronized<std::vector<restbed::Response *>> &getResponsePool() {
+    static folly::Synchronized<std::vector<restbed::Response *>> pool;
+    return pool;
+}
+
+void releaseResponse(restbed::Response *response) {
+    response->set_body(restbed::Bytes());
+    response->set_headers({});
+    {
+        auto lockedPool = getResponsePool().wlock();
+        if (lockedPool->size() < RESPONSE_POOL_SIZE) {
+            lockedPool->push_back(response);
+            return;
+        }
+    }
+    delete response;
+}
+
+void append(restbed::Bytes &out, const std::string &str) {
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+} // namespace
+
+SerializedResponse::SerializedResponse(const restbed::Response &response) {
+    std::string head = "HTTP/1.1 " +
+                       std::to_string(response.get_status_code()) + ' ' +
+                       response.get_status_message() + "\r\n";
+    for (const auto &header: response.get_headers())
+        head += header.first + ": " + header.second + "\r\n";
+    const auto &body = response.get_body();
+    bytes.reserve(head.size() + 2 + body.size());
+    append(bytes, head);
+    headLength = bytes.size();
+    append(bytes, "\r\n");
+    bytes.insert(bytes.end(), body.begin(), body.end());
+}
+
+const restbed::Bytes &SerializedResponse::getBytes() const {
+    return bytes;
+}
+
+std::size_t SerializedResponse::size() const {
+    return bytes.size();
+}
+
+void SerializedResponse::appendTo(restbed::Bytes &out,
+                                  const std::string &extraHeaders) const {
+    if (extraHeaders.empty()) {
+        out.insert(out.end(), bytes.begin(), bytes.end());
+        return;
+    }
+    out.insert(out.end(), bytes.begin(), bytes.begin() + headLength);
+    append(out, extraHeaders);
+    out.insert(out.end(), bytes.begin() + headLength, bytes.end());
+}
+
+std::shared_ptr<restbed::Response> acquireResponse() {
+    restbed::Response *response = nullptr;
+    {
+        auto lockedPool = getResponsePool().wlock();
+        if (!lockedPool->empty()) {
+            response = lockedPool->back();
+            lockedPool->pop_back();
+        }
+    }
+    if (response == nullptr) response = new restbed::Response();
+    return std::shared_ptr<restbed::Response>(response, releaseResponse);
+}
+
+SharedResponse serializeResponse(const restbed::Response &response) {
+    return std::make_shared<const SerializedResponse>(response);
+}
+
+SharedResponse generateSerializedResponse(const std::string &body,
+                                          const std::string &content_type,
+                                          Connection connection) {
+    return serializeResponse(*generateResponse(body, content_type, connection));
+}
+
+} // namespace restbes
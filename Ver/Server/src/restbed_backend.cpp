@@ -0,0 +1,223 @@
+#include "restbed_backend.h"
+#include "upgrade.h"
+
+#include <utility>
+
+namespace restbes {
+
+namespace {
+
+// Attribute of the restbed session that refers to its adapter
+const std::string ADAPTER_KEY = "restbes.session";
+
+// Holds nothing but the socket, so the handlers restbed keeps make a new one
+// instead of referring back to it
+struct RestbedWebSocket : WebSocketConnection {
+private:
+    std::shared_ptr<restbed::WebSocket> socket;
+
+public:
+    explicit RestbedWebSocket(std::shared_ptr<restbed::WebSocket> socket)
+            : socket(std::move(socket)) {}
+
+    bool is_open() const override {
+        return socket->is_open();
+    }
+
+    bool is_closed() const override {
+        return socket->is_closed();
+    }
+
+    void send(const Message &message, Callback sent) override {
+        if (sent == nullptr) {
+            socket->send(message);
+            return;
+        }
+        socket->send(message, [sent](
+                const std::shared_ptr<restbed::WebSocket> socket) {
+            sent(std::make_shared<RestbedWebSocket>(socket));
+        });
+    }
+
+    void close() override {
+        socket->close();
+    }
+
+    void set_message_handler(MessageHandler handler) override {
+        socket->set_message_handler([handler](
+                const std::shared_ptr<restbed::WebSocket> socket,
+                const Message message) {
+            handler(std::make_shared<RestbedWebSocket>(socket), message);
+        });
+    }
+
+    void set_close_handler(Callback handler) override {
+        socket->set_close_handler([handler](
+                const std::shared_ptr<restbed::WebSocket> socket) {
+            handler(std::make_shared<RestbedWebSocket>(socket));
+        });
+    }
+
+    void set_error_handler(ErrorHandler handler) override {
+        socket->set_error_handler([handler](
+                const std::shared_ptr<restbed::WebSocket> socket,
+                const std::error_code error) {
+            handler(std::make_shared<RestbedWebSocket>(socket), error);
+        });
+    }
+};
+
+struct RestbedSession : HttpSession {
+private:
+    std::shared_ptr<restbed::Session> session;
+
+public:
+    explicit RestbedSession(std::shared_ptr<restbed::Session> session)
+            : session(std::move(session)) {}
+
+    std::shared_ptr<const restbed::Request> get_request() const override {
+        return session->get_request();
+    }
+
+    std::string get_origin() const override {
+        return session->get_origin();
+    }
+
+    bool is_open() const override {
+        return session->is_open();
+    }
+
+    bool is_closed() const override {
+        return session->is_closed();
+    }
+
+    void fetch(std::size_t length, FetchCallback callback) override {
+        session->fetch(length, [self = shared_from_this(), callback](
+                const std::shared_ptr<restbed::Session>,
+                const restbed::Bytes &body) { callback(self, body); });
+    }
+
+    void yield(const restbed::Bytes &data, Callback callback) override {
+        if (callback == nullptr) {
+            session->yield(data);
+            return;
+        }
+        session->yield(data, [self = shared_from_this(), callback](
+                const std::shared_ptr<restbed::Session>) { callback(self); });
+    }
+
+    void yield(const restbed::Response &response) override {
+        session->yield(response);
+    }
+
+    void write(const restbed::Bytes &data, Callback written) override {
+        // restbed reads the next request only after yields without a
+        // callback, an empty one re-arms it
+        session->yield(data, [self = shared_from_this(), written](
+                const std::shared_ptr<restbed::Session> session) {
+            written(self);
+            if (session->is_open()) session->yield(restbed::Bytes());
+        });
+    }
+
+    void close(const restbed::Bytes &data) override {
+        session->close(data);
+    }
+
+    void close(const restbed::Response &response) override {
+        session->close(response);
+    }
+
+    void close(int status) override {
+        session->close(status);
+    }
+
+    void close() override {
+        session->close();
+    }
+
+    void upgrade(int status,
+                 const std::multimap<std::string, std::string> &headers,
+                 UpgradeCallback callback) override {
+        session->upgrade(status, headers, [callback](
+                const std::shared_ptr<restbed::WebSocket> socket) {
+            callback(std::make_shared<RestbedWebSocket>(socket));
+        });
+    }
+
+    std::shared_ptr<restbed::Session> native() const override {
+        return session;
+    }
+};
+
+// restbed keeps one session per connection. Its adapter is reused while
+// someone holds it, so sessions of the same connection compare equal
+SharedHttpSession wrap(const std::shared_ptr<restbed::Session> &session) {
+    if (session->has(ADAPTER_KEY)) {
+        std::weak_ptr<HttpSession> cached = session->get(ADAPTER_KEY);
+        if (auto adapter = cached.lock()) return adapter;
+    }
+    SharedHttpSession adapter = std::make_shared<RestbedSession>(session);
+    // Weak, the restbed session must not keep its adapter alive
+    session->set(ADAPTER_KEY, std::weak_ptr<HttpSession>(adapter));
+    return adapter;
+}
+
+} // namespace
+
+RestbedBackend::RestbedBackend() : service(new restbed::Service()) {}
+
+void RestbedBackend::publish(std::shared_ptr<const Resource> resource) {
+    auto target = std::make_shared<restbed::Resource>();
+    target->set_path(resource->path);
+    for (const auto &[method, handler]: resource->methods) {
+        target->set_method_handler(
+                method, [handler = handler](
+                        const std::shared_ptr<restbed::Session> session) {
+                    handler(wrap(session));
+                });
+    }
+    if (resource->errorHandler) {
+        target->set_error_handler(
+                [handler = resource->errorHandler](
+                        const int code, const std::exception &exception,
+                        const std::shared_ptr<restbed::Session> session) {
+                    handler(code, exception,
+                            session == nullptr ? nullptr : wrap(session));
+                });
+    }
+    service->publish(target);
+}
+
+void RestbedBackend::schedule(Task task, std::chrono::milliseconds interval) {
+    service->schedule(std::move(task), interval);
+}
+
+bool RestbedBackend::adopt(const std::vector<int> &) {
+    return false;
+}
+
+void RestbedBackend::start(const std::shared_ptr<restbed::Settings> &settings,
+                           Task ready) {
+    if (ready) {
+        service->set_ready_handler(
+                [ready = std::move(ready)](restbed::Service &) { ready(); });
+    }
+    service->start(settings);
+}
+
+void RestbedBackend::stopAccepting() {
+    // restbed does not expose its acceptors, the descriptors are swapped
+    // under it
+    restbes::stopAccepting(listeningSockets());
+}
+
+bool RestbedBackend::hasNativeSessions() const {
+    return true;
+}
+
+void RestbedBackend::stop() {
+    service->stop();
+}
+
+} // namespace restbes
@@ -1,90 +1,354 @@
 #include "server.h"
 #include "user.h"
 #include "session.h"
+#include "compression.h"
+#include "response.h"
+#include "upgrade.h"
+#include "websocket.h"
 
+#include <folly/executors/SerialExecutor.h>
+#include <folly/json.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <thread>
 #include <utility>
 
 namespace restbes {
 
-Server::Server() : service(new restbed::Service()) {}
+namespace {
 
-folly::Synchronized<Server::UserCollection>::ConstRLockedPtr
-Server::getUsers() const {
-    return users.rlock();
+// Random, so that the ids a restarted server gets from the clients of its
+// predecessor are unlikely to match its own sessions
+std::uint32_t firstSessionGeneration() {
+    return std::random_device{}();
 }
 
-folly::Synchronized<Server::UserCollection>::WLockedPtr Server::getUsersW() {
-    return users.wlock();
+} // namespace
+
+Server::Server()
+        : sessions(firstSessionGeneration()),
+          fanOutPool(std::make_shared<folly::CPUThreadPoolExecutor>(
+                  std::max(1u, std::thread::hardware_concurrency()))),
+          admission(std::make_unique<AdmissionScheduler>(
+                  HANDLER_THREADS)),
+          blockingPool(std::make_shared<folly::CPUThreadPoolExecutor>(
+                  BLOCKING_THREADS)),
+          backend(makeBackend(BackendKind::RESTBED)) {}
+
+const Server::UserCollection &Server::getUsers() const {
+    return users;
 }
 
-folly::Synchronized<Server::SessionCollection>::ConstRLockedPtr
-Server::getSessions() const {
-    return sessions.rlock();
+const Server::SessionCollection &Server::getSessions() const {
+    return sessions;
 }
 
-folly::Synchronized<Server::SessionCollection>::WLockedPtr
-Server::getSessionsW() {
-    return sessions.wlock();
+Server::SessionCollection &Server::getSessions() {
+    return sessions;
 }
 
-std::shared_ptr<Session> Server::getSession(unsigned int session_id) const {
-    if (session_id == 0) return nullptr;
-    auto lockedSessions = sessions.rlock();
-    auto session = lockedSessions->find(session_id);
-    if (session != lockedSessions->end()) return session->second;
-    return nullptr;
+namespace {
+
+constexpr SessionId SESSION_WORKER_MASK = SessionId(0xFF)
+                                          << SESSION_WORKER_SHIFT;
+
+} // namespace
+
+std::shared_ptr<Session> Server::getSession(SessionId session_id) const {
+    if (session_id == 0 || (session_id & SESSION_WORKER_MASK) != workerTag)
+        return nullptr;
+    return sessions.find(session_id & ~SESSION_WORKER_MASK);
+}
+
+SessionId Server::addSession(SharedHttpSession session,
+                             std::string user_id, Transport transport) {
+    std::shared_ptr<Session> created;
+    auto slot = sessions.emplace([&](SessionId id) {
+        created = std::make_shared<Session>(std::move(session),
+                                            std::move(user_id),
+                                            id | workerTag, this, transport);
+        return created;
+    });
+    if (slot == 0) throw std::runtime_error("Session table is full");
+    scheduleSessionCheck(created, SESSION_CHECK_INTERVAL);
+    return slot | workerTag;
+}
+
+void Server::scheduleSessionCheck(const std::shared_ptr<Session> &session,
+                                  std::chrono::steady_clock::duration delay) {
+    sessionExpiry.schedule({session->getId(), session->rearmExpiry()}, delay);
+}
+
+void Server::sessionClosed(SessionId session_id) {
+    auto session = getSession(session_id);
+    if (session == nullptr || !session->reportClosed()) return;
+    scheduleSessionCheck(session, SESSION_RECONNECT_GRACE);
+}
+
+void Server::expireSessions() {
+    sessionExpiry.advance([this](const SessionCheck &check) {
+        auto session_id = check.session_id;
+        auto session = getSession(session_id);
+        if (session == nullptr || !session->isExpiryCurrent(check.generation))
+            return;
+        if (session->is_open()) {
+            scheduleSessionCheck(session, SESSION_CHECK_INTERVAL);
+            return;
+        }
+        // Closed without a drain noticing, the grace starts now
+        if (session->reportClosed()) {
+            scheduleSessionCheck(session, SESSION_RECONNECT_GRACE);
+            return;
+        }
+        auto idle = session->idleFor();
+        if (idle < SESSION_RECONNECT_GRACE) {
+            scheduleSessionCheck(session, SESSION_RECONNECT_GRACE - idle);
+            return;
+        }
+        sessions.erase(session_id & ~SESSION_WORKER_MASK);
+        droppedByErased += session->getDroppedCount();
+        auto user = getUser(session->getUserId());
+        if (user != nullptr) user->eraseSession(session_id);
+    });
+}
+
+void Server::setFlushWindow(std::chrono::milliseconds window) {
+    flushWindow = window;
+}
+
+std::chrono::milliseconds Server::getFlushWindow() const {
+    return flushWindow;
+}
+
+void Server::flushSessions() {
+    deferredFlushes.consumeAll([this](SessionId session_id) {
+        auto session = getSession(session_id);
+        if (session != nullptr) session->flush();
+    });
+}
+
+void Server::setQueueLimits(QueueLimits limits) {
+    queueLimits = limits;
 }
 
-unsigned int Server::addSession(std::shared_ptr<restbed::Session> session,
-                                std::string user_id) {
-    auto ss = std::make_shared<Session>(std::move(session), std::move(user_id));
-    auto session_id = ++sessionCounter;
-    sessions.wlock()->insert({session_id, std::move(ss)});
-    return session_id;
+const QueueLimits &Server::getQueueLimits() const {
+    return queueLimits;
 }
 
-void Server::assignSession(unsigned int session_id,
+void Server::deferFlush(SessionId session_id) {
+    deferredFlushes.push(session_id);
+}
+
+std::uint64_t Server::getDroppedCount() const {
+    std::uint64_t dropped = droppedByErased;
+    sessions.forEach([&dropped](const std::shared_ptr<Session> &session) {
+        dropped += session->getDroppedCount();
+    });
+    return dropped;
+}
+
+void Server::assignSession(SessionId session_id,
                            const std::string &user_id) const {
+    if (workerGroup != nullptr &&
+        (session_id & SESSION_WORKER_MASK) != workerTag) {
+        workerGroup->assignSession(
+                (session_id & SESSION_WORKER_MASK) >> SESSION_WORKER_SHIFT,
+                session_id, user_id);
+        return;
+    }
     getSession(session_id)->setUser(user_id);
     getUser(user_id)->addSession(session_id);
 }
 
+void Server::replayEvents(SessionId session_id, const std::string &user_id,
+                          std::uint64_t lastEventId) const {
+    auto session = getSession(session_id);
+    auto user = getUser(user_id);
+    if (session != nullptr && user != nullptr) user->replay(session, lastEventId);
+}
+
 std::shared_ptr<User> Server::getUser(const std::string &name) const {
-    if (users.rlock()->count(name) == 0) return nullptr;
-    else return users.rlock()->at(name);
+    auto user = users.find(name);
+    if (user != users.cend()) return user->second;
+    return nullptr;
 }
 
-void Server::addUser(const std::string &name, std::shared_ptr<Server> serv) {
-    if (serv->users.rlock()->count(name) == 0) {
-        serv->users.wlock()->insert({name, std::make_shared<User>(name, serv)});
+std::shared_ptr<User> Server::getOrCreateUser(const std::string &name) {
+    auto user = getUser(name);
+    if (user != nullptr) return user;
+    auto created = users.try_emplace(name, std::make_shared<User>(name, this));
+    if (created.second) {
+        scheduleUserExpiry(name, userIdleTtl);
+        markUserIdle(created.first->second);
+        evictLeastRecentlyIdle();
+    }
+    return created.first->second;
+}
+
+std::shared_ptr<User>
+Server::getOrCreateUser(const std::string &name,
+                        const std::shared_ptr<Server> &serv) {
+    return serv->getOrCreateUser(name);
+}
+
+void Server::setUserIdleTtl(std::chrono::seconds ttl) {
+    userIdleTtl = ttl;
+}
+
+std::chrono::seconds Server::getUserIdleTtl() const {
+    return userIdleTtl;
+}
+
+void Server::scheduleUserExpiry(const std::string &name,
+                                std::chrono::steady_clock::duration delay) {
+    userExpiry.schedule(name, delay);
+}
+
+void Server::expireUsers() {
+    userExpiry.advance([this](const std::string &name) {
+        auto user = getUser(name);
+        if (user != nullptr) user->evictIfIdle(userIdleTtl);
+    });
+}
+
+bool Server::eraseUser(const std::string &name,
+                       const std::shared_ptr<User> &user) {
+    return users.erase_if_equal(name, user) > 0;
+}
+
+void Server::setMaxUsers(std::size_t count) {
+    maxUsers = count;
+}
+
+void Server::markUserIdle(const std::shared_ptr<User> &user) {
+    std::lock_guard<std::mutex> lock(idleUsersMutex);
+    auto position = idlePositions.find(user.get());
+    if (position != idlePositions.end()) idleUsers.erase(position->second);
+    idleUsers.emplace_back(user.get(), user);
+    idlePositions[user.get()] = std::prev(idleUsers.end());
+}
+
+void Server::unmarkUserIdle(const User &user) {
+    std::lock_guard<std::mutex> lock(idleUsersMutex);
+    auto position = idlePositions.find(&user);
+    if (position == idlePositions.end()) return;
+    idleUsers.erase(position->second);
+    idlePositions.erase(position);
+}
+
+void Server::evictLeastRecentlyIdle() {
+    auto count = users.size();
+    if (maxUsers == 0 || count <= maxUsers) return;
+    std::vector<std::shared_ptr<User>> evicted;
+    {
+        std::lock_guard<std::mutex> lock(idleUsersMutex);
+        for (auto excess = count - maxUsers; excess != 0 && !idleUsers.empty();
+             --excess) {
+            auto [key, weak] = idleUsers.front();
+            idlePositions.erase(key);
+            idleUsers.pop_front();
+            if (auto user = weak.lock()) evicted.push_back(std::move(user));
+        }
     }
+    // Users that got a session in the meantime stay
+    for (const auto &user: evicted)
+        user->evictIfIdle(std::chrono::steady_clock::duration::zero());
+}
+
+void Server::addUser(const std::string &name, std::shared_ptr<Server> serv) {
+    getOrCreateUser(name, serv);
 }
 
-void Server::addResource(std::shared_ptr<restbed::Resource> resource) {
-    service->publish(resource);
+void Server::addResource(std::shared_ptr<Resource> resource) {
+    backend->publish(std::move(resource));
 }
 
 void Server::setSettings(std::shared_ptr<restbed::Settings> newSettings) {
     settings = std::move(newSettings);
 }
 
+void Server::setBackend(std::unique_ptr<Backend> newBackend) {
+    backend = std::move(newBackend);
+}
+
+bool Server::enableKernelTls() {
+    return backend->enableKernelTls();
+}
+
 void Server::schedule(const ScheduledTask &task,
                       std::shared_ptr<Server> server,
                       const std::chrono::duration<int64_t, std::ratio<1, 1000>> &interval) {
-    service->schedule(generateScheduledTask(task, std::move(server)), interval);
+    backend->schedule(generateScheduledTask(task, std::move(server)), interval);
 }
 
 void Server::startServer() {
-    service->start(settings);
+    Backend::Task ready;
+    if (!upgradeSocket.empty()) {
+        auto inherited = takeOverSockets(upgradeSocket);
+        // A backend that binds its own sockets needs the ports free: closing
+        // the last descriptors of the inherited ones frees them. Connections
+        // still waiting in their backlogs are reset
+        if (!backend->adopt(inherited))
+            for (int fd: inherited) close(fd);
+        ready = [this]() {
+            std::thread([this]() {
+                auto stop = [this](const std::vector<int> &) {
+                    backend->stopAccepting();
+                };
+                if (awaitUpgrade(upgradeSocket, stop)) drain();
+            }).detach();
+        };
+    }
+    backend->start(settings, std::move(ready));
+}
+
+void Server::setUpgradeSocket(const std::string &path, DrainLimits limits) {
+    upgradeSocket = path;
+    drainLimits = limits;
+}
+
+bool Server::isDraining() const {
+    return draining;
+}
+
+void Server::drain() {
+    draining = true;
+    admission->waitIdle(std::chrono::steady_clock::now() + drainLimits.timeout);
+
+    // Jittered, so the clients don't all reconnect and resync at once
+    std::mt19937 random(std::random_device{}());
+    std::uniform_int_distribution<std::chrono::milliseconds::rep> retry(
+            0, drainLimits.spread.count());
+    sessions.forEach([&](const std::shared_ptr<Session> &session) {
+        std::chrono::milliseconds delay(retry(random));
+        auto user = getUser(session->getUserId());
+        if (user != nullptr) user->requestReconnect(session, delay);
+        else session->push(makeReconnectNotification(delay, 0));
+    });
+    std::this_thread::sleep_for(drainLimits.spread + SESSION_RECONNECT_GRACE);
+    backend->stop();
 }
 
+namespace {
+
 std::shared_ptr<restbed::Response>
-generateResponse(const std::string &body, const std::string &content_type,
-                 Connection connection) {
-    auto response = std::make_shared<restbed::Response>();
+generateEncodedResponse(const std::string &body,
+                        const std::string &content_type,
+                        Connection connection, Encoding encoding) {
+    auto response = acquireResponse();
     response->set_body(body);
     response->set_header("Content-Length", std::to_string(body.size()));
     response->set_header("Content-Type", content_type);
+    if (encoding != Encoding::IDENTITY)
+        response->set_header("Content-Encoding", encodingName(encoding));
+    response->set_header("Vary", "Accept-Encoding");
     switch (connection) {
         case Connection::KEEP_ALIVE:
             response->set_header("Connection", "keep-alive");
@@ -99,31 +363,361 @@ generateResponse(const std::string &body, const std::string &content_type,
     return response;
 }
 
-restbed_HTTP_Handler
+} // namespace
+
+std::shared_ptr<restbed::Response>
+generateResponse(const std::string &body, const std::string &content_type,
+                 Connection connection, Encoding encoding) {
+    if (encoding == Encoding::IDENTITY || body.size() < MIN_COMPRESSED_SIZE)
+        return generateEncodedResponse(body, content_type, connection,
+                                       Encoding::IDENTITY);
+    std::string compressed = compress(body, encoding);
+    if (compressed.empty())
+        return generateEncodedResponse(body, content_type, connection,
+                                       Encoding::IDENTITY);
+    return generateEncodedResponse(compressed, content_type, connection,
+                                   encoding);
+}
+
+std::shared_ptr<restbed::Response>
+generateResponse(const CompressedBody &body, const std::string &content_type,
+                 Connection connection, Encoding encoding) {
+    return generateEncodedResponse(body.get(encoding), content_type,
+                                   connection,
+                                   body.effectiveEncoding(encoding));
+}
+
+Encoding acceptedEncoding(const SharedHttpSession &session) {
+    return negotiateEncoding(
+            session->get_request()->get_header("Accept-Encoding", ""));
+}
+
+Connection
+requestedConnection(const SharedHttpSession &session, const Server &server) {
+    auto request = session->get_request();
+    auto connection = request->get_header("Connection", "");
+    std::transform(connection.begin(), connection.end(), connection.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    if (connection == "close" || server.isDraining())
+        return Connection::CLOSE;
+    // HTTP/1.0 clients have to ask for a persistent connection
+    if (request->get_version() < 1.1 && connection != "keep-alive")
+        return Connection::CLOSE;
+    return Connection::KEEP_ALIVE;
+}
+
+namespace {
+
+void send(const SharedHttpSession &session,
+          const restbed::Response &response, Connection connection) {
+    // Without a callback the backend waits for the next request on the same
+    // connection after the write
+    if (connection == Connection::KEEP_ALIVE) session->yield(response);
+    else session->close(response);
+}
+
+SharedResponse generateRejection(ResponseCode code, const std::string &message,
+                                 Connection connection) {
+    restbed::Response response;
+    response.set_status_code(code);
+    response.set_status_message(message);
+    response.set_header("Retry-After", "1");
+    response.set_header("Content-Length", "0");
+    response.set_header("Connection", connection == Connection::KEEP_ALIVE
+                                          ? "keep-alive"
+                                          : "close");
+    return serializeResponse(response);
+}
+
+std::string rateLimitKey(const SharedHttpSession &session) {
+    auto request = session->get_request();
+    auto user_id = request->get_header("User-ID", "");
+    if (!user_id.empty()) return "user:" + user_id;
+    auto session_id = request->get_header("Session-ID", "");
+    if (!session_id.empty()) return "session:" + session_id;
+    // Without the port, every connection from one address shares a bucket
+    auto origin = session->get_origin();
+    return "origin:" + origin.substr(0, origin.rfind(':'));
+}
+
+// Same buckets as the HTTP requests of the session's user
+std::string rateLimitKey(const Session &session) {
+    auto user_id = session.getUserId();
+    if (!user_id.empty()) return "user:" + user_id;
+    return "session:" + std::to_string(session.getId());
+}
+
+void reject(const SharedHttpSession &session, const Server &server,
+            const SharedResponse &keepAlive, const SharedResponse &close) {
+    if (requestedConnection(session, server) == Connection::KEEP_ALIVE)
+        session->yield(keepAlive->getBytes());
+    else
+        session->close(close->getBytes());
+}
+
+bool withinRateLimit(const SharedHttpSession &session, const Server &server,
+                     RateLimiter &limiter) {
+    if (limiter.tryAcquire(rateLimitKey(session))) return true;
+    static const SharedResponse keepAlive = generateRejection(
+        ResponseCode::TOO_MANY_REQUESTS, "Too Many Requests",
+        Connection::KEEP_ALIVE);
+    static const SharedResponse close =
+        generateRejection(ResponseCode::TOO_MANY_REQUESTS,
+                          "Too Many Requests", Connection::CLOSE);
+    reject(session, server, keepAlive, close);
+    return false;
+}
+
+void shedLoad(const SharedHttpSession &session, const Server &server) {
+    static const SharedResponse keepAlive = generateRejection(
+        ResponseCode::SERVICE_UNAVAILABLE, "Service Unavailable",
+        Connection::KEEP_ALIVE);
+    static const SharedResponse close =
+        generateRejection(ResponseCode::SERVICE_UNAVAILABLE,
+                          "Service Unavailable", Connection::CLOSE);
+    reject(session, server, keepAlive, close);
+}
+
+} // namespace
+
+void respond(const SharedHttpSession &session, const Server &server,
+             const std::string &body, const std::string &content_type) {
+    auto connection = requestedConnection(session, server);
+    send(session, *generateResponse(body, content_type, connection,
+                                    acceptedEncoding(session)),
+         connection);
+}
+
+void respond(const SharedHttpSession &session, const Server &server,
+             const CompressedBody &body, const std::string &content_type) {
+    auto connection = requestedConnection(session, server);
+    send(session, *generateResponse(body, content_type, connection,
+                                    acceptedEncoding(session)),
+         connection);
+}
+
+HttpHandler
 Server::generateGetMethodHandler(const GET_Handler &callback,
-                                  std::shared_ptr<Server> server) {
-    return [callback, server](std::shared_ptr<restbed::Session> session) {
-            callback(std::move(session), server);
+                                  const ErrorHandler &errorHandler,
+                                  std::shared_ptr<Server> server,
+                                  std::shared_ptr<RateLimiter> limiter,
+                                  Priority priority) {
+    return [callback, errorHandler, server, limiter, priority](
+                   SharedHttpSession session) {
+            if (!withinRateLimit(session, *server, *limiter)) return;
+            if (!server->admission->submit(
+                        priority,
+                        [callback, errorHandler, server, session] {
+                            try {
+                                callback(session, server);
+                            } catch (const std::exception &exception) {
+                                errorHandler(
+                                        ResponseCode::INTERNAL_SERVER_ERROR,
+                                        exception, session, server);
+                            }
+                        }))
+                shedLoad(session, *server);
     };
 }
 
-restbed_HTTP_Handler
+HttpHandler
 Server::generatePostMethodHandler(const POST_Handler &callback,
-                                  std::shared_ptr<Server> server) {
-    return [callback, server](std::shared_ptr<restbed::Session> session) {
+                                  const ErrorHandler &errorHandler,
+                                  std::shared_ptr<Server> server,
+                                  std::shared_ptr<RateLimiter> limiter,
+                                  Priority priority) {
+    return [callback, errorHandler, server, limiter, priority](
+                   SharedHttpSession session) {
         int content_length = session->get_request()->get_header(
                 "Content-Length", 0);
+        // The body is read even when the request is rejected, so the
+        // connection can take the next request
         session->fetch(
                 content_length,
-                [callback, server](
-                        const std::shared_ptr<restbed::Session> session,
+                [callback, errorHandler, server, limiter, priority](
+                        const SharedHttpSession session,
                         const restbed::Bytes &body) {
+                    if (!withinRateLimit(session, *server, *limiter)) return;
                     std::string data = std::string(body.begin(), body.end());
-                    callback(session, data, server);
+                    if (!server->admission->submit(
+                                priority,
+                                [callback, errorHandler, server, session,
+                                 data = std::move(data)] {
+                                    try {
+                                        callback(session, data, server);
+                                    } catch (const std::exception &exception) {
+                                        errorHandler(
+                                            ResponseCode::INTERNAL_SERVER_ERROR,
+                                            exception, session, server);
+                                    }
+                                }))
+                        shedLoad(session, *server);
                 });
     };
 }
 
+HttpHandler
+Server::generateCoroutineHandler(const CoroutineHandler &callback,
+                                 const ErrorHandler &errorHandler,
+                                 std::shared_ptr<Server> server,
+                                 std::shared_ptr<RateLimiter> limiter,
+                                 Priority priority) {
+    auto admit = [callback, errorHandler, server, limiter, priority](
+            const SharedHttpSession &session, std::string body) {
+        if (!withinRateLimit(session, *server, *limiter)) return;
+        // The request stays in flight until the coroutine completes, so a
+        // draining server waits for it
+        auto run = [callback, errorHandler, server, priority, session,
+                    body = std::move(body)](folly::Func done) mutable {
+            auto context = std::make_shared<RequestContext>(
+                    session, server, std::move(body),
+                    server->getBlockingExecutor());
+            callback(*context)
+                    .scheduleOn(server->admission->getExecutor(priority))
+                    .start([context, errorHandler, server,
+                            done = std::move(done)](auto &&result) mutable {
+                        if (result.hasException() && context->hasResponded()) {
+                            // A 500 would land in the middle of the reply or
+                            // after it, the client sees the connection drop
+                            context->getSession()->close();
+                        } else if (result.hasException()) {
+                            std::runtime_error failure(
+                                    result.exception().what().toStdString());
+                            errorHandler(ResponseCode::INTERNAL_SERVER_ERROR,
+                                         failure, context->getSession(),
+                                         server);
+                        }
+                        done();
+                    });
+        };
+        if (!server->admission->submitAsync(priority, std::move(run)))
+            shedLoad(session, *server);
+    };
+    return [admit](SharedHttpSession session) {
+        std::size_t content_length = session->get_request()->get_header(
+                "Content-Length", 0);
+        if (content_length == 0) {
+            admit(session, "");
+            return;
+        }
+        session->fetch(content_length,
+                       [admit](const SharedHttpSession session,
+                               const restbed::Bytes &body) {
+                           admit(session, std::string(body.begin(), body.end()));
+                       });
+    };
+}
+
+HttpHandler
+Server::generateWebSocketHandler(const WebSocketHandler &callback,
+                                 std::shared_ptr<Server> server,
+                                 std::shared_ptr<RateLimiter> limiter) {
+    return [callback, server, limiter](SharedHttpSession session) {
+        auto request = session->get_request();
+        if (request->get_header("Upgrade", "") != "websocket") {
+            session->close(restbed::BAD_REQUEST);
+            return;
+        }
+        std::string user_id = request->get_header("User-ID", "");
+        SessionId session_id = request->get_header("Session-ID", SessionId(0));
+        bool deflate = offersPerMessageDeflate(
+                request->get_header("Sec-WebSocket-Extensions", ""));
+        bool binary = request->get_query_parameter("frames", "") == "binary";
+        std::uint64_t lastEventId = std::strtoull(
+                request->get_header("Last-Event-ID", "0").c_str(), nullptr, 10);
+
+        std::multimap<std::string, std::string> headers{
+                {"Upgrade", "websocket"},
+                {"Connection", "Upgrade"},
+                {"Sec-WebSocket-Accept",
+                 webSocketAccept(request->get_header("Sec-WebSocket-Key", ""))}};
+        if (deflate)
+            headers.insert({"Sec-WebSocket-Extensions", PER_MESSAGE_DEFLATE});
+
+        session->upgrade(restbed::SWITCHING_PROTOCOLS, headers, [=](
+                const SharedWebSocket socket) {
+            auto id = session_id;
+            auto realSession = server->getSession(id);
+            bool created = realSession == nullptr;
+            if (created) {
+                id = server->addSession(session, "");
+                realSession = server->getSession(id);
+            }
+            if (!user_id.empty()) {
+                getOrCreateUser(user_id, server);
+                if (realSession->getUserId().empty())
+                    server->assignSession(id, user_id);
+            }
+
+            std::weak_ptr<Session> weakSession = realSession;
+            // Handlers may block on the database, so they leave the I/O
+            // thread, but messages of one socket are still handled in order
+            auto serial = folly::SerialExecutor::create(
+                    server->getBlockingExecutor());
+            socket->set_message_handler([callback, server, limiter,
+                                         weakSession, deflate, serial](
+                    const SharedWebSocket socket,
+                    const std::shared_ptr<restbed::WebSocketMessage> message) {
+                const auto &data = message->get_data();
+                switch (message->get_opcode()) {
+                    case restbed::WebSocketMessage::PING_FRAME:
+                        socket->send(std::make_shared<restbed::WebSocketMessage>(
+                                restbed::WebSocketMessage::PONG_FRAME, data));
+                        break;
+                    case restbed::WebSocketMessage::CONNECTION_CLOSE_FRAME:
+                        socket->close();
+                        break;
+                    case restbed::WebSocketMessage::TEXT_FRAME:
+                    case restbed::WebSocketMessage::BINARY_FRAME: {
+                        auto receivingSession = weakSession.lock();
+                        if (receivingSession == nullptr) break;
+                        if (!limiter->tryAcquire(
+                                    rateLimitKey(*receivingSession))) {
+                            receivingSession->sendMessage(folly::toJson(
+                                    folly::dynamic::object("event", "error")(
+                                            "message", "Too Many Requests")));
+                            break;
+                        }
+                        std::string text(data.begin(), data.end());
+                        if (deflate && message->get_rsv1_flag())
+                            text = inflateMessage(text);
+                        serial->add([callback, server, receivingSession,
+                                     text = std::move(text)] {
+                            try {
+                                callback(receivingSession, text, server);
+                            } catch (const std::exception &exception) {
+                                receivingSession->sendMessage(folly::toJson(
+                                        folly::dynamic::object("event", "error")(
+                                                "message", exception.what())));
+                            }
+                        });
+                        break;
+                    }
+                    default:
+                        break;
+                }
+            });
+            socket->set_close_handler([server, id](const SharedWebSocket) {
+                server->sessionClosed(id);
+            });
+            socket->set_error_handler([server, id](const SharedWebSocket,
+                                                   const std::error_code) {
+                server->sessionClosed(id);
+            });
+
+            realSession->setWebSocket(socket, deflate, binary);
+            if (!user_id.empty())
+                server->replayEvents(id, user_id, lastEventId);
+            if (created) {
+                realSession->push(makeNotification(
+                        "new_session",
+                        folly::toJson(folly::dynamic::object(
+                                "event", "new_session")("session_id", id))));
+            }
+        });
+    };
+}
+
 std::function<void(void)>
 Server::generateScheduledTask(const ScheduledTask &task,
                               std::shared_ptr<Server> server) {
@@ -132,41 +726,355 @@ Server::generateScheduledTask(const ScheduledTask &task,
     };
 }
 
-restbed_ErrorHandler Server::generateErrorHandler(const ErrorHandler &callback,
+HttpErrorHandler Server::generateErrorHandler(const ErrorHandler &callback,
                                                   std::shared_ptr<Server> server) {
     return [callback, server](const int code,
                               const std::exception &exception,
-                              std::shared_ptr<restbed::Session> session) {
+                              SharedHttpSession session) {
         callback(code, exception, std::move(session), server);
     };
 }
 
-std::shared_ptr<restbed::Resource> createResource(const std::string &path,
-                                                  const std::optional<Server::GET_Handler> &getMethodHandler,
-                                                  const std::optional<Server::POST_Handler> &postMethodHandler,
-                                                  const Server::ErrorHandler &errorHandler,
-                                                  std::shared_ptr<Server> server) {
-    auto resource = std::make_shared<restbed::Resource>();
-    resource->set_path(path);
+std::shared_ptr<Resource> createResource(const std::string &path,
+                                         const std::optional<Server::GET_Handler> &getMethodHandler,
+                                         const std::optional<Server::POST_Handler> &postMethodHandler,
+                                         const Server::ErrorHandler &errorHandler,
+                                         std::shared_ptr<Server> server,
+                                         Priority priority) {
+    auto resource = std::make_shared<Resource>();
+    resource->path = path;
+    auto limiter = server->getRateLimiter(path);
     if (getMethodHandler)
-        resource->set_method_handler("GET",
-                                     Server::generateGetMethodHandler(
-                                             getMethodHandler.value(), server));
+        resource->methods["GET"] = Server::generateGetMethodHandler(
+                getMethodHandler.value(), errorHandler, server, limiter,
+                priority);
     if (postMethodHandler)
-        resource->set_method_handler("POST",
-                                     Server::generatePostMethodHandler(
-                                             postMethodHandler.value(),
-                                             server));
-    resource->set_error_handler(
-            Server::generateErrorHandler(errorHandler, server));
+        resource->methods["POST"] = Server::generatePostMethodHandler(
+                postMethodHandler.value(), errorHandler, server, limiter,
+                priority);
+    resource->errorHandler = Server::generateErrorHandler(errorHandler, server);
     return resource;
 }
 
-void Server::pushToAllSessions(std::shared_ptr<restbed::Response> response) {
-    auto lockedSessions = getSessions();
-    for (const auto &session: *(lockedSessions)) {
-        session.second->push(response);
+std::shared_ptr<Resource>
+createResource(const std::string &path,
+               const std::optional<Server::RestbedGET_Handler> &getMethodHandler,
+               const std::optional<Server::RestbedPOST_Handler> &postMethodHandler,
+               const Server::RestbedErrorHandler &errorHandler,
+               std::shared_ptr<Server> server, Priority priority) {
+    if (!server->backend->hasNativeSessions())
+        throw std::logic_error("Handlers of " + path +
+                               " take restbed sessions, use the restbed "
+                               "backend");
+    std::optional<Server::GET_Handler> get;
+    if (getMethodHandler)
+        get = [callback = *getMethodHandler](SharedHttpSession session,
+                                             std::shared_ptr<Server> server) {
+            callback(session->native(), std::move(server));
+        };
+    std::optional<Server::POST_Handler> post;
+    if (postMethodHandler)
+        post = [callback = *postMethodHandler](SharedHttpSession session,
+                                               const std::string &data,
+                                               std::shared_ptr<Server> server) {
+            callback(session->native(), data, std::move(server));
+        };
+    return createResource(
+            path, get, post,
+            [errorHandler](const int code, const std::exception &exception,
+                           SharedHttpSession session,
+                           std::shared_ptr<Server> server) {
+                errorHandler(code, exception,
+                             session == nullptr ? nullptr : session->native(),
+                             std::move(server));
+            },
+            std::move(server), priority);
+}
+
+std::shared_ptr<Resource>
+createCoroutineResource(const std::string &path,
+                        const std::optional<Server::CoroutineHandler> &getMethodHandler,
+                        const std::optional<Server::CoroutineHandler> &postMethodHandler,
+                        const Server::ErrorHandler &errorHandler,
+                        std::shared_ptr<Server> server,
+                        Priority priority) {
+    auto resource = std::make_shared<Resource>();
+    resource->path = path;
+    auto limiter = server->getRateLimiter(path);
+    if (getMethodHandler)
+        resource->methods["GET"] = Server::generateCoroutineHandler(
+                getMethodHandler.value(), errorHandler, server, limiter,
+                priority);
+    if (postMethodHandler)
+        resource->methods["POST"] = Server::generateCoroutineHandler(
+                postMethodHandler.value(), errorHandler, server, limiter,
+                priority);
+    resource->errorHandler = Server::generateErrorHandler(errorHandler, server);
+    return resource;
+}
+
+std::shared_ptr<Resource>
+createWebSocketResource(const std::string &path,
+                        const Server::WebSocketHandler &messageHandler,
+                        const Server::ErrorHandler &errorHandler,
+                        std::shared_ptr<Server> server,
+                        const std::string &limitedPath) {
+    auto resource = std::make_shared<Resource>();
+    resource->path = path;
+    resource->methods["GET"] = Server::generateWebSocketHandler(
+            messageHandler, server, server->getRateLimiter(limitedPath));
+    resource->errorHandler = Server::generateErrorHandler(errorHandler, server);
+    return resource;
+}
+
+void Server::setFanOutThreads(std::size_t threads) {
+    fanOutPool->setNumThreads(threads);
+}
+
+void Server::setCoreLoops(std::size_t count) {
+    coreLoopCount = count;
+}
+
+const CoreLoops &Server::getCoreLoops() const {
+    std::call_once(coreLoopsStarted, [this]() {
+        coreLoops = std::make_unique<CoreLoops>(coreLoopCount);
+    });
+    return *coreLoops;
+}
+
+void Server::setBroadcastListener(BroadcastListener listener) {
+    broadcastListener = std::move(listener);
+}
+
+void Server::setHandlerThreads(std::size_t threads) {
+    admission->setThreads(threads);
+}
+
+void Server::setAdmissionLimits(AdmissionLimits limits) {
+    admission->setLimits(limits);
+}
+
+std::uint64_t Server::getShedCount() const {
+    return admission->getShedCount();
+}
+
+std::chrono::microseconds Server::getAdmissionDelay() const {
+    return admission->getDelay();
+}
+
+void Server::setBlockingThreads(std::size_t threads) {
+    blockingPool->setNumThreads(threads);
+}
+
+folly::Executor::KeepAlive<> Server::getBlockingExecutor() const {
+    return folly::getKeepAliveToken(blockingPool.get());
+}
+
+void Server::setWorkerGroup(std::unique_ptr<WorkerGroup> group) {
+    workerGroup = std::move(group);
+    if (workerGroup == nullptr) return;
+    workerTag = SessionId(workerGroup->getIndex()) << SESSION_WORKER_SHIFT;
+    workerGroup->listen([this](PeerMessage &&message) {
+        switch (message.kind) {
+            case PeerMessage::USER: {
+                auto user = getUser(message.user);
+                if (user != nullptr)
+                    user->push(message.notification, message.session);
+                break;
+            }
+            case PeerMessage::BROADCAST:
+                if (peerBroadcastListener)
+                    peerBroadcastListener(*message.notification);
+                pushToLocalSessions(message.notification);
+                break;
+            case PeerMessage::ASSIGN:
+                if (getSession(message.session) != nullptr) {
+                    getOrCreateUser(message.user);
+                    assignSession(message.session, message.user);
+                }
+                break;
+            case PeerMessage::RESYNC:
+                // The clients refetch what the lost messages carried
+                if (message.user.empty()) {
+                    pushToLocalSessions(makeResyncNotification());
+                } else {
+                    auto user = getUser(message.user);
+                    if (user != nullptr) user->push(makeResyncNotification());
+                }
+                break;
+        }
+    });
+}
+
+bool Server::hasSession(SessionId session_id) const {
+    if (getSession(session_id) != nullptr) return true;
+    // Sessions of the other workers can't be checked from here
+    auto worker = (session_id & SESSION_WORKER_MASK) >> SESSION_WORKER_SHIFT;
+    return session_id != 0 && workerGroup != nullptr &&
+           (session_id & SESSION_WORKER_MASK) != workerTag &&
+           worker < workerGroup->size();
+}
+
+std::size_t Server::getWorkerIndex() const {
+    return workerGroup == nullptr ? 0 : workerGroup->getIndex();
+}
+
+void Server::setPeerBroadcastListener(PeerBroadcastListener listener) {
+    peerBroadcastListener = std::move(listener);
+}
+
+void Server::userOnline(const std::string &name) const {
+    if (workerGroup != nullptr) workerGroup->userOnline(name);
+}
+
+void Server::userOffline(const std::string &name) const {
+    if (workerGroup != nullptr) workerGroup->userOffline(name);
+}
+
+bool Server::hasUser(const std::string &name) const {
+    return getUser(name) != nullptr ||
+           (workerGroup != nullptr && workerGroup->isOnline(name));
+}
+
+void Server::pushToUser(const std::string &name,
+                        const SharedNotification &notification,
+                        SessionId origin) {
+    auto user = getUser(name);
+    if (user != nullptr) user->push(notification, origin);
+    if (workerGroup != nullptr)
+        workerGroup->sendToUser(name, *notification, origin);
+}
+
+std::shared_ptr<RateLimiter>
+Server::getRateLimiter(const std::string &path) {
+    auto found = rateLimiters.find(path);
+    if (found != rateLimiters.cend()) return found->second;
+    return rateLimiters.insert(path, std::make_shared<RateLimiter>())
+            .first->second;
+}
+
+void Server::setRateLimit(const std::string &path, RateLimit limit) {
+    getRateLimiter(path)->setLimit(limit);
+}
+
+void Server::expireRateLimits() {
+    for (const auto &[path, limiter]: rateLimiters) limiter->expire();
+}
+
+void Server::broadcast(const SharedNotification &notification,
+                       std::vector<std::shared_ptr<Session>> sessions,
+                       std::vector<std::shared_ptr<User>> users) {
+    struct Progress {
+        std::chrono::steady_clock::time_point start;
+        std::size_t recipients;
+        std::atomic<std::size_t> remaining;
+    };
+    auto batchesOf = [](std::size_t recipients) {
+        return (recipients + FAN_OUT_BATCH_SIZE - 1) / FAN_OUT_BATCH_SIZE;
+    };
+    // Users get the broadcast on their own loop, in the order the broadcasts
+    // were made, so a late batch cannot replace a newer menu with an older one
+    std::vector<std::vector<std::shared_ptr<User>>> usersByLoop(
+            getCoreLoops().size());
+    for (auto &user: users)
+        usersByLoop[user->getOwner()].push_back(std::move(user));
+    auto batches = batchesOf(sessions.size());
+    for (const auto &owned: usersByLoop) batches += batchesOf(owned.size());
+
+    auto progress = std::make_shared<Progress>();
+    progress->start = std::chrono::steady_clock::now();
+    progress->recipients = sessions.size() + users.size();
+    progress->remaining = std::max<std::size_t>(batches, 1);
+    auto finish = [this, notification, progress]() {
+        if (--progress->remaining != 0 || !broadcastListener) return;
+        broadcastListener(
+                *notification, progress->recipients,
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - progress->start));
+    };
+    if (batches == 0) {
+        finish();
+        return;
     }
+
+    for (std::size_t loop = 0; loop < usersByLoop.size(); ++loop) {
+        auto &owned = usersByLoop[loop];
+        for (std::size_t begin = 0; begin < owned.size();
+             begin += FAN_OUT_BATCH_SIZE) {
+            auto end = std::min(begin + FAN_OUT_BATCH_SIZE, owned.size());
+            std::vector<std::shared_ptr<User>> batch(
+                    std::make_move_iterator(owned.begin() + begin),
+                    std::make_move_iterator(owned.begin() + end));
+            getCoreLoops().run(loop, [this, batch = std::move(batch), notification,
+                                  finish]() {
+                for (const auto &user: batch) {
+                    try {
+                        user->deliver(notification, 0);
+                    } catch (const std::exception &) {
+                        // One recipient must not hold up the rest of the batch
+                        ++failedPushes;
+                    }
+                }
+                finish();
+            });
+        }
+    }
+
+    // Sessions without a user are pushed to in parallel and drop a broadcast
+    // that arrives after a newer one with the same key
+    auto sequence = ++broadcastSequence;
+    auto recipients =
+            std::make_shared<const std::vector<std::shared_ptr<Session>>>(
+                    std::move(sessions));
+    for (std::size_t begin = 0; begin < recipients->size();
+         begin += FAN_OUT_BATCH_SIZE) {
+        fanOutPool->add([this, recipients, begin, notification, sequence,
+                         finish]() {
+            auto end = std::min(begin + FAN_OUT_BATCH_SIZE, recipients->size());
+            for (auto i = begin; i < end; ++i) {
+                try {
+                    (*recipients)[i]->push(
+                            Delivery{0, notification, 0, 0, nullptr, sequence});
+                } catch (const std::exception &) {
+                    ++failedPushes;
+                }
+            }
+            finish();
+        });
+    }
+}
+
+std::uint64_t Server::getFailedPushCount() const {
+    return failedPushes;
+}
+
+std::uint64_t Server::getPeerDroppedCount() const {
+    return workerGroup == nullptr ? 0 : workerGroup->getDroppedCount();
+}
+
+void Server::pushToAllSessions(const SharedNotification &notification) {
+    if (workerGroup != nullptr) workerGroup->sendToAll(*notification);
+    pushToLocalSessions(notification);
+}
+
+void Server::pushToLocalSessions(const SharedNotification &notification) {
+    std::vector<std::shared_ptr<Session>> anonymous;
+    sessions.forEach([&anonymous](const std::shared_ptr<Session> &session) {
+        if (session->getUserId().empty()) anonymous.push_back(session);
+    });
+    std::vector<std::shared_ptr<User>> recipients;
+    recipients.reserve(users.size());
+    for (const auto &user: users) recipients.push_back(user.second);
+    broadcast(notification, std::move(anonymous), std::move(recipients));
+}
+
+void Server::pushToStreamingSessions(const SharedNotification &notification) {
+    std::vector<std::shared_ptr<Session>> streaming;
+    sessions.forEach([&streaming](const std::shared_ptr<Session> &session) {
+        if (session->getTransport() != Transport::LONG_POLL)
+            streaming.push_back(session);
+    });
+    broadcast(notification, std::move(streaming), {});
 }
 
 std::shared_ptr<restbed::Settings> createSettingsWithSSL(
@@ -183,6 +1091,12 @@ std::shared_ptr<restbed::Settings> createSettingsWithSSL(
             restbed::Uri("file://" + SSL_Certificate));
     ssl_settings->set_temporary_diffie_hellman(
             restbed::Uri("file://" + SSL_DHKey));
+    ssl_settings->set_sslv2_enabled(false);
+    ssl_settings->set_sslv3_enabled(false);
+    ssl_settings->set_tlsv1_enabled(false);
+    ssl_settings->set_tlsv11_enabled(false);
+    ssl_settings->set_compression_enabled(false);
+    ssl_settings->set_single_diffie_hellman_use_enabled(true);
     ssl_settings->set_port(port);
     auto settings = std::make_shared<restbed::Settings>();
     settings->set_ssl_settings(ssl_settings);
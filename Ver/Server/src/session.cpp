@@ -1,57 +1,354 @@
 #include "session.h"
 #include "server.h"
+#include "websocket.h"
 
+#include <algorithm>
 #include <string>
 
 namespace restbes {
 
-void Session::yieldFromQueue() {
-    while (!responseQueue.rlock()->empty() && is_open()) {
-        session->yield(*(responseQueue.rlock()->front()));
-        responseQueue.wlock()->pop();
+namespace {
+
+const std::string EVENT_STREAM_HEAD =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n";
+
+void append(restbed::Bytes &out, const std::string &str) {
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+std::size_t deliverySize(const Delivery &delivery) {
+    return delivery.notification->getFrame().size();
+}
+
+} // namespace
+
+void Session::scheduleDrain() {
+    unsigned int requests = drainRequests.fetch_add(1) + 1;
+    if (requests != 1) return;
+    do {
+        drain();
+        requests = drainRequests.fetch_sub(requests) - requests;
+    } while (requests != 0);
+}
+
+void Session::drain() {
+    incoming.consumeAll([this](Delivery &&delivery) {
+        if (delivery.notification == nullptr) {
+            pending.erase(std::remove_if(pending.begin(), pending.end(),
+                                         [](const Delivery &queued) {
+                                             return queued.id != 0;
+                                         }),
+                          pending.end());
+            return;
+        }
+        if (delivery.origin != 0 && delivery.origin == getId()) return;
+        if (delivery.sequence != 0 &&
+            !delivery.notification->getKey().empty()) {
+            auto &latest =
+                    broadcastSequences[delivery.notification->getKey()];
+            if (delivery.sequence < latest) return;
+            latest = delivery.sequence;
+        }
+        enqueue(std::move(delivery));
+    });
+    auto current = getAttachment();
+    auto &ss = current->session;
+    if (current->is_closed() && !closeReported) server->sessionClosed(getId());
+    enforceLimits(*current);
+    if (!current->is_open()) return;
+    // Backpressure: wait until the socket takes the previous writes
+    const auto &limits = server->getQueueLimits();
+    if (limits.maxBytes != 0 && current->unacknowledged >= limits.maxBytes)
+        return;
+
+    if (current->transport == Transport::WEB_SOCKET) {
+        drained = current;
+        for (const auto &delivery: pending) {
+            const auto &notification = delivery.notification;
+            if (notification->isComment()) {
+                current->socket->send(std::make_shared<restbed::WebSocketMessage>(
+                        restbed::WebSocketMessage::PING_FRAME));
+            } else if (delivery.id == 0) {
+                sendToSocket(current, notification->getData(),
+                             current->deflate ? notification->getDeflated()
+                                              : std::string());
+            } else {
+                auto message = delivery.message != nullptr
+                               ? delivery.message
+                               : std::make_shared<const NumberedMessage>(
+                                        delivery.id, notification);
+                sendToSocket(current, message->getData(),
+                             current->deflate ? message->getDeflated()
+                                              : std::string());
+            }
+        }
+        pending.clear();
+        return;
+    }
+
+    restbed::Bytes batch;
+    bool streamStarted = false;
+    if (current != drained) {
+        drained = current;
+        if (current->transport == Transport::EVENT_STREAM) {
+            append(batch, EVENT_STREAM_HEAD);
+            streamStarted = true;
+        }
     }
+    for (const auto &delivery: pending) {
+        const auto &notification = delivery.notification;
+        if (current->transport == Transport::EVENT_STREAM) {
+            if (delivery.id != 0)
+                append(batch, "id: " + std::to_string(delivery.id) + '\n');
+            append(batch, notification->getFrame());
+        } else if (notification->getResponse() != nullptr) {
+            notification->getResponse()->appendTo(
+                    batch, delivery.id == 0 ? "" : "Event-ID: " +
+                                                   std::to_string(delivery.id) +
+                                                   "\r\n");
+        }
+    }
+    pending.clear();
+    if (batch.empty() && !streamStarted) return;
+    auto written = trackWrite(current, batch.size());
+    auto onWritten = [written](const SharedHttpSession &) { written(); };
+    // A long-polling client sends its next request on the same connection,
+    // an event stream is only written to
+    if (current->transport == Transport::LONG_POLL)
+        ss->write(batch, onWritten);
+    else
+        ss->yield(batch, onWritten);
 }
 
-Session::Session(std::shared_ptr<restbed::Session> ss, std::string uid)
-        : session(std::move(ss)), user_id(std::move(uid)) {
+void Session::enqueue(Delivery &&delivery) {
+    const auto &key = delivery.notification->getKey();
+    if (!key.empty()) {
+        pending.erase(std::remove_if(pending.begin(), pending.end(),
+                                     [&key](const Delivery &queued) {
+                                         return queued.notification->getKey() ==
+                                                key;
+                                     }),
+                      pending.end());
+    }
+    pending.push_back(std::move(delivery));
+}
+
+bool Session::overLimits(const Attachment &current) const {
+    const auto &limits = server->getQueueLimits();
+    if (limits.maxCount != 0 && pending.size() > limits.maxCount) return true;
+    if (limits.maxBytes == 0) return false;
+    std::size_t bytes = current.unacknowledged;
+    for (const auto &delivery: pending) bytes += deliverySize(delivery);
+    return bytes > limits.maxBytes;
+}
+
+void Session::enforceLimits(const Attachment &current) {
+    if (pending.size() <= 1 || !overLimits(current)) return;
+    switch (server->getQueueLimits().policy) {
+        case OverflowPolicy::DROP_OLDEST: {
+            std::uint64_t lastDroppedId = 0;
+            while (pending.size() > 1 && overLimits(current)) {
+                lastDroppedId = std::max(lastDroppedId, pending.front().id);
+                pending.pop_front();
+                ++dropped;
+            }
+            // The client has to refetch what the lost events carried
+            if (lastDroppedId != 0)
+                pending.push_front(
+                        Delivery{lastDroppedId, makeResyncNotification()});
+            break;
+        }
+        case OverflowPolicy::COALESCE: {
+            std::uint64_t lastId = 0;
+            for (const auto &delivery: pending)
+                lastId = std::max(lastId, delivery.id);
+            dropped += pending.size();
+            pending.clear();
+            pending.push_back(Delivery{lastId, makeResyncNotification()});
+            break;
+        }
+        case OverflowPolicy::DISCONNECT:
+            dropped += pending.size();
+            pending.clear();
+            // Not numbered, so that it survives the replay after reconnect
+            pending.push_back(Delivery{0, makeResyncNotification()});
+            if (current.is_open()) {
+                if (current.transport == Transport::WEB_SOCKET)
+                    current.socket->close();
+                else
+                    current.session->close();
+            }
+            break;
+    }
+}
+
+std::function<void()>
+Session::trackWrite(const std::shared_ptr<const Attachment> &current,
+                   std::size_t size) {
+    current->unacknowledged += size;
+    return [weak = weak_from_this(),
+            weakAttachment = std::weak_ptr<const Attachment>(current), size]() {
+        auto attachment = weakAttachment.lock();
+        if (attachment == nullptr) return;
+        auto &unacknowledged = attachment->unacknowledged;
+        auto expected = unacknowledged.load();
+        while (!unacknowledged.compare_exchange_weak(
+                expected, expected - std::min(size, expected))) {
+        }
+        auto self = weak.lock();
+        if (self != nullptr && self->server->getQueueLimits().maxBytes != 0 &&
+            self->getAttachment() == attachment)
+            self->scheduleDrain();
+    };
+}
+
+void Session::sendToSocket(const std::shared_ptr<const Attachment> &current,
+                           const std::string &data,
+                           const std::string &deflated) {
+    const std::string &payload = current->deflate ? deflated : data;
+    auto message = std::make_shared<restbed::WebSocketMessage>(
+            current->binary ? restbed::WebSocketMessage::BINARY_FRAME
+                            : restbed::WebSocketMessage::TEXT_FRAME,
+            restbed::Bytes(payload.begin(), payload.end()));
+    if (current->deflate) message->set_rsv1_flag(true);
+    auto written = trackWrite(current, payload.size());
+    current->socket->send(message, [written](
+            const SharedWebSocket &) { written(); });
+}
+
+Session::Attachment::Attachment(SharedHttpSession session, Transport transport,
+                                SharedWebSocket socket, bool deflate,
+                                bool binary)
+        : session(std::move(session)), transport(transport),
+          socket(std::move(socket)), deflate(deflate), binary(binary) {}
+
+bool Session::Attachment::is_open() const {
+    if (transport == Transport::WEB_SOCKET) return socket->is_open();
+    return session->is_open();
+}
+
+bool Session::Attachment::is_closed() const {
+    if (transport == Transport::WEB_SOCKET) return socket->is_closed();
+    return session->is_closed();
+}
+
+Session::Session(SharedHttpSession ss, std::string uid,
+                 SessionId id, Server *owner, Transport transport)
+        : attachment(std::make_shared<const Attachment>(std::move(ss),
+                                                        transport)),
+          user_id(std::make_shared<const std::string>(std::move(uid))),
+          session_id(id),
+          lastActivity(std::chrono::steady_clock::now().time_since_epoch()
+                               .count()),
+          server(owner) {
 }
 
 void Session::setUser(std::string uid) {
-    *(user_id.wlock()) = std::move(uid);
+    std::atomic_store(&user_id,
+                      std::make_shared<const std::string>(std::move(uid)));
+}
+
+void Session::setSession(SharedHttpSession ss,
+                         Transport transport) {
+    std::atomic_store(&attachment,
+                      std::make_shared<const Attachment>(std::move(ss),
+                                                         transport));
+    closeReported = false;
+    lastActivity = std::chrono::steady_clock::now().time_since_epoch().count();
+    scheduleDrain();
+}
+
+void Session::setWebSocket(SharedWebSocket socket, bool deflate,
+                           bool binary) {
+    auto current = getAttachment();
+    std::atomic_store(&attachment, std::make_shared<const Attachment>(
+            current->session, Transport::WEB_SOCKET, std::move(socket), deflate,
+            binary));
+    closeReported = false;
+    lastActivity = std::chrono::steady_clock::now().time_since_epoch().count();
+    scheduleDrain();
 }
 
-void Session::setSession(std::shared_ptr<restbed::Session> ss) {
-    session = std::move(ss);
-    yieldFromQueue();
+void Session::sendMessage(const std::string &data) {
+    if (getTransport() != Transport::WEB_SOCKET) return;
+    push(makeNotification("reply", data));
+}
+
+std::shared_ptr<const Session::Attachment> Session::getAttachment() const {
+    return std::atomic_load(&attachment);
 }
 
 bool Session::is_open() const {
-    return session->is_open();
+    return getAttachment()->is_open();
 }
 
 bool Session::is_closed() const {
-    return session->is_closed();
+    return getAttachment()->is_closed();
 }
 
 std::string Session::getPath() const {
-    return session->get_request()->get_path();
+    return getSession()->get_request()->get_path();
+}
+
+void Session::push(SharedNotification notification) {
+    push(Delivery{0, std::move(notification)});
+}
+
+void Session::push(Delivery delivery) {
+    incoming.push(std::move(delivery));
+    if (server->getFlushWindow() == std::chrono::milliseconds::zero()) {
+        scheduleDrain();
+    } else if (!flushScheduled.exchange(true)) {
+        server->deferFlush(getId());
+    }
 }
 
-void Session::push(std::shared_ptr<restbed::Response> response) {
-    responseQueue.wlock()->push(response);
-    yieldFromQueue();
+void Session::flush() {
+    flushScheduled = false;
+    scheduleDrain();
 }
 
 std::string Session::getUserId() const {
-    return user_id.copy();
+    return *std::atomic_load(&user_id);
+}
+
+SharedHttpSession Session::getSession() const {
+    return getAttachment()->session;
+}
+
+Transport Session::getTransport() const {
+    return getAttachment()->transport;
+}
+
+SessionId Session::getId() const {
+    return session_id;
+}
+
+std::chrono::steady_clock::duration Session::idleFor() const {
+    return std::chrono::steady_clock::now().time_since_epoch() -
+           std::chrono::steady_clock::duration(lastActivity.load());
+}
+
+bool Session::reportClosed() {
+    if (closeReported.exchange(true)) return false;
+    lastActivity = std::chrono::steady_clock::now().time_since_epoch().count();
+    return true;
+}
+
+std::uint64_t Session::rearmExpiry() {
+    return ++expiryGeneration;
 }
 
-std::shared_ptr<restbed::Session> Session::getSession() const {
-    return session;
+bool Session::isExpiryCurrent(std::uint64_t generation) const {
+    return expiryGeneration.load() == generation;
 }
 
-[[nodiscard]] unsigned int Session::getId() const {
-    return session_id.copy();
+std::uint64_t Session::getDroppedCount() const {
+    return dropped;
 }
 
 } //restbes
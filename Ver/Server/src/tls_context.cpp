@@ -0,0 +1,155 @@
+#include "tls_context.h"
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+namespace restbes {
+
+namespace {
+
+// ECDHE first, DHE only for clients without it; AEAD ciphers only
+constexpr const char *TLS12_CIPHERS =
+        "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+        "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+        "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:"
+        "DHE-RSA-AES128-GCM-SHA256:DHE-RSA-AES256-GCM-SHA384";
+constexpr const char *TLS13_CIPHERS =
+        "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:"
+        "TLS_CHACHA20_POLY1305_SHA256";
+constexpr const unsigned char SESSION_ID_CONTEXT[] = "restbes";
+
+TicketKeys::Key generateKey() {
+    TicketKeys::Key key{};
+    if (RAND_bytes(key.name.data(), key.name.size()) != 1 ||
+        RAND_bytes(key.cipher.data(), key.cipher.size()) != 1 ||
+        RAND_bytes(key.mac.data(), key.mac.size()) != 1)
+        throw std::runtime_error("Can't generate a session ticket key");
+    return key;
+}
+
+int ticketKeysIndex() {
+    static const int index =
+            SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+// Returns 1 when the ticket is sealed or opened, 2 when it is opened with
+// the previous key and should be replaced, 0 to fall back to a handshake
+template <class Mac, class SetMacKey>
+int sealTicket(SSL *ssl, unsigned char *name, unsigned char *iv,
+               EVP_CIPHER_CTX *cipher, Mac *mac, int encrypt,
+               SetMacKey setMacKey) {
+    auto *keys = static_cast<TicketKeys *>(
+            SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ticketKeysIndex()));
+    if (keys == nullptr) return 0;
+    if (encrypt) {
+        auto key = keys->current();
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+            return -1;
+        std::memcpy(name, key.name.data(), key.name.size());
+        if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr,
+                               key.cipher.data(), iv) != 1 ||
+            !setMacKey(mac, key))
+            return -1;
+        return 1;
+    }
+    auto found = keys->find(name);
+    if (!found) return 0;
+    const auto &[key, current] = *found;
+    if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr,
+                           key.cipher.data(), iv) != 1 ||
+        !setMacKey(mac, key))
+        return -1;
+    return current ? 1 : 2;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int ticketKeyCallback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                      EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int encrypt) {
+    return sealTicket(ssl, name, iv, cipher, mac, encrypt,
+                      [](EVP_MAC_CTX *mac, const TicketKeys::Key &key) {
+        char digest[] = "SHA256";
+        OSSL_PARAM params[] = {
+                OSSL_PARAM_construct_octet_string(
+                        OSSL_MAC_PARAM_KEY,
+                        const_cast<unsigned char *>(key.mac.data()),
+                        key.mac.size()),
+                OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest,
+                                                 0),
+                OSSL_PARAM_construct_end()};
+        return EVP_MAC_CTX_set_params(mac, params) == 1;
+    });
+}
+#else
+int ticketKeyCallback(SSL *ssl, unsigned char *name, unsigned char *iv,
+                      EVP_CIPHER_CTX *cipher, HMAC_CTX *mac, int encrypt) {
+    return sealTicket(ssl, name, iv, cipher, mac, encrypt,
+                      [](HMAC_CTX *mac, const TicketKeys::Key &key) {
+        return HMAC_Init_ex(mac, key.mac.data(),
+                            static_cast<int>(key.mac.size()), EVP_sha256(),
+                            nullptr) == 1;
+    });
+}
+#endif
+
+} // namespace
+
+TicketKeys::TicketKeys() : keys{generateKey()} {}
+
+void TicketKeys::rotate() {
+    auto key = generateKey();
+    std::lock_guard lock(mutex);
+    keys.push_front(key);
+    if (keys.size() > 2) keys.pop_back();
+}
+
+TicketKeys::Key TicketKeys::current() const {
+    std::lock_guard lock(mutex);
+    return keys.front();
+}
+
+std::optional<std::pair<TicketKeys::Key, bool>>
+TicketKeys::find(const unsigned char *name) const {
+    std::lock_guard lock(mutex);
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        if (std::equal(keys[i].name.begin(), keys[i].name.end(), name))
+            return std::make_pair(keys[i], i == 0);
+    }
+    return std::nullopt;
+}
+
+void configureTls(SSL_CTX *context, TicketKeys &keys) {
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(context, SESSION_ID_CONTEXT,
+                                   sizeof(SESSION_ID_CONTEXT) - 1);
+    // A cached session lives as long as a ticket
+    SSL_CTX_set_timeout(
+            context,
+            static_cast<long>(std::chrono::seconds(2 * TICKET_KEY_ROTATION)
+                                      .count()));
+
+    SSL_CTX_set_ex_data(context, ticketKeysIndex(), &keys);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(context, ticketKeyCallback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(context, ticketKeyCallback);
+#endif
+
+    if (SSL_CTX_set_cipher_list(context, TLS12_CIPHERS) != 1 ||
+        SSL_CTX_set_ciphersuites(context, TLS13_CIPHERS) != 1)
+        throw std::runtime_error("Can't set the TLS ciphers");
+    SSL_CTX_set_options(context, SSL_OP_CIPHER_SERVER_PREFERENCE);
+}
+
+} // namespace restbes
@@ -0,0 +1,170 @@
+#include "upgrade.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace restbes {
+
+namespace {
+
+// Most sockets one handoff carries
+constexpr std::size_t MAX_HANDED_SOCKETS = 64;
+
+bool unixAddress(const std::string &path, sockaddr_un &address) {
+    address = {};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+int getOption(int fd, int option) {
+    int value = 0;
+    socklen_t length = sizeof(value);
+    if (getsockopt(fd, SOL_SOCKET, option, &value, &length) != 0) return -1;
+    return value;
+}
+
+} // namespace
+
+std::vector<int> listeningSockets() {
+    std::vector<int> sockets;
+    DIR *descriptors = opendir("/proc/self/fd");
+    if (descriptors == nullptr) return sockets;
+    while (auto entry = readdir(descriptors)) {
+        char *end;
+        long fd = std::strtol(entry->d_name, &end, 10);
+        if (*end != '\0' || end == entry->d_name || fd == dirfd(descriptors))
+            continue;
+        int domain = getOption(static_cast<int>(fd), SO_DOMAIN);
+        if ((domain == AF_INET || domain == AF_INET6) &&
+            getOption(static_cast<int>(fd), SO_ACCEPTCONN) == 1)
+            sockets.push_back(static_cast<int>(fd));
+    }
+    closedir(descriptors);
+    return sockets;
+}
+
+void stopAccepting(const std::vector<int> &sockets) {
+    for (int fd: sockets) {
+        // Listening, so accept() reports no connection instead of an error,
+        // and non-blocking like the socket it replaces. Binding just the
+        // family gives the socket a random abstract name
+        int idle = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+        sa_family_t family = AF_UNIX;
+        if (idle < 0 ||
+            bind(idle, reinterpret_cast<sockaddr *>(&family),
+                 sizeof(family)) != 0 ||
+            listen(idle, 1) != 0 || dup3(idle, fd, O_CLOEXEC) < 0) {
+            if (idle >= 0) close(idle);
+            throw std::runtime_error("Can't stop accepting on a socket");
+        }
+        close(idle);
+    }
+}
+
+std::vector<int> takeOverSockets(const std::string &path) {
+    std::vector<int> sockets;
+    sockaddr_un address;
+    if (!unixAddress(path, address))
+        throw std::invalid_argument("Bad upgrade socket path " + path);
+    int channel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (channel < 0) throw std::runtime_error("Can't open the upgrade socket");
+    if (connect(channel, reinterpret_cast<sockaddr *>(&address),
+                sizeof(address)) != 0) {
+        // Nothing runs there, start from scratch
+        close(channel);
+        return sockets;
+    }
+
+    char byte;
+    iovec data{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) *
+                                              MAX_HANDED_SOCKETS)];
+    msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received;
+    do {
+        received = recvmsg(channel, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    for (auto header = CMSG_FIRSTHDR(&message); header != nullptr;
+         header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+            continue;
+        auto count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        auto fds = reinterpret_cast<const int *>(CMSG_DATA(header));
+        sockets.insert(sockets.end(), fds, fds + count);
+    }
+    // The old process closes the connection once it has stopped accepting
+    while (received > 0 || (received < 0 && errno == EINTR))
+        received = read(channel, &byte, 1);
+    close(channel);
+    return sockets;
+}
+
+bool awaitUpgrade(const std::string &path,
+                  const std::function<void(const std::vector<int> &)> &stop) {
+    sockaddr_un address;
+    if (!unixAddress(path, address)) return false;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) return false;
+    // Left behind by the process this one took over from
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) != 0 ||
+        listen(listener, 1) != 0) {
+        close(listener);
+        return false;
+    }
+    int channel;
+    do {
+        channel = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    } while (channel < 0 && errno == EINTR);
+    close(listener);
+    if (channel < 0) return false;
+
+    auto sockets = listeningSockets();
+    if (sockets.size() > MAX_HANDED_SOCKETS) sockets.resize(MAX_HANDED_SOCKETS);
+    char byte = 0;
+    iovec data{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) *
+                                              MAX_HANDED_SOCKETS)] = {};
+    msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    if (!sockets.empty()) {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(sizeof(int) * sockets.size());
+        auto header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int) * sockets.size());
+        std::memcpy(CMSG_DATA(header), sockets.data(),
+                    sizeof(int) * sockets.size());
+    }
+    ssize_t sent;
+    do {
+        sent = sendmsg(channel, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent != 1) {
+        close(channel);
+        return false;
+    }
+    stop(sockets);
+    close(channel);
+    return true;
+}
+
+} // namespace restbes
@@ -2,49 +2,136 @@
 #include "server.h"
 #include "session.h"
 
-using namespace std::chrono_literals;
+#include <cassert>
 
 namespace restbes {
 
-User::User(std::string nm, std::shared_ptr<Server> serv) : id(std::move(nm)),
-                                                           server(std::move(
-                                                                   serv)) {}
+namespace {
 
-void User::push(std::shared_ptr<restbed::Response> response) {
-    auto lockedSessions = activeSessions.rlock(10ms);
-    if (!lockedSessions) throw std::runtime_error("Couldn't acquire lock");
-    for (auto session_id: *lockedSessions) {
+// Event ids continue to grow when a user is recreated, e.g. after a restart
+std::uint64_t firstEventId() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+User::User(std::string nm, Server *serv)
+        : server(serv), id(std::move(nm)),
+          owner(server->getCoreLoops().ownerOf(id)),
+          history(EventHistory{firstEventId(), 0, {}}),
+          idleSince(std::chrono::steady_clock::now()) {
+    history.lastId = history.firstId;
+}
+
+void User::push(const SharedNotification &notification, SessionId origin) {
+    server->getCoreLoops().run(owner, [self = shared_from_this(), notification,
+                                       origin]() {
+        self->deliver(notification, origin);
+    });
+}
+
+void User::deliver(const SharedNotification &notification,
+                   SessionId origin) {
+    assert(server->getCoreLoops().isOwnerThread(owner));
+    auto id = ++history.lastId;
+    Delivery delivery{id, notification, 0, origin,
+                      std::make_shared<const NumberedMessage>(id, notification)};
+    history.events.push_back(delivery);
+    if (history.events.size() > EVENT_HISTORY_SIZE)
+        history.events.pop_front();
+
+    for (auto session_id: activeSessions) {
         auto session = server->getSession(session_id);
-        if (session != nullptr) session->push(response);
+        if (session != nullptr) session->push(delivery);
     }
 }
 
-void User::addSession(unsigned int session_id) {
-    activeSessions.wlock()->insert(session_id);
-    server->getSession(session_id)->setUser(id.copy());
+void User::replay(const std::shared_ptr<Session> &session,
+                  std::uint64_t lastEventId) {
+    server->getCoreLoops().run(owner, [self = shared_from_this(), session,
+                                       lastEventId]() {
+        self->replayNow(session, lastEventId);
+    });
 }
 
-void User::eraseInactiveSessions() {
-    auto lockedSessions = activeSessions.wlock();
-    for (auto session_id = lockedSessions->begin();
-         session_id != lockedSessions->end();) {
-        if (server->getSession(*session_id) == nullptr) {
-            session_id = lockedSessions->erase(session_id);
-        } else {
-            ++session_id;
-        }
+void User::replayNow(const std::shared_ptr<Session> &session,
+                     std::uint64_t lastEventId) const {
+    assert(server->getCoreLoops().isOwnerThread(owner));
+    // Clients of a replaced process get resync_required too: its history is
+    // gone with it, and events raised during the handoff may have been lost
+    if (lastEventId == 0 || lastEventId >= history.lastId) return;
+    session->push(Delivery{0, nullptr, lastEventId});
+    const auto &events = history.events;
+    if (events.empty() || events.front().id > lastEventId + 1) {
+        session->push(Delivery{history.lastId, makeResyncNotification()});
+        return;
     }
+    for (const auto &event: events) {
+        if (event.id > lastEventId) session->push(event);
+    }
+}
+
+void User::requestReconnect(const std::shared_ptr<Session> &session,
+                            std::chrono::milliseconds retry) {
+    server->getCoreLoops().run(owner, [self = shared_from_this(), session,
+                                       retry]() {
+        session->push(Delivery{
+                0, makeReconnectNotification(retry, self->history.lastId)});
+    });
+}
+
+void User::addSession(SessionId session_id) {
+    // The session may have expired before it was assigned
+    auto session = server->getSession(session_id);
+    if (session == nullptr) return;
+    session->setUser(id);
+    server->getCoreLoops().run(owner, [self = shared_from_this(), session_id]() {
+        // Lost the race with eviction: the session belongs to the new user
+        if (self->evicted) {
+            self->server->getOrCreateUser(self->id)->addSession(session_id);
+            return;
+        }
+        if (self->activeSessions.empty()) {
+            self->server->userOnline(self->id);
+            self->server->unmarkUserIdle(*self);
+        }
+        self->activeSessions.insert(session_id);
+    });
+}
+
+void User::eraseSession(SessionId session_id) {
+    server->getCoreLoops().run(owner, [self = shared_from_this(), session_id]() {
+        if (self->activeSessions.erase(session_id) == 0 ||
+            !self->activeSessions.empty())
+            return;
+        self->server->userOffline(self->id);
+        self->server->markUserIdle(self);
+        self->idleSince = std::chrono::steady_clock::now();
+        self->server->scheduleUserExpiry(self->id,
+                                         self->server->getUserIdleTtl());
+    });
+}
+
+void User::evictIfIdle(std::chrono::steady_clock::duration ttl) {
+    server->getCoreLoops().run(owner, [self = shared_from_this(), ttl]() {
+        if (self->evicted || !self->activeSessions.empty()) return;
+        auto idle = std::chrono::steady_clock::now() - self->idleSince;
+        if (idle < ttl) {
+            self->server->scheduleUserExpiry(self->id, ttl - idle);
+            return;
+        }
+        self->evicted = self->server->eraseUser(self->id, self);
+        if (self->evicted) self->server->unmarkUserIdle(*self);
+    });
 }
 
-std::shared_ptr<Session>
-User::getSession(unsigned int session_id) const {
-    if (activeSessions.rlock()->count(session_id) > 0)
-        return server->getSession(session_id);
-    return nullptr;
+const std::string &User::getId() const {
+    return id;
 }
 
-std::string User::getId() const {
-    return id.copy();
+std::size_t User::getOwner() const {
+    return owner;
 }
 
 } //restbes
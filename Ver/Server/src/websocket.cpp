@@ -0,0 +1,69 @@
+#include "websocket.h"
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <zlib.h>
+
+namespace restbes {
+
+namespace {
+
+const std::string WEBSOCKET_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+const std::string DEFLATE_TAIL("\x00\x00\xff\xff", 4);
+
+} // namespace
+
+std::string webSocketAccept(const std::string &key) {
+    std::string source = key + WEBSOCKET_GUID;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char *>(source.data()), source.size(),
+         digest);
+    unsigned char encoded[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+    int length = EVP_EncodeBlock(encoded, digest, SHA_DIGEST_LENGTH);
+    return std::string(reinterpret_cast<char *>(encoded), length);
+}
+
+bool offersPerMessageDeflate(const std::string &extensions) {
+    return extensions.find("permessage-deflate") != std::string::npos;
+}
+
+std::string deflateMessage(const std::string &data) {
+    z_stream stream{};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return {};
+    std::string result(deflateBound(&stream, data.size()) + 8, '\0');
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef *>(result.data());
+    stream.avail_out = static_cast<uInt>(result.size());
+    deflate(&stream, Z_SYNC_FLUSH);
+    result.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (result.size() >= DEFLATE_TAIL.size() &&
+        result.compare(result.size() - DEFLATE_TAIL.size(),
+                       DEFLATE_TAIL.size(), DEFLATE_TAIL) == 0)
+        result.resize(result.size() - DEFLATE_TAIL.size());
+    return result;
+}
+
+std::string inflateMessage(const std::string &data) {
+    z_stream stream{};
+    if (inflateInit2(&stream, -15) != Z_OK) return {};
+    std::string input = data + DEFLATE_TAIL;
+    stream.next_in = reinterpret_cast<Bytef *>(input.data());
+    stream.avail_in = static_cast<uInt>(input.size());
+    std::string result;
+    char buffer[4096];
+    int code;
+    do {
+        stream.next_out = reinterpret_cast<Bytef *>(buffer);
+        stream.avail_out = sizeof(buffer);
+        code = inflate(&stream, Z_SYNC_FLUSH);
+        result.append(buffer, sizeof(buffer) - stream.avail_out);
+    } while (code == Z_OK && stream.avail_in > 0);
+    inflateEnd(&stream);
+    return result;
+}
+
+} // namespace restbes
@@ -0,0 +1,448 @@
+#include "worker_group.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace restbes {
+
+namespace {
+
+// Longest user id kept in the directory, including the terminating zero
+constexpr std::size_t DIRECTORY_NAME_SIZE = 48;
+// Slots tried before a user is given up on
+constexpr std::size_t DIRECTORY_PROBES = 64;
+// Hash of a slot whose name is being written, user hashes are odd
+constexpr std::uint64_t RESERVED = 2;
+// Hash of a slot freed by the last worker of its user, lookups go past it
+constexpr std::uint64_t TOMBSTONE = 4;
+// Users kept for a resync per worker, beyond it the worker resyncs everyone
+constexpr std::size_t MAX_LOST_USERS = 1024;
+// How often the receiver retries the pending resyncs when nothing arrives
+constexpr std::chrono::seconds RESYNC_RETRY(1);
+// Largest datagram the receiver accepts
+constexpr std::size_t MAX_MESSAGE_SIZE = 1 << 20;
+
+std::uint64_t hashName(const std::string &name) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c: name) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash | 1;
+}
+
+sockaddr_un channelAddress(pid_t supervisor, std::size_t worker,
+                           socklen_t &length) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    // Abstract socket: the leading zero keeps it out of the file system
+    auto name = "restbes-" + std::to_string(supervisor) + "-" +
+                std::to_string(worker);
+    std::memcpy(address.sun_path + 1, name.data(), name.size());
+    length = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + 1 +
+                                    name.size());
+    return address;
+}
+
+void appendField(std::string &out, const std::string &field) {
+    auto size = static_cast<std::uint32_t>(field.size());
+    out.append(reinterpret_cast<const char *>(&size), sizeof(size));
+    out += field;
+}
+
+bool readField(const char *&data, const char *end, std::string &field) {
+    std::uint32_t size;
+    if (static_cast<std::size_t>(end - data) < sizeof(size)) return false;
+    std::memcpy(&size, data, sizeof(size));
+    data += sizeof(size);
+    if (static_cast<std::size_t>(end - data) < size) return false;
+    field.assign(data, size);
+    data += size;
+    return true;
+}
+
+// kind, session, user, then for notifications event, key and the data up to
+// the end of the datagram
+std::string encode(PeerMessage::Kind kind, SessionId session,
+                   const std::string &user,
+                   const Notification *notification = nullptr) {
+    std::string message(1, kind);
+    message.append(reinterpret_cast<const char *>(&session), sizeof(session));
+    appendField(message, user);
+    if (notification == nullptr) return message;
+    appendField(message, notification->getEvent());
+    appendField(message, notification->getKey());
+    message += notification->getData();
+    return message;
+}
+
+bool decode(const char *data, const char *end, PeerMessage &message) {
+    if (data == end) return false;
+    message.kind = static_cast<PeerMessage::Kind>(*data++);
+    if (static_cast<std::size_t>(end - data) < sizeof(message.session))
+        return false;
+    std::memcpy(&message.session, data, sizeof(message.session));
+    data += sizeof(message.session);
+    if (!readField(data, end, message.user)) return false;
+    switch (message.kind) {
+        case PeerMessage::ASSIGN:
+            return !message.user.empty();
+        case PeerMessage::RESYNC:
+            return true;
+        case PeerMessage::USER:
+        case PeerMessage::BROADCAST: {
+            if ((message.kind == PeerMessage::USER) == message.user.empty())
+                return false;
+            std::string event, key;
+            if (!readField(data, end, event) || !readField(data, end, key))
+                return false;
+            message.notification = makeNotification(
+                    event, std::string(data, end), std::move(key));
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+// Readers don't lock: a slot is RESERVED while its name is written and is
+// checked again after the name was compared. Writers hold the mutex, which
+// is robust, so a worker that dies holding it can't block the others
+struct UserDirectory {
+    struct Entry {
+        std::atomic<std::uint64_t> hash{0};
+        std::atomic<std::uint64_t> workers{0};
+        char name[DIRECTORY_NAME_SIZE];
+    };
+
+    pthread_mutex_t mutex;
+    // Per worker, its online users that did not fit: users missing from the
+    // directory may be online on these workers
+    std::atomic<std::uint32_t> unlisted[MAX_WORKERS] = {};
+    Entry entries[USER_DIRECTORY_SIZE];
+
+    UserDirectory() {
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&mutex, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+    }
+
+    void lock() {
+        if (pthread_mutex_lock(&mutex) != EOWNERDEAD) return;
+        // The owner died in the middle of writing a name
+        for (auto &entry: entries) {
+            if (entry.hash.load(std::memory_order_relaxed) != RESERVED)
+                continue;
+            entry.workers.store(0, std::memory_order_relaxed);
+            entry.hash.store(TOMBSTONE, std::memory_order_release);
+        }
+        pthread_mutex_consistent(&mutex);
+    }
+
+    void unlock() {
+        pthread_mutex_unlock(&mutex);
+    }
+
+    Entry *find(const std::string &name) {
+        if (name.size() >= DIRECTORY_NAME_SIZE) return nullptr;
+        auto hash = hashName(name);
+        for (std::size_t probe = 0; probe < DIRECTORY_PROBES; ++probe) {
+            auto &entry = entries[(hash + probe) % USER_DIRECTORY_SIZE];
+            auto current = entry.hash.load(std::memory_order_acquire);
+            while (current == RESERVED) {
+                std::this_thread::yield();
+                current = entry.hash.load(std::memory_order_acquire);
+            }
+            if (current == 0) return nullptr;
+            if (current != hash || name != entry.name) continue;
+            // The slot may have been reused while the name was compared
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (entry.hash.load(std::memory_order_relaxed) == hash)
+                return &entry;
+        }
+        return nullptr;
+    }
+
+    // Under the lock. nullptr if the probed slots are all taken
+    Entry *add(const std::string &name) {
+        if (name.size() >= DIRECTORY_NAME_SIZE) return nullptr;
+        auto hash = hashName(name);
+        Entry *free = nullptr;
+        for (std::size_t probe = 0; probe < DIRECTORY_PROBES; ++probe) {
+            auto &entry = entries[(hash + probe) % USER_DIRECTORY_SIZE];
+            auto current = entry.hash.load(std::memory_order_relaxed);
+            if (current == hash && name == entry.name) return &entry;
+            if (current == 0 || current == TOMBSTONE) {
+                if (free == nullptr) free = &entry;
+                if (current == 0) break;
+            }
+        }
+        if (free == nullptr) return nullptr;
+        free->hash.store(RESERVED, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(free->name, name.c_str(), name.size() + 1);
+        free->workers.store(0, std::memory_order_relaxed);
+        free->hash.store(hash, std::memory_order_release);
+        return free;
+    }
+
+    // Under the lock, frees the slot once no worker has the user
+    void remove(Entry &entry, std::uint64_t workers) {
+        if ((entry.workers.fetch_and(~workers, std::memory_order_acq_rel) &
+             ~workers) == 0)
+            entry.hash.store(TOMBSTONE, std::memory_order_release);
+    }
+
+    // Under the lock, for a worker that stopped
+    void removeWorker(std::size_t worker) {
+        for (auto &entry: entries) {
+            auto hash = entry.hash.load(std::memory_order_relaxed);
+            if (hash & 1) remove(entry, 1ull << worker);
+        }
+        unlisted[worker].store(0, std::memory_order_relaxed);
+    }
+
+    std::uint64_t workersOf(const std::string &name) {
+        auto entry = find(name);
+        if (entry != nullptr)
+            return entry->workers.load(std::memory_order_acquire);
+        std::uint64_t workers = 0;
+        for (std::size_t worker = 0; worker < MAX_WORKERS; ++worker) {
+            if (unlisted[worker].load(std::memory_order_relaxed) != 0)
+                workers |= 1ull << worker;
+        }
+        return workers;
+    }
+};
+
+WorkerGroup::WorkerGroup(std::size_t index, std::size_t count,
+                         pid_t supervisor, UserDirectory *directory)
+        : index(index), count(count), supervisor(supervisor),
+          directory(directory), channel(socket(AF_UNIX, SOCK_DGRAM, 0)),
+          lost(count) {
+    socklen_t length;
+    auto address = channelAddress(supervisor, index, length);
+    if (channel < 0 ||
+        bind(channel, reinterpret_cast<sockaddr *>(&address), length) != 0)
+        throw std::runtime_error("Can't open the worker channel");
+    // Wakes the receiver to retry the pending resyncs
+    timeval timeout{RESYNC_RETRY.count(), 0};
+    setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+std::unique_ptr<WorkerGroup> WorkerGroup::start(std::size_t count) {
+    if (count <= 1) return nullptr;
+    if (count > MAX_WORKERS)
+        throw std::invalid_argument("Too many worker processes");
+
+    void *memory = mmap(nullptr, sizeof(UserDirectory),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::runtime_error("Can't map the user directory");
+    auto directory = new (memory) UserDirectory();
+    pid_t supervisor = getpid();
+
+    std::vector<pid_t> workers(count, 0);
+    auto spawn = [&](std::size_t worker) -> bool {
+        pid_t pid = fork();
+        if (pid < 0) throw std::runtime_error("Can't fork a worker");
+        if (pid > 0) {
+            workers[worker] = pid;
+            return false;
+        }
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != supervisor) std::_Exit(EXIT_FAILURE);
+        return true;
+    };
+
+    for (std::size_t worker = 0; worker < count; ++worker) {
+        if (spawn(worker))
+            return std::unique_ptr<WorkerGroup>(
+                    new WorkerGroup(worker, count, supervisor, directory));
+    }
+
+    std::size_t running = count;
+    while (running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        std::size_t worker = 0;
+        while (worker < count && workers[worker] != pid) ++worker;
+        if (worker == count) continue;
+        // Its sessions are gone, the clients reconnect to the other workers
+        {
+            std::lock_guard lock(*directory);
+            directory->removeWorker(worker);
+        }
+        bool crashed = WIFSIGNALED(status) && WTERMSIG(status) != SIGTERM &&
+                       WTERMSIG(status) != SIGINT &&
+                       WTERMSIG(status) != SIGKILL;
+        if (!crashed) {
+            --running;
+            continue;
+        }
+        // Messages to the worker fail until the replacement binds the channel
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        if (spawn(worker))
+            return std::unique_ptr<WorkerGroup>(
+                    new WorkerGroup(worker, count, supervisor, directory));
+    }
+    std::exit(EXIT_SUCCESS);
+}
+
+WorkerGroup::~WorkerGroup() {
+    shutdown(channel, SHUT_RDWR);
+    if (receiver.joinable()) receiver.join();
+    close(channel);
+}
+
+std::size_t WorkerGroup::getIndex() const {
+    return index;
+}
+
+std::size_t WorkerGroup::size() const {
+    return count;
+}
+
+void WorkerGroup::userOnline(const std::string &user) {
+    std::lock_guard lock(*directory);
+    auto entry = directory->add(user);
+    if (entry != nullptr) {
+        entry->workers.fetch_or(1ull << index, std::memory_order_acq_rel);
+        return;
+    }
+    std::lock_guard unlistedLock(unlistedMutex);
+    if (unlisted.insert(user).second)
+        directory->unlisted[index].fetch_add(1, std::memory_order_relaxed);
+}
+
+void WorkerGroup::userOffline(const std::string &user) {
+    std::lock_guard lock(*directory);
+    auto entry = directory->find(user);
+    if (entry != nullptr) {
+        directory->remove(*entry, 1ull << index);
+        return;
+    }
+    std::lock_guard unlistedLock(unlistedMutex);
+    if (unlisted.erase(user) != 0)
+        directory->unlisted[index].fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool WorkerGroup::isOnline(const std::string &user) const {
+    return directory->workersOf(user) != 0;
+}
+
+bool WorkerGroup::send(std::size_t worker, const std::string &message) const {
+    socklen_t length;
+    auto address = channelAddress(supervisor, worker, length);
+    // Fails when the peer's queue is full or it is restarting
+    return sendto(channel, message.data(), message.size(), MSG_DONTWAIT,
+                  reinterpret_cast<sockaddr *>(&address), length) >= 0;
+}
+
+void WorkerGroup::markLost(std::size_t worker, const std::string &user) const {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard lock(lostMutex);
+    auto &users = lost[worker];
+    if (users.count("") != 0) return;
+    if (user.empty() || users.size() >= MAX_LOST_USERS) {
+        users.clear();
+        users.insert("");
+    } else {
+        users.insert(user);
+    }
+    anyLost.store(true, std::memory_order_release);
+}
+
+void WorkerGroup::resyncLost() const {
+    if (!anyLost.load(std::memory_order_acquire)) return;
+    std::lock_guard lock(lostMutex);
+    bool remaining = false;
+    for (std::size_t worker = 0; worker < count; ++worker) {
+        auto &users = lost[worker];
+        for (auto it = users.begin(); it != users.end();) {
+            if (!send(worker, encode(PeerMessage::RESYNC, 0, *it))) {
+                // Still not taking messages, tried again later
+                remaining = true;
+                break;
+            }
+            it = users.erase(it);
+        }
+    }
+    anyLost.store(remaining, std::memory_order_release);
+}
+
+void WorkerGroup::sendToUser(const std::string &user,
+                             const Notification &notification,
+                             SessionId origin) const {
+    auto workers = directory->workersOf(user) & ~(1ull << index);
+    if (workers == 0) return;
+    auto message = encode(PeerMessage::USER, origin, user, &notification);
+    for (std::size_t worker = 0; worker < count; ++worker) {
+        if ((workers & (1ull << worker)) && !send(worker, message))
+            markLost(worker, user);
+    }
+}
+
+void WorkerGroup::sendToAll(const Notification &notification) const {
+    auto message = encode(PeerMessage::BROADCAST, 0, "", &notification);
+    for (std::size_t worker = 0; worker < count; ++worker) {
+        if (worker != index && !send(worker, message)) markLost(worker, "");
+    }
+}
+
+void WorkerGroup::assignSession(std::size_t worker, SessionId session,
+                                const std::string &user) const {
+    // The client signs in again if its session stays unassigned
+    if (!send(worker, encode(PeerMessage::ASSIGN, session, user)))
+        dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::uint64_t WorkerGroup::getDroppedCount() const {
+    return dropped.load(std::memory_order_relaxed);
+}
+
+void WorkerGroup::listen(Receiver callback) {
+    receiver = std::thread([this, callback = std::move(callback)]() {
+        std::vector<char> buffer(MAX_MESSAGE_SIZE);
+        while (true) {
+            resyncLost();
+            auto size = recv(channel, buffer.data(), buffer.size(), 0);
+            if (size < 0 && (errno == EINTR || errno == EAGAIN ||
+                             errno == EWOULDBLOCK))
+                continue;
+            if (size <= 0) return;
+            PeerMessage message;
+            if (decode(buffer.data(), buffer.data() + size, message))
+                callback(std::move(message));
+        }
+    });
+}
+
+} // namespace restbes
@@ -0,0 +1,84 @@
+#include "mpsc_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using restbes::MpscQueue;
+
+TEST(MpscQueueTest, ConsumesInPushOrder) {
+    MpscQueue<int> queue;
+    EXPECT_TRUE(queue.empty());
+    for (int i = 0; i < 5; ++i) queue.push(i);
+    EXPECT_FALSE(queue.empty());
+    std::vector<int> consumed;
+    queue.consumeAll([&consumed](int &&value) { consumed.push_back(value); });
+    EXPECT_EQ(consumed, (std::vector<int>{0, 1, 2, 3, 4}));
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST(MpscQueueTest, ConsumeOfEmptyQueueDoesNothing) {
+    MpscQueue<int> queue;
+    int calls = 0;
+    queue.consumeAll([&calls](int &&) { ++calls; });
+    EXPECT_EQ(calls, 0);
+}
+
+TEST(MpscQueueTest, MovesValues) {
+    MpscQueue<std::unique_ptr<int>> queue;
+    queue.push(std::make_unique<int>(42));
+    int value = 0;
+    queue.consumeAll([&value](std::unique_ptr<int> &&pointer) {
+        value = *pointer;
+    });
+    EXPECT_EQ(value, 42);
+}
+
+TEST(MpscQueueTest, DestructorFreesPendingValues) {
+    auto shared = std::make_shared<int>(1);
+    {
+        MpscQueue<std::shared_ptr<int>> queue;
+        queue.push(shared);
+        queue.push(shared);
+        EXPECT_EQ(shared.use_count(), 3);
+    }
+    EXPECT_EQ(shared.use_count(), 1);
+}
+
+TEST(MpscQueueTest, KeepsOrderOfEachProducer) {
+    constexpr int PRODUCERS = 4;
+    constexpr int PER_PRODUCER = 20000;
+    struct Item {
+        int producer;
+        int sequence;
+    };
+    MpscQueue<Item> queue;
+    std::atomic<int> finished{0};
+    std::vector<std::thread> producers;
+    for (int p = 0; p < PRODUCERS; ++p) {
+        producers.emplace_back([&queue, &finished, p]() {
+            for (int i = 0; i < PER_PRODUCER; ++i) queue.push({p, i});
+            ++finished;
+        });
+    }
+    std::vector<int> next(PRODUCERS, 0);
+    bool ordered = true;
+    auto consume = [&]() {
+        queue.consumeAll([&](Item &&item) {
+            if (item.sequence != next[item.producer]) ordered = false;
+            next[item.producer] = item.sequence + 1;
+        });
+    };
+    while (finished != PRODUCERS) consume();
+    for (auto &producer: producers) producer.join();
+    consume();
+    EXPECT_TRUE(ordered);
+    for (int p = 0; p < PRODUCERS; ++p) EXPECT_EQ(next[p], PER_PRODUCER);
+}
+
+} // namespace
@@ -0,0 +1,141 @@
+#include "slot_map.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using restbes::SlotMap;
+
+struct Item {
+    SlotMap<Item>::Id id;
+};
+
+SlotMap<Item>::Id add(SlotMap<Item> &map) {
+    return map.emplace([](SlotMap<Item>::Id id) {
+        return std::make_shared<Item>(Item{id});
+    });
+}
+
+TEST(SlotMapTest, FindsWhatWasEmplaced) {
+    SlotMap<Item> map;
+    auto first = add(map);
+    auto second = add(map);
+    ASSERT_NE(first, 0u);
+    ASSERT_NE(second, 0u);
+    EXPECT_NE(first, second);
+    EXPECT_EQ(map.find(first)->id, first);
+    EXPECT_EQ(map.find(second)->id, second);
+    EXPECT_EQ(map.size(), 2u);
+}
+
+TEST(SlotMapTest, RejectsErasedIds) {
+    SlotMap<Item> map;
+    auto id = add(map);
+    EXPECT_TRUE(map.erase(id));
+    EXPECT_EQ(map.find(id), nullptr);
+    EXPECT_FALSE(map.erase(id));
+    EXPECT_EQ(map.size(), 0u);
+}
+
+TEST(SlotMapTest, ReusesSlotsWithNewGeneration) {
+    SlotMap<Item> map;
+    auto old = add(map);
+    map.erase(old);
+    auto reused = add(map);
+    EXPECT_EQ(static_cast<std::uint32_t>(reused),
+              static_cast<std::uint32_t>(old));
+    EXPECT_NE(reused, old);
+    EXPECT_EQ(map.find(old), nullptr);
+    EXPECT_FALSE(map.erase(old));
+    EXPECT_EQ(map.find(reused)->id, reused);
+}
+
+TEST(SlotMapTest, RejectsIdsOfUnallocatedSlots) {
+    SlotMap<Item> map;
+    add(map);
+    EXPECT_EQ(map.find(0), nullptr);
+    EXPECT_EQ(map.find(~SlotMap<Item>::Id(0)), nullptr);
+    EXPECT_EQ(map.find(SlotMap<Item>::Id(1) << 32 | 5000), nullptr);
+}
+
+TEST(SlotMapTest, StartsAtGivenGeneration) {
+    SlotMap<Item> map(7);
+    auto id = add(map);
+    EXPECT_EQ(id >> 32, 7u);
+    SlotMap<Item> other(8);
+    EXPECT_EQ(other.find(id), nullptr);
+}
+
+TEST(SlotMapTest, GrowsPastOneChunk) {
+    SlotMap<Item> map;
+    std::vector<SlotMap<Item>::Id> ids;
+    for (std::size_t i = 0; i < SlotMap<Item>::CHUNK_SIZE + 10; ++i)
+        ids.push_back(add(map));
+    for (auto id: ids) ASSERT_EQ(map.find(id)->id, id);
+    std::size_t visited = 0;
+    map.forEach([&visited](const std::shared_ptr<Item> &) { ++visited; });
+    EXPECT_EQ(visited, ids.size());
+}
+
+TEST(SlotMapTest, ConcurrentFindNeverSeesAnotherGeneration) {
+    SlotMap<Item> map;
+    std::vector<SlotMap<Item>::Id> initial;
+    for (int i = 0; i < 64; ++i) initial.push_back(add(map));
+
+    std::atomic<bool> stop{false};
+    std::atomic<std::size_t> mismatches{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&]() {
+            while (!stop) {
+                for (auto id: initial) {
+                    auto found = map.find(id);
+                    if (found != nullptr && found->id != id) ++mismatches;
+                }
+            }
+        });
+    }
+    // Churns the same slots, every id in initial goes stale
+    for (int round = 0; round < 2000; ++round) {
+        std::vector<SlotMap<Item>::Id> ids;
+        for (int i = 0; i < 64; ++i) ids.push_back(add(map));
+        for (auto id: ids) map.erase(id);
+        if (round == 0)
+            for (auto id: initial) map.erase(id);
+    }
+    stop = true;
+    for (auto &reader: readers) reader.join();
+    EXPECT_EQ(mismatches, 0u);
+    for (auto id: initial) EXPECT_EQ(map.find(id), nullptr);
+    EXPECT_EQ(map.size(), 0u);
+}
+
+TEST(SlotMapTest, ConcurrentEmplaceAndErase) {
+    SlotMap<Item> map;
+    std::vector<std::thread> writers;
+    std::atomic<std::size_t> failures{0};
+    for (int t = 0; t < 8; ++t) {
+        writers.emplace_back([&]() {
+            for (int i = 0; i < 5000; ++i) {
+                auto id = add(map);
+                auto found = map.find(id);
+                if (found == nullptr || found->id != id) ++failures;
+                if (i % 2 == 1 && !map.erase(id)) ++failures;
+            }
+        });
+    }
+    for (auto &writer: writers) writer.join();
+    EXPECT_EQ(failures, 0u);
+    EXPECT_EQ(map.size(), 8u * 2500);
+    std::size_t visited = 0;
+    map.forEach([&visited](const std::shared_ptr<Item> &) { ++visited; });
+    EXPECT_EQ(visited, map.size());
+}
+
+} // namespace
@@ -0,0 +1,132 @@
+#include "timer_wheel.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <vector>
+
+namespace {
+
+// Steady clock moved by hand
+struct FakeClock {
+    using duration = std::chrono::milliseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<FakeClock>;
+    static constexpr bool is_steady = true;
+
+    static inline time_point current{};
+
+    static time_point now() {
+        return current;
+    }
+
+    static void advance(duration by) {
+        current += by;
+    }
+};
+
+using namespace std::chrono_literals;
+using Wheel = restbes::TimerWheel<int, FakeClock>;
+
+struct TimerWheelTest : testing::Test {
+    std::vector<int> fired;
+
+    void SetUp() override {
+        FakeClock::current = FakeClock::time_point{};
+    }
+
+    // Moves the clock in steps of one tick, like the periodic caller does
+    void run(Wheel &wheel, int ticks, FakeClock::duration tick) {
+        for (int i = 0; i < ticks; ++i) {
+            FakeClock::advance(tick);
+            wheel.advance([this](int key) { fired.push_back(key); });
+        }
+    }
+};
+
+TEST_F(TimerWheelTest, FiresAfterDelay) {
+    Wheel wheel(8, 10ms);
+    wheel.schedule(1, 30ms);
+    run(wheel, 2, 10ms);
+    EXPECT_TRUE(fired.empty());
+    run(wheel, 1, 10ms);
+    EXPECT_EQ(fired, std::vector<int>{1});
+    run(wheel, 16, 10ms);
+    EXPECT_EQ(fired, std::vector<int>{1});
+}
+
+TEST_F(TimerWheelTest, RoundsUpToWholeTicks) {
+    Wheel wheel(8, 10ms);
+    wheel.schedule(1, 21ms);
+    run(wheel, 2, 10ms);
+    EXPECT_TRUE(fired.empty());
+    run(wheel, 1, 10ms);
+    EXPECT_EQ(fired, std::vector<int>{1});
+}
+
+TEST_F(TimerWheelTest, ZeroDelayWaitsOneTick) {
+    Wheel wheel(8, 10ms);
+    wheel.schedule(1, 0ms);
+    wheel.advance([this](int key) { fired.push_back(key); });
+    EXPECT_TRUE(fired.empty());
+    run(wheel, 1, 10ms);
+    EXPECT_EQ(fired, std::vector<int>{1});
+}
+
+TEST_F(TimerWheelTest, DelayOfExactlyOneRevolution) {
+    Wheel wheel(8, 10ms);
+    wheel.schedule(1, 80ms);
+    run(wheel, 7, 10ms);
+    EXPECT_TRUE(fired.empty());
+    run(wheel, 1, 10ms);
+    EXPECT_EQ(fired, std::vector<int>{1});
+}
+
+TEST_F(TimerWheelTest, LongDelaysWaitExtraRounds) {
+    Wheel wheel(8, 10ms);
+    // Same slot as a 30ms timer, two revolutions later
+    wheel.schedule(1, 190ms);
+    wheel.schedule(2, 30ms);
+    run(wheel, 3, 10ms);
+    EXPECT_EQ(fired, std::vector<int>{2});
+    run(wheel, 15, 10ms);
+    EXPECT_EQ(fired, std::vector<int>{2});
+    run(wheel, 1, 10ms);
+    EXPECT_EQ(fired, (std::vector<int>{2, 1}));
+}
+
+TEST_F(TimerWheelTest, CatchesUpAfterLateAdvance) {
+    Wheel wheel(8, 10ms);
+    wheel.schedule(1, 20ms);
+    wheel.schedule(2, 100ms);
+    wheel.schedule(3, 200ms);
+    FakeClock::advance(105ms);
+    wheel.advance([this](int key) { fired.push_back(key); });
+    EXPECT_EQ(fired, (std::vector<int>{1, 2}));
+    run(wheel, 10, 10ms);
+    EXPECT_EQ(fired, (std::vector<int>{1, 2, 3}));
+}
+
+TEST_F(TimerWheelTest, PlacesRelativeToWheelTime) {
+    Wheel wheel(8, 10ms);
+    // The wheel is at 0, the clock is already 5ms into the first tick
+    FakeClock::advance(5ms);
+    wheel.schedule(1, 10ms);
+    wheel.advance([this](int key) { fired.push_back(key); });
+    FakeClock::advance(5ms);
+    wheel.advance([this](int key) { fired.push_back(key); });
+    EXPECT_TRUE(fired.empty());
+    FakeClock::advance(10ms);
+    wheel.advance([this](int key) { fired.push_back(key); });
+    EXPECT_EQ(fired, std::vector<int>{1});
+}
+
+TEST_F(TimerWheelTest, KeepsScheduleOrderWithinSlot) {
+    Wheel wheel(4, 10ms);
+    for (int key = 0; key < 5; ++key) wheel.schedule(key, 20ms);
+    run(wheel, 2, 10ms);
+    EXPECT_EQ(fired, (std::vector<int>{0, 1, 2, 3, 4}));
+}
+
+} // namespace